@@ -0,0 +1,115 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#include <heist/arena.h>
+#include <unordered_set>
+#include <assert.h>
+#include <stdint.h>
+
+
+namespace heist {
+    namespace impl {
+        thread_local region* current_region = NULL;
+
+        namespace {
+            const size_t MIN_CHUNK = 65536;
+            const size_t MAX_CHUNK = 1048576;
+            /*!
+             * Chunks are made of whole granules, so a pointer's granule says whether
+             * it's in one.
+             */
+            const size_t GRANULE = 4096;
+
+            /*!
+             * The granules of every chunk of the regions on this thread, which are
+             * all nested in each other.
+             */
+            thread_local std::unordered_set<uintptr_t> granules;
+        }
+
+        struct chunk {
+            chunk* next;
+            char* begin;
+            char* end;
+        };
+
+        struct finalizer {
+            void (*fn)(void*);
+            void* obj;
+            finalizer* next;
+        };
+
+        region::region()
+            : next(NULL), end(NULL), chunks(NULL), finalizers(NULL),
+              outer(current_region), suspended(false)
+        {
+            current_region = this;
+        }
+
+        region::~region()
+        {
+            assert(current_region == this);
+            // Still current, so that frees of this region's blocks from the
+            // finalizers are recognized and ignored.
+            while (finalizers != NULL) {
+                finalizer* f = finalizers;
+                finalizers = f->next;
+                f->fn(f->obj);
+            }
+            current_region = outer;
+            while (chunks != NULL) {
+                chunk* c = chunks;
+                chunks = c->next;
+                for (uintptr_t g = (uintptr_t)c->begin / GRANULE; g < (uintptr_t)c->end / GRANULE; g++)
+                    granules.erase(g);
+                ::operator delete(c);
+            }
+        }
+
+        void* region::allocate_chunk(size_t size)
+        {
+            size_t header = (sizeof(chunk) + 15) & ~(size_t)15;
+            size_t capacity = chunks == NULL ? MIN_CHUNK
+                                             : (size_t)(chunks->end - chunks->begin) * 2;
+            if (capacity > MAX_CHUNK) capacity = MAX_CHUNK;
+            if (capacity < size) capacity = size;
+            capacity = (capacity + GRANULE - 1) & ~(GRANULE - 1);
+            // The header goes at the start of the block and the chunk starts at the
+            // next granule boundary after it.
+            chunk* c = (chunk*)::operator new(header + capacity + GRANULE - 1);
+            c->begin = (char*)(((uintptr_t)c + header + GRANULE - 1) & ~(uintptr_t)(GRANULE - 1));
+            c->end = c->begin + capacity;
+            for (uintptr_t g = (uintptr_t)c->begin / GRANULE; g < (uintptr_t)c->end / GRANULE; g++)
+                granules.insert(g);
+            c->next = chunks;
+            chunks = c;
+            next = c->begin + size;
+            end = c->end;
+            return c->begin;
+        }
+
+        bool region::owns(const void* p) const
+        {
+            return granules.count((uintptr_t)p / GRANULE) != 0;
+        }
+
+        void region::finalize_with(void (*fn)(void*), void* obj)
+        {
+            finalizer* f = (finalizer*)allocate(sizeof(finalizer));
+            f->fn = fn;
+            f->obj = obj;
+            f->next = finalizers;
+            finalizers = f;
+        }
+    }
+
+    arena::arena()
+    {
+    }
+
+    arena::~arena()
+    {
+    }
+}
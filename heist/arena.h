@@ -0,0 +1,49 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_ARENA_H_
+#define _HEIST_ARENA_H_
+
+#include <heist/node_pool.h>
+
+namespace heist {
+    /*!
+     * Region allocation for short-lived versions.  While an arena is alive, the
+     * nodes of every heist data structure built on this thread are bump-allocated
+     * from it, and aren't reference counted.  They are all finalized and released
+     * at once when the arena is destroyed, so building lots of temporary versions
+     * costs little more than the memory they touch.
+     *
+     *     heist::map<int, std::string> result;
+     *     {
+     *         heist::arena a;
+     *         heist::map<int, std::string> scratch = ...;
+     *         // ... build and throw away many versions of scratch ...
+     *         result = scratch.promote();  // copy out the nodes that escape
+     *     }
+     *
+     * The rules:
+     *
+     *  - Anything holding nodes from the arena must be destroyed or promoted before
+     *    the arena is, and mustn't be passed to another thread.  promote() copies the
+     *    arena's nodes to the heap, sharing any nodes that were already there.  It
+     *    copies elements with their copy constructors, so containers nested inside
+     *    elements must be promoted separately.
+     *
+     *  - Arenas nest, and must be destroyed in reverse order on the thread that
+     *    created them.
+     */
+    class arena {
+        public:
+            arena();
+            ~arena();
+        private:
+            arena(const arena&) = delete;
+            arena& operator = (const arena&) = delete;
+            impl::region r;
+    };
+}
+
+#endif
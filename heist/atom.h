@@ -0,0 +1,269 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_ATOM_H_
+#define _HEIST_ATOM_H_
+
+#include <heist/lock_pool.h>
+#include <heist/node_pool.h>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <assert.h>
+#include <stdint.h>
+
+// atom packs a pointer into 48 bits on 64-bit platforms.  Where pointers may
+// carry tags in their high bits, or the platform isn't known to keep them below
+// 2^48, it takes a lock around the pointer instead.
+#if !defined(HEIST_ATOM_LOCKED)
+#if defined(__has_feature)
+#if __has_feature(hwaddress_sanitizer)
+#define HEIST_ATOM_LOCKED
+#endif
+#endif
+#if defined(__SANITIZE_HWADDRESS__) || defined(__ARM_FEATURE_MEMORY_TAGGING) || \
+    (defined(__ANDROID__) && defined(__aarch64__)) || \
+    (UINTPTR_MAX > 0xffffffffu && !defined(__x86_64__) && !defined(_M_X64) && \
+     !defined(__aarch64__) && !defined(_M_ARM64))
+#define HEIST_ATOM_LOCKED
+#endif
+#endif
+
+namespace heist {
+    namespace impl {
+        /*!
+         * A published version of an atom's value.
+         */
+        template <class T>
+        struct atom_box : pooled {
+            explicit atom_box(const T& value) : ref_count(0), value(value) {}
+            explicit atom_box(T&& value) : ref_count(0), value(std::move(value)) {}
+            std::atomic<intptr_t> ref_count;
+            const T value;
+        };
+
+        template <class T>
+        void intrusive_ptr_add_ref(atom_box<T>* p)
+        {
+            p->ref_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        template <class T>
+        void intrusive_ptr_release(atom_box<T>* p)
+        {
+            if (p->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete p;
+        }
+
+        /*!
+         * Adjust a box's count by delta, freeing it if that leaves it at zero.
+         */
+        template <class T>
+        void atom_box_adjust(atom_box<T>* p, intptr_t delta)
+        {
+            if (p->ref_count.fetch_add(delta, std::memory_order_acq_rel) == -delta)
+                delete p;
+        }
+    }
+
+    /*!
+     * A mutable reference to an immutable value, for publishing new versions of a
+     * data structure from writers to readers on other threads.
+     *
+     * load() takes a snapshot of the current version without locking or copying the
+     * value, so readers never block each other or writers.  store() publishes a new
+     * version.  swap(f) and compare_and_set() update it atomically, with swap
+     * retrying if another writer got in first.  A version is freed when the atom
+     * and every snapshot of it have let go of it.
+     *
+     * It uses split reference counting: The pointer to the current version is packed
+     * into one word with a count of the readers that are part way through loading
+     * it.  A reader increments that count, takes a reference in the version itself,
+     * and then gives the first back.  A writer that replaces the version transfers
+     * the outstanding count to the old version, so its readers can still finish.
+     * This needs pointers to fit in 48 bits on 64-bit platforms, which is checked
+     * in debug builds.  Where that isn't guaranteed, HEIST_ATOM_LOCKED is defined
+     * and load() and the writers take a lock from the lock pool instead.
+     */
+    template <class T>
+    class atom
+    {
+        private:
+            typedef impl::atom_box<T> box;
+            static const int PTR_BITS = sizeof(void*) == 8 ? 48 : 32;
+            static const uint64_t PTR_MASK = ((uint64_t)1 << PTR_BITS) - 1;
+            static const uint64_t READER = (uint64_t)1 << PTR_BITS;
+
+            mutable std::atomic<uint64_t> current;   // The published box, and the readers part way through loading it
+
+            static box* box_of(uint64_t w) { return reinterpret_cast<box*>((uintptr_t)(w & PTR_MASK)); }
+            static intptr_t readers_of(uint64_t w) { return (intptr_t)(w >> PTR_BITS); }
+            static uint64_t word_of(box* b) {
+                assert(((uintptr_t)b & ~PTR_MASK) == 0);
+                return (uint64_t)(uintptr_t)b;
+            }
+
+            /*!
+             * Publish b, which the caller holds a reference to, and let go of the
+             * version it replaces.
+             */
+            void publish(box* b) {
+                b->ref_count.fetch_add(1, std::memory_order_relaxed);
+#if defined(HEIST_ATOM_LOCKED)
+                impl::spin_lock* l = impl::spin_get_and_lock(this);
+                uint64_t old = current.exchange(word_of(b), std::memory_order_acq_rel);
+                l->unlock();
+#else
+                uint64_t old = current.exchange(word_of(b), std::memory_order_acq_rel);
+#endif
+                retire(old);
+            }
+
+            /*!
+             * The atom no longer refers to the box in w.  Its readers that haven't
+             * finished loading it each own one of its references.
+             */
+            static void retire(uint64_t w) {
+                impl::atom_box_adjust(box_of(w), readers_of(w) - 1);
+            }
+
+        public:
+            /*!
+             * A reference to one version of an atom's value.  Copying it is one atomic
+             * increment.
+             */
+            class snapshot {
+                friend class atom<T>;
+                private:
+                    boost::intrusive_ptr<box> b;
+                    explicit snapshot(box* b, bool add_ref) : b(b, add_ref) {}
+
+                public:
+                    const T& get() const { return b->value; }
+                    const T& operator * () const { return b->value; }
+                    const T* operator -> () const { return &b->value; }
+                    /*!
+                     * True if they're snapshots of the same version.
+                     */
+                    bool operator == (const snapshot& other) const { return b == other.b; }
+                    bool operator != (const snapshot& other) const { return b != other.b; }
+            };
+
+            explicit atom(const T& value = T()) : current(word_of(new box(value))) {
+                box_of(current.load(std::memory_order_relaxed))->ref_count.store(1, std::memory_order_relaxed);
+            }
+            ~atom() {
+                retire(current.load(std::memory_order_acquire));
+            }
+
+            /*!
+             * The current version.  Lock-free.
+             */
+            snapshot load() const {
+#if defined(HEIST_ATOM_LOCKED)
+                impl::spin_lock* l = impl::spin_get_and_lock(const_cast<atom*>(this));
+                box* b = box_of(current.load(std::memory_order_relaxed));
+                b->ref_count.fetch_add(1, std::memory_order_relaxed);
+                l->unlock();
+                return snapshot(b, false);
+#else
+                uint64_t w = current.load(std::memory_order_acquire);
+                while (!current.compare_exchange_weak(w, w + READER, std::memory_order_acq_rel))
+                    ;
+                box* b = box_of(w);
+                // While we're counted in current, b can't be freed.
+                b->ref_count.fetch_add(1, std::memory_order_relaxed);
+                uint64_t now = w + READER;
+                while (true) {
+                    if (box_of(now) != b) {
+                        // A writer replaced it, and turned our count into a reference.
+                        impl::atom_box_adjust(b, -1);
+                        break;
+                    }
+                    if (current.compare_exchange_weak(now, now - READER, std::memory_order_acq_rel))
+                        break;
+                }
+                return snapshot(b, false);
+#endif
+            }
+
+            /*!
+             * Replace the value.
+             */
+            void store(const T& value) {
+                snapshot s(new box(value), true);
+                publish(s.b.get());
+            }
+
+            void store(T&& value) {
+                snapshot s(new box(std::move(value)), true);
+                publish(s.b.get());
+            }
+
+            /*!
+             * Replace the value with desired if expected is still the current version.
+             * Returns true if it was replaced.
+             */
+            bool compare_and_set(const snapshot& expected, const T& desired) {
+                snapshot s(new box(desired), true);
+                return compare_and_set(expected, s);
+            }
+
+            /*!
+             * Replace the value with f(value), atomically.  If another writer changes
+             * it in the meantime, f is called again on the new value.  Returns the
+             * version it published.
+             */
+            template <class Fn>
+            snapshot swap(const Fn& f) {
+                while (true) {
+                    snapshot s = load();
+                    snapshot next(new box(f(*s)), true);
+                    if (compare_and_set(s, next))
+                        return next;
+                }
+            }
+
+          private:
+            /*!
+             * Publish desired if expected is still the current version.  desired
+             * must not have been published before, or a reader that's part way through
+             * loading it could give back a count that isn't its own.
+             */
+            bool compare_and_set(const snapshot& expected, const snapshot& desired) {
+                box* b = desired.b.get();
+                b->ref_count.fetch_add(1, std::memory_order_relaxed);
+                uint64_t next = word_of(b);
+#if defined(HEIST_ATOM_LOCKED)
+                impl::spin_lock* l = impl::spin_get_and_lock(this);
+                uint64_t w = current.load(std::memory_order_relaxed);
+                bool replaced = box_of(w) == expected.b.get();
+                if (replaced)
+                    current.store(next, std::memory_order_relaxed);
+                l->unlock();
+                if (replaced) {
+                    retire(w);
+                    return true;
+                }
+#else
+                uint64_t w = current.load(std::memory_order_acquire);
+                while (box_of(w) == expected.b.get()) {
+                    // Readers may change the count while we try, so retry until the
+                    // version itself changes.
+                    if (current.compare_exchange_weak(w, next, std::memory_order_acq_rel)) {
+                        retire(w);
+                        return true;
+                    }
+                }
+#endif
+                b->ref_count.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            atom(const atom&) = delete;
+            atom& operator = (const atom&) = delete;
+    };
+}
+
+#endif
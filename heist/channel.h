@@ -0,0 +1,193 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_CHANNEL_H_
+#define _HEIST_CHANNEL_H_
+
+#include <boost/optional.hpp>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace heist {
+    /*!
+     * A bounded lock-free channel for handing values, such as versions of heist's
+     * data structures, from any number of sending threads to one receiving thread.
+     *
+     * Values are moved in and moved out, so handing over a map or list moves its
+     * root without touching any reference counts.  It's a ring of slots, each with
+     * a sequence number that says whether it's waiting to be written or read on the
+     * current lap (Vyukov's bounded queue): Senders claim a slot by advancing the
+     * send position with compare-and-swap, and the receiver needs no atomic
+     * read-modify-write at all.
+     *
+     * receive(), try_receive() and drain() must only be called by one thread at a
+     * time.
+     */
+    template <class T>
+    class channel
+    {
+        private:
+            struct slot {
+                std::atomic<size_t> seq;
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+                T* get() { return reinterpret_cast<T*>(&value); }
+            };
+            static const size_t CACHE_LINE = 64;
+
+            size_t mask;
+            std::unique_ptr<slot[]> slots;
+            alignas(CACHE_LINE) std::atomic<size_t> send_pos;
+            alignas(CACHE_LINE) size_t receive_pos;  // Only touched by the receiver
+
+            template <class... Args>
+            bool try_emplace(Args&&... args)
+            {
+                size_t pos = send_pos.load(std::memory_order_relaxed);
+                while (true) {
+                    slot& s = slots[pos & mask];
+                    intptr_t diff = (intptr_t)s.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+                    if (diff == 0) {
+                        if (send_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            // If this throws, the slot stays claimed and the channel
+                            // is stuck, so T's constructor here should be a move.
+                            new (s.get()) T(std::forward<Args>(args)...);
+                            s.seq.store(pos + 1, std::memory_order_release);
+                            return true;
+                        }
+                    }
+                    else if (diff < 0)
+                        return false;  // Full: The receiver hasn't got to it since the last lap
+                    else
+                        pos = send_pos.load(std::memory_order_relaxed);
+                }
+            }
+
+            /*!
+             * The slot at the receive position, if its value has been sent.
+             */
+            slot* ready()
+            {
+                slot& s = slots[receive_pos & mask];
+                return s.seq.load(std::memory_order_acquire) == receive_pos + 1 ? &s : NULL;
+            }
+
+            void consume(slot* s)
+            {
+                s->get()->~T();
+                s->seq.store(receive_pos + mask + 1, std::memory_order_release);
+                receive_pos++;
+            }
+
+        public:
+            /*!
+             * A channel that can hold at least capacity values, rounded up to a power
+             * of two.
+             */
+            explicit channel(size_t capacity) : send_pos(0), receive_pos(0)
+            {
+                size_t n = 2;
+                while (n < capacity)
+                    n *= 2;
+                mask = n - 1;
+                slots.reset(new slot[n]);
+                for (size_t i = 0; i < n; i++)
+                    slots[i].seq.store(i, std::memory_order_relaxed);
+            }
+
+            ~channel()
+            {
+                while (slot* s = ready())
+                    consume(s);
+            }
+
+            size_t capacity() const
+            {
+                return mask + 1;
+            }
+
+            /*!
+             * Send a value if there's room, and return true, or return false, leaving
+             * value untouched, if the channel is full.
+             */
+            bool try_send(T&& value)
+            {
+                return try_emplace(std::move(value));
+            }
+
+            bool try_send(const T& value)
+            {
+                return try_emplace(value);
+            }
+
+            /*!
+             * Send a value, yielding until there's room.
+             */
+            void send(T&& value)
+            {
+                while (!try_emplace(std::move(value)))
+                    std::this_thread::yield();
+            }
+
+            void send(const T& value)
+            {
+                while (!try_emplace(value))
+                    std::this_thread::yield();
+            }
+
+            /*!
+             * The next value, or boost::none if nothing has been sent.  Receiver only.
+             */
+            boost::optional<T> try_receive()
+            {
+                slot* s = ready();
+                if (s == NULL)
+                    return boost::none;
+                boost::optional<T> out(std::move(*s->get()));
+                consume(s);
+                return out;
+            }
+
+            /*!
+             * The next value, yielding until one is sent.  Receiver only.
+             */
+            T receive()
+            {
+                slot* s;
+                while ((s = ready()) == NULL)
+                    std::this_thread::yield();
+                T out(std::move(*s->get()));
+                consume(s);
+                return out;
+            }
+
+            /*!
+             * Pass up to max_items values that have been sent to f as rvalues, in the
+             * order they were sent, freeing their slots as it goes.  Returns how many
+             * there were.  Receiver only.
+             */
+            template <class Fn>
+            size_t drain(const Fn& f, size_t max_items = SIZE_MAX)
+            {
+                size_t n = 0;
+                slot* s;
+                for (; n < max_items && (s = ready()) != NULL; n++) {
+                    f(std::move(*s->get()));
+                    consume(s);
+                }
+                return n;
+            }
+
+          private:
+            channel(const channel&) = delete;
+            channel& operator = (const channel&) = delete;
+    };
+}
+
+#endif
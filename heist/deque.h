@@ -0,0 +1,170 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_DEQUE_H_
+#define _HEIST_DEQUE_H_
+
+#include <heist/unrolled_list.h>
+#include <initializer_list>
+#include <stdexcept>
+#include <vector>
+
+namespace heist {
+
+    /*!
+     * An immutable double-ended queue.  It's Okasaki's banker's deque: A list for
+     * each end, the back one in reverse order, kept within a factor of BALANCE of
+     * each other's lengths.  When one end gets too long, half of it is moved to the
+     * other.  Both are unrolled_lists, so most pushes fill a free slot instead of
+     * allocating.
+     *
+     * push_front, push_back, pop_front and pop_back are O(1) amortized, and front,
+     * back and size are O(1).  As with queue, that holds for any sequence of
+     * operations as long as each version is only popped from once.
+     *
+     * Its cells aren't allocated from arenas.
+     */
+    template <class A>
+    class deque {
+        private:
+            static const size_t BALANCE = 3;
+
+            unrolled_list<A> f;     // The front, first element first
+            unrolled_list<A> r;     // The back, last element first
+            size_t nf, nr;
+
+            deque(unrolled_list<A> f, size_t nf, unrolled_list<A> r, size_t nr)
+                : f(std::move(f)), r(std::move(r)), nf(nf), nr(nr)
+            {
+                if (this->nf > BALANCE * this->nr + 1)
+                    move_half(this->f, this->nf, this->r, this->nr);
+                else if (this->nr > BALANCE * this->nf + 1)
+                    move_half(this->r, this->nr, this->f, this->nf);
+            }
+
+            /*!
+             * Move the far half of the long end onto the far end of the short one, in
+             * one pass.  Each end is a list whose far end is its last element, so the
+             * long end keeps a copy of its first half, and the short end is copied
+             * onto the reverse of the second half.
+             */
+            static void move_half(unrolled_list<A>& lng, size_t& nl, unrolled_list<A>& shrt, size_t& ns)
+            {
+                size_t keep = (nl + ns) / 2;
+                std::vector<const A*> ls = lng.pointers();
+                std::vector<const A*> ss = shrt.pointers();
+                unrolled_list<A> l, s;
+                for (size_t i = keep; i < nl; i++)
+                    s = unrolled_list<A>(*ls[i], s);
+                for (auto it = ss.rbegin(); it != ss.rend(); ++it)
+                    s = unrolled_list<A>(**it, s);
+                for (size_t i = keep; i > 0; i--)
+                    l = unrolled_list<A>(*ls[i - 1], l);
+                lng = std::move(l);
+                shrt = std::move(s);
+                ns += nl - keep;
+                nl = keep;
+            }
+
+        public:
+            deque() : nf(0), nr(0) {}
+
+            /*!
+             * construct a deque from a C++11 initializer list.
+             */
+            deque(std::initializer_list<A> il) : nf(0), nr(0) {
+                for (const A& a : il)
+                    *this = push_back(a);
+            }
+
+            /*!
+             * True if this deque has anything in it.
+             */
+            operator bool() const
+            {
+                return nf + nr != 0;
+            }
+
+            /*!
+             * The number of items in the deque.  O(1).
+             */
+            size_t size() const
+            {
+                return nf + nr;
+            }
+
+            /*!
+             * Return the first item.  Caller must ensure that this deque isn't empty
+             * before calling, by casting to bool.
+             */
+            const A& front() const
+            {
+                // The balance condition means that if the front is empty, the back has
+                // one item.
+                return f ? f.head() : r.head();
+            }
+
+            /*!
+             * Return the last item.  Caller must ensure that this deque isn't empty
+             * before calling, by casting to bool.
+             */
+            const A& back() const
+            {
+                return r ? r.head() : f.head();
+            }
+
+            deque<A> push_front(const A& a) const {
+                return deque<A>(unrolled_list<A>(a, f), nf+1, r, nr);
+            }
+
+            deque<A> push_front(A&& a) const {
+                return deque<A>(unrolled_list<A>(std::move(a), f), nf+1, r, nr);
+            }
+
+            deque<A> push_back(const A& a) const {
+                return deque<A>(f, nf, unrolled_list<A>(a, r), nr+1);
+            }
+
+            deque<A> push_back(A&& a) const {
+                return deque<A>(f, nf, unrolled_list<A>(std::move(a), r), nr+1);
+            }
+
+            /*!
+             * Return this deque without its first item.  Will throw an exception if
+             * the deque is empty.
+             */
+            deque<A> pop_front() const {
+                if (nf == 0) {
+                    if (nr == 0)
+                        throw std::runtime_error("deque::pop_front() empty");
+                    return deque<A>();
+                }
+                return deque<A>(f.tail(), nf-1, r, nr);
+            }
+
+            /*!
+             * Return this deque without its last item.  Will throw an exception if
+             * the deque is empty.
+             */
+            deque<A> pop_back() const {
+                if (nr == 0) {
+                    if (nf == 0)
+                        throw std::runtime_error("deque::pop_back() empty");
+                    return deque<A>();
+                }
+                return deque<A>(f, nf, r.tail(), nr-1);
+            }
+
+            /*!
+             * Its cells never come from an arena, so this deque is returned unchanged.
+             */
+            deque<A> promote() const {
+                return *this;
+            }
+    };
+
+};
+
+#endif
@@ -18,30 +18,36 @@ namespace heist {
     Name::Name(void* value_, impl::deleter del_) \
         : value(value_), count(new impl::count(1, del_)) \
     { \
+        if (count->arena) \
+            impl::current_region->finalize_with(del_, value_); \
     } \
      \
     Name::Name(const Name& other) \
         : value(other.value), count(other.count) \
     { \
-        GET_AND_LOCK; \
-        count->c++; \
-        UNLOCK; \
+        if (count != nullptr && !count->arena) { \
+            GET_AND_LOCK; \
+            count->c++; \
+            UNLOCK; \
+        } \
     } \
     \
     Name::~Name() { \
-        GET_AND_LOCK; \
-        if (count != nullptr && --count->c == 0) { \
-            UNLOCK; \
-            count->del(value); delete count; \
-        } \
-        else { \
-            UNLOCK; \
+        if (count != nullptr && !count->arena) { \
+            GET_AND_LOCK; \
+            if (--count->c == 0) { \
+                UNLOCK; \
+                count->del(value); delete count; \
+            } \
+            else { \
+                UNLOCK; \
+            } \
         } \
     } \
      \
     Name& Name::operator = (const Name& other) { \
         if (count != other.count) { \
-            { \
+            if (count != nullptr && !count->arena) { \
                 GET_AND_LOCK; \
                 if (--count->c == 0) { \
                     UNLOCK; \
@@ -53,7 +59,7 @@ namespace heist {
             } \
             value = other.value; \
             count = other.count; \
-            { \
+            if (count != nullptr && !count->arena) { \
                 GET_AND_LOCK; \
                 count->c++; \
                 UNLOCK; \
@@ -6,6 +6,7 @@
 #ifndef _HEIST_LIGHTPTR_H_
 #define _HEIST_LIGHTPTR_H_
 
+#include <heist/node_pool.h>
 #include <utility>
 
 namespace heist {
@@ -17,12 +18,13 @@ namespace heist {
 
     namespace impl {
         typedef void (*deleter)(void*);
-        struct count {
+        struct count : arena_pooled {
             count(
                 int c_,
                 deleter del_
-            ) : c(c_), del(del_) {}
+            ) : c(c_), arena(allocating_region() != NULL), del(del_) {}
             int c;
+            bool arena;  // Owned by an arena: Not reference counted
             deleter del;
         };
     };
@@ -50,6 +52,12 @@ namespace heist {
             name(void* value, impl::deleter del); \
             ~name(); \
             name& operator = (const name& other); \
+            name& operator = (name&& other) \
+            { \
+                std::swap(value, other.value); \
+                std::swap(count, other.count); \
+                return *this; \
+            } \
             void* value; \
             impl::count* count; \
          \
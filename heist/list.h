@@ -11,12 +11,13 @@
 #include <boost/variant.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/intrusive_ptr.hpp>
-#include <mutex>
+#include <atomic>
 #include <vector>
 #include <iostream>
 #include <list>
 #include <initializer_list>
-#include <heist/lock_pool.h>
+#include <heist/node_pool.h>
+#include <heist/reclaimer.h>
 
 
 
@@ -30,63 +31,93 @@ namespace heist {
     template <class A>
     void intrusive_ptr_add_ref(cons<A>* p)
     {
-        heist::impl::spin_lock* l = heist::impl::spin_get_and_lock(p);
-        p->ref_count++;
-        l->unlock();
+        if (p->arena) return;
+        // Whoever copies a reference already holds one, so nothing needs ordering.
+        p->ref_count.fetch_add(1, std::memory_order_relaxed);
     }
 
     template <class A>
     void intrusive_ptr_release(cons<A>* p)
     {
-        heist::impl::spin_lock* l = heist::impl::spin_get_and_lock(p);
-        if (--p->ref_count == 0) {
-            l->unlock();
+        if (p->arena) return;
+        // Release our writes to the cell, and make everyone else's visible to the
+        // thread that deletes it.
+        if (p->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
             delete p;
-        }
-        else
-            l->unlock();
     }
 
     template <class A>
-    struct cons {
-        cons(const A& head, const boost::intrusive_ptr<cons<A>>& tail) : ref_count(0), head(head), tail(tail) {}
+    struct cons : impl::arena_pooled {
+        cons(const A& head, const boost::intrusive_ptr<cons<A>>& tail)
+            : ref_count(0), arena(impl::allocating_region() != NULL), head(head), tail(tail) { finalize_in_arena(); }
+        cons(A&& head, const boost::intrusive_ptr<cons<A>>& tail)
+            : ref_count(0), arena(impl::allocating_region() != NULL), head(std::move(head)), tail(tail) { finalize_in_arena(); }
+        template <class... Args>
+        cons(boost::in_place_init_t, const boost::intrusive_ptr<cons<A>>& tail, Args&&... args)
+            : ref_count(0), arena(impl::allocating_region() != NULL), head(std::forward<Args>(args)...), tail(tail)
+        {
+            finalize_in_arena();
+        }
         ~cons() {
-            // Optimization to allow it to clean up long lists without
-            // using up the stack.
-            if (tail && tail->ref_count == 1) {
-                std::vector<cons<A>*> ptrs;
-                cons<A>* p = this;
-                while (true) {
-                    boost::intrusive_ptr<cons<A>>& l = p->tail;
-                    if (!l)
-                        break;
-                    p = &*l;
-                    if (!p->tail || p->tail->ref_count != 1)
-                        break;
-                    ptrs.push_back(p);
+            // Free the cells that only we refer to one at a time, detaching each
+            // one's tail before it goes, so long lists don't use up the stack.
+            boost::intrusive_ptr<cons<A>> t = std::move(tail);
+            for (int n = 0; t && t->ref_count.load(std::memory_order_acquire) == 1; n++) {
+                if (n == impl::RECLAIM_AFTER && impl::reclaiming_in_background()) {
+                    impl::reclaim_later(t.detach(), drop);
+                    return;
                 }
-                for (int i= (int)ptrs.size()-1; i >= 0; i--)
-                    ptrs[i]->tail = NULL;
+                boost::intrusive_ptr<cons<A>> next = std::move(t->tail);
+                t = std::move(next);
             }
         }
-        int ref_count;
+        std::atomic<int> ref_count;
+        bool arena;  // Owned by an arena: Not reference counted
         A head;
         boost::intrusive_ptr<cons<A>> tail;
+
+      private:
+        /*!
+         * If this cell was allocated from an arena, have the arena destroy it.
+         */
+        void finalize_in_arena() {
+            if (arena)
+                impl::current_region->finalize_with(destroy, this);
+        }
+        static void destroy(void* p) {
+            ((cons<A>*)p)->~cons<A>();
+        }
+        static void drop(void* p) {
+            boost::intrusive_ptr<cons<A>>((cons<A>*)p, false);
+        }
     };
 }
 
 namespace heist {
 
     template <class A> class list;
+    namespace impl {
+        struct access;
+        template <class A> class list_builder;
+    }
     template <class A> list<A> concat(list<list<A>> lists);
     template <class A> list<A> cat_optional(list<boost::optional<A>> xs);
 
     template <class A> class list
     {
         friend class cons<A>;
+        friend struct impl::access;
+        friend class impl::list_builder<A>;
         private:
             boost::intrusive_ptr<cons<A>> ocons;
             list(const boost::intrusive_ptr<cons<A>>& ocons) : ocons(ocons) {}
+            list(boost::intrusive_ptr<cons<A>>&& ocons) : ocons(std::move(ocons)) {}
+            /*!
+             * A new reference to a cell that's been borrowed from a list.
+             */
+            static list<A> borrowed(const cons<A>* c) {
+                return list<A>(boost::intrusive_ptr<cons<A>>(const_cast<cons<A>*>(c)));
+            }
 
         public:
             typedef A value_type;
@@ -99,6 +130,7 @@ namespace heist {
              * construct a list.  Better to use % operator.
              */
             list(const A& head, const list<A>& tail) : ocons(new cons<A>(head, tail.ocons)) {}
+            list(A&& head, const list<A>& tail) : ocons(new cons<A>(std::move(head), tail.ocons)) {}
             /*!
              * construct a list from a C++11 initializer list.
              */
@@ -113,6 +145,16 @@ namespace heist {
                 }
             }
 
+            /*!
+             * Return this list with a new head constructed in place from the specified
+             * arguments.
+             */
+            template <class... Args>
+            list<A> emplace_front(Args&&... args) const {
+                return list<A>(boost::intrusive_ptr<cons<A>>(
+                    new cons<A>(boost::in_place_init, ocons, std::forward<Args>(args)...)));
+            }
+
             /*!
              * Check whether this list is non-empty.  If it returns true, then it's valid to
              * use head() and tail().
@@ -135,14 +177,15 @@ namespace heist {
             list<A> tail() const {return list<A>(ocons->tail);}
 
             bool operator == (const list<A>& other) const {
-                list<A> one = *this;
-                list<A> two = other;
-                while (one && two) {
-                    if (!(one.head() == two.head())) return false;
-                    one = one.tail();
-                    two = two.tail();
+                const cons<A>* one = ocons.get();
+                const cons<A>* two = other.ocons.get();
+                // Stop early at a shared tail.
+                while (one != two && one != NULL && two != NULL) {
+                    if (!(one->head == two->head)) return false;
+                    one = one->tail.get();
+                    two = two->tail.get();
                 }
-                return !one && !two;
+                return one == two;
             }
 
             bool operator != (const list<A>& other) const {
@@ -150,15 +193,15 @@ namespace heist {
             }
 
             bool operator < (const list<A>& other) const {
-                list<A> one = *this;
-                list<A> two = other;
-                while (one && two) {
-                    if (one.head() < two.head()) return true;
-                    if (two.head() < one.head()) return false;
-                    one = one.tail();
-                    two = two.tail();
+                const cons<A>* one = ocons.get();
+                const cons<A>* two = other.ocons.get();
+                while (one != two && one != NULL && two != NULL) {
+                    if (one->head < two->head) return true;
+                    if (two->head < one->head) return false;
+                    one = one->tail.get();
+                    two = two->tail.get();
                 }
-                return (bool)two;
+                return one != two && two != NULL;
             }
 
             bool operator > (const list<A>& other) const {
@@ -174,19 +217,39 @@ namespace heist {
             }
 
             A operator [] (int ix) const {
-                list<A> l = *this;
-                while (l && ix > 0) {
-                    l = l.tail();
+                const cons<A>* c = ocons.get();
+                while (c != NULL && ix > 0) {
+                    c = c->tail.get();
                     ix--;
                 }
-                return l.head();
+                return c->head;
             };
 
+            /*!
+             * Return this list with the cells that were allocated in an arena copied to
+             * the heap, so it can outlive the arena.  See arena.h.
+             */
+            list<A> promote() const
+            {
+                impl::region_suspender rs;
+                // Cells that aren't in an arena can't refer to any that are.
+                std::vector<const A*> prefix;
+                const cons<A>* c = ocons.get();
+                while (c != NULL && c->arena) {
+                    prefix.push_back(&c->head);
+                    c = c->tail.get();
+                }
+                list<A> out = borrowed(c);
+                for (auto it = prefix.rbegin(); it != prefix.rend(); ++it)
+                    out = list<A>(**it, out);
+                return out;
+            }
+
             size_t size() const
             {
                 size_t len = 0;
-                list<A> xs = *this;
-                while (xs) {len++; xs = xs.tail();}
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    len++;
                 return len;
             }
 
@@ -196,35 +259,26 @@ namespace heist {
             template <class Fn>
             list<typename std::result_of<Fn(A)>::type> map(const Fn& f) const {
                 typedef typename std::result_of<Fn(A)>::type B;
-                list<B> out;
-                list<A> in = *this;
-                while (in) {
-                    out = f(in.head()) %= out;
-                    in = in.tail();
-                }
-                return out.reverse();
+                impl::list_builder<B> out;
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    out.push_back(f(c->head));
+                return out.finish();
             }
 
             list<A> filter(std::function<bool(const A&)> pred) const
             {
-                list<A> xs(*this);
-                list<A> ys;
-                while (xs) {
-                    if (pred(xs.head()))
-                        ys = xs.head() %= ys;
-                    xs = xs.tail();
-                }
-                return ys.reverse();
+                impl::list_builder<A> ys;
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    if (pred(c->head))
+                        ys.push_back(c->head);
+                return ys.finish();
             }
 
             list<A> reverse() const
             {
                 list<A> acc;
-                list<A> as = *this;
-                while (as) {
-                    acc = as.head() %= acc;
-                    as = as.tail();
-                }
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    acc = c->head %= acc;
                 return acc;
             }
 
@@ -246,73 +300,66 @@ namespace heist {
             }
 
             std::tuple<heist::list<A>, heist::list<A>> split_at(int i) const {
-                heist::list<A> xs = *this;
-                heist::list<A> fst;
-                while (i > 0 && (bool)xs) {
-                    fst = heist::list<A>(xs.head(), fst);
-                    xs = xs.tail();
+                const cons<A>* c = ocons.get();
+                impl::list_builder<A> fst;
+                while (i > 0 && c != NULL) {
+                    fst.push_back(c->head);
+                    c = c->tail.get();
                     i--;
                 }
-                return std::tuple<heist::list<A>, heist::list<A>>(fst.reverse(), xs);
+                return std::tuple<heist::list<A>, heist::list<A>>(fst.finish(), borrowed(c));
             }
 
             list<A> intersperse(A x) const {
-                const auto& xs = *this;
-                if (xs && xs.tail())
-                    return xs.head() %= x %= xs.tail().intersperse(x);
-                else
-                    return xs;
+                const cons<A>* c = ocons.get();
+                if (c == NULL || !c->tail)
+                    return *this;
+                impl::list_builder<A> out;
+                for (; c->tail; c = c->tail.get()) {
+                    out.push_back(c->head);
+                    out.push_back(x);
+                }
+                // The last cell can be shared.
+                return out.finish(borrowed(c));
             }
 
             bool any(std::function<bool(const A&)> pred) const {
-                auto xs = *this;
-                while (xs) {
-                    if (pred(xs.head())) return true;
-                    xs = xs.tail();
-                }
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    if (pred(c->head)) return true;
                 return false;
             }
 
             std::list<A> to_std_list() const {
                 std::list<A> out;
-                auto xs = *this;
-                while (xs) {
-                    out.push_back(xs.head());
-                    xs = xs.tail();
-                }
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    out.push_back(c->head);
                 return out;
             }
 
             bool contains(const A& a) const
             {
-                auto xs = *this;
-                while (xs) {
-                    if (xs.head() == a)
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    if (c->head == a)
                         return true;
-                    xs = xs.tail();
-                }
                 return false;
             }
 
             template <class B>
             B foldl(std::function<B(const B&,const A&)> f, B b) const
             {
-                auto xs = *this;
-                while (xs) {
-                    b = f(b, xs.head());
-                    xs = xs.tail();
-                }
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    b = f(b, c->head);
                 return b;
             }
 
             template <class B>
             B foldr(std::function<B(const A&,const B&)> f, B b) const
             {
-                auto xs = reverse();
-                while (xs) {
-                    b = f(xs.head(), b);
-                    xs = xs.tail();
-                }
+                std::vector<const A*> xs;
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get())
+                    xs.push_back(&c->head);
+                for (auto it = xs.rbegin(); it != xs.rend(); ++it)
+                    b = f(**it, b);
                 return b;
             }
 
@@ -340,20 +387,68 @@ namespace heist {
              */
             std::tuple<list<A>, list<A>> partition(std::function<bool(const A&)> pred) const
             {
-                auto xs = *this;
-                list<A> ins;
-                list<A> outs;
-                while (xs) {
-                    if (pred(xs.head()))
-                        ins = xs.head() %= ins;
+                impl::list_builder<A> ins;
+                impl::list_builder<A> outs;
+                for (const cons<A>* c = ocons.get(); c != NULL; c = c->tail.get()) {
+                    if (pred(c->head))
+                        ins.push_back(c->head);
                     else
-                        outs = xs.head() %= outs;
-                    xs = xs.tail();
+                        outs.push_back(c->head);
                 }
-                return std::make_tuple(ins.reverse(), outs.reverse());
+                return std::make_tuple(ins.finish(), outs.finish());
             }
     };
 
+    namespace impl {
+        /*!
+         * Builds a list front to back, by appending to a tail that nothing else can
+         * see yet, so each element costs one cell.
+         */
+        template <class A>
+        class list_builder {
+            public:
+                list_builder() : last(NULL) {}
+
+                template <class... Args>
+                void emplace_back(Args&&... args) {
+                    boost::intrusive_ptr<cons<A>> c(new cons<A>(boost::in_place_init,
+                        boost::intrusive_ptr<cons<A>>(), std::forward<Args>(args)...));
+                    cons<A>* p = c.get();
+                    if (last != NULL)
+                        last->tail = std::move(c);
+                    else
+                        first = std::move(c);
+                    last = p;
+                }
+                void push_back(const A& a) { emplace_back(a); }
+                void push_back(A&& a) { emplace_back(std::move(a)); }
+
+                /*!
+                 * Append a copy of every element of xs.
+                 */
+                void append(const list<A>& xs) {
+                    for (const cons<A>* c = xs.ocons.get(); c != NULL; c = c->tail.get())
+                        emplace_back(c->head);
+                }
+
+                /*!
+                 * Return the list built so far followed by tail, leaving the builder
+                 * empty.
+                 */
+                list<A> finish(const list<A>& tail = list<A>()) {
+                    if (last == NULL)
+                        return tail;
+                    last->tail = tail.ocons;
+                    last = NULL;
+                    return list<A>(std::move(first));
+                }
+
+            private:
+                boost::intrusive_ptr<cons<A>> first;
+                cons<A>* last;
+        };
+    }
+
     /*!
      * Operator synonym for list constructor - right-associative.
      */
@@ -363,23 +458,18 @@ namespace heist {
         return list<A>(x, xs);
     }
 
-    /*!
-     * To do (when we have really long lists): Uses too much stack.
-     */
+    template <class A>
+    inline list<A> operator %= (A&& x, const list<A>& xs)
+    {
+        return list<A>(std::move(x), xs);
+    }
+
     template <class A>
     list<A> operator + (const list<A>& one, const list<A>& tother)
     {
-        list<A> xs = one.reverse();
-        if (xs) {
-            list<A> out = tother;
-            while (xs) {
-                out = xs.head() %= out;
-                xs = xs.tail();
-            }
-            return out;
-        }
-        else
-            return tother;
+        impl::list_builder<A> out;
+        out.append(one);
+        return out.finish(tother);
     }
 
     template <class A>
@@ -400,9 +490,11 @@ namespace heist {
      */
     template <class A>
     list<A> concat(list<list<A>> lists) {
-        return lists.template foldr<list<A>>([] (const list<A>& a, const list<A>& b) {
-                return a + b;
-            }, list<A>());
+        // The last list is shared rather than copied.
+        impl::list_builder<A> out;
+        for (; lists && lists.tail(); lists = lists.tail())
+            out.append(lists.head());
+        return out.finish(lists ? lists.head() : list<A>());
     }
 
     /*!
@@ -410,21 +502,23 @@ namespace heist {
      */
     template <class A>
     list<A> cat_optional(list<boost::optional<A>> xs) {
-        return
-            xs.filter([] (const boost::optional<A>& oa) { return (bool)oa; })
-              .map([] (boost::optional<A> oa) { return oa.get(); });
+        impl::list_builder<A> out;
+        for (; xs; xs = xs.tail())
+            if (xs.head())
+                out.push_back(xs.head().get());
+        return out.finish();
     }
 
     template <class A, class B, class C>
     list<C> zip_with(std::function<C(const A&,const B&)> f, list<A> as, list<B> bs)
     {
-        list<C> cs;
+        impl::list_builder<C> cs;
         while (as && bs) {
-            cs = f(as.head(), bs.head()) %= cs;
+            cs.push_back(f(as.head(), bs.head()));
             as = as.tail();
             bs = bs.tail();
         }
-        return cs.reverse();
+        return cs.finish();
     }
 
     template <class A, class B>
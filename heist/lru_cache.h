@@ -7,12 +7,23 @@
 #define _HEIST_LRUCACHE_H_
 
 #include <heist/map.h>
+#include <heist/queue.h>
 #include <functional>
 
 namespace heist {
     
     /*!
      * Immutable LRU cache.
+     *
+     * Each value is stamped with a sequence number when it's inserted or touched.
+     * The order they were stamped in is kept in a queue of (stamp, key) records,
+     * which is only ever pushed onto, so a hit costs one descent of the values
+     * tree and an O(1) push.  Re-stamping a key leaves its old record behind, so
+     * records whose stamps don't match the key's value any more are skipped when
+     * the oldest is wanted.  Once the queue is more than four times as long as the
+     * cache, each stamp also moves a few records from its front to a second queue,
+     * dropping the stale ones, until it has been through them all, so cleaning up
+     * adds a bounded number of lookups to each stamp and never stops to sort.
      */
     template <class K, class A>
     class lru_cache
@@ -20,50 +31,147 @@ namespace heist {
     friend class lru_cache_test;
     
     private:
+        typedef std::tuple<long long, K> record;
+        /*!
+         * Stale records allowed beyond the number of values before a cleaning pass
+         * starts.
+         */
+        static const int STALE_SLACK = 32;
+        /*!
+         * Records that each stamp moves during a cleaning pass.  It's enough for
+         * the pass to catch up with the records pushed while it runs.
+         */
+        static const int CLEAN_STEP = 4;
+
         heist::map<K, std::tuple<long long, A>> values;
-        heist::map<long long, K> recency;
+        // The records, least recently stamped first, are older followed by recency.
+        // older is the part that the current cleaning pass has been through.
+        heist::queue<record> older;
+        heist::queue<record> recency;
+        bool cleaning;
         long long next_seq;
         int size_;
         std::function<bool(const lru_cache<K, A>&)> purge_condition;
     
         lru_cache(
             heist::map<K, std::tuple<long long, A>> values,
-            heist::map<long long, K> recency,
+            heist::queue<record> older,
+            heist::queue<record> recency,
+            bool cleaning,
             long long next_seq,
             int size,
             std::function<bool(const lru_cache<K, A>&)> purge_condition
-        ) : values(values), recency(recency), next_seq(next_seq), size_(size), purge_condition(purge_condition) {}
+        ) : values(std::move(values)), older(std::move(older)), recency(std::move(recency)),
+            cleaning(cleaning), next_seq(next_seq), size_(size),
+            purge_condition(std::move(purge_condition)) {}
+
+        /*!
+         * True if r is the record of its key's current stamp in vs.
+         */
+        static bool is_fresh(const heist::map<K, std::tuple<long long, A>>& vs, const record& r)
+        {
+            auto ova = vs.lookup(std::get<1>(r));
+            return ova && std::get<0>(ova.get()) == std::get<0>(r);
+        }
+
+        /*!
+         * This cache with the new values, where k's value has just been stamped with
+         * next_seq.
+         */
+        lru_cache<K, A> stamped(heist::map<K, std::tuple<long long, A>> vs, const K& k, int size) const
+        {
+            heist::queue<record> os = older;
+            heist::queue<record> rs = recency.push(record(next_seq, k));
+            bool cl = cleaning || rs.size() > 4 * (size_t)size + STALE_SLACK;
+            if (cl) {
+                for (int i = 0; i < CLEAN_STEP && rs; i++) {
+                    auto p = rs.pop();
+                    if (is_fresh(vs, std::get<0>(p)))
+                        os = os.push(std::get<0>(p));
+                    rs = std::get<1>(p);
+                }
+                if (!rs) {
+                    rs = std::move(os);
+                    os = heist::queue<record>();
+                    cl = false;
+                }
+            }
+            return lru_cache(std::move(vs), std::move(os), std::move(rs), cl, next_seq+1, size,
+                             purge_condition).purge();
+        }
+
+        /*!
+         * This cache without the stale records at the front of its queues, so the
+         * first one is the oldest key's, if there is one.
+         */
+        lru_cache<K, A> without_stale() const
+        {
+            heist::queue<record> os = older, rs = recency;
+            while (os || rs) {
+                heist::queue<record>& q = os ? os : rs;
+                auto p = q.pop();
+                if (is_fresh(values, std::get<0>(p)))
+                    break;
+                q = std::get<1>(p);
+            }
+            return lru_cache(values, std::move(os), std::move(rs), cleaning, next_seq, size_, purge_condition);
+        }
+
+        /*!
+         * The first record, which the caller must ensure exists.
+         */
+        record front() const
+        {
+            return std::get<0>(older ? older.pop() : recency.pop());
+        }
     
     public:
         lru_cache(std::function<bool(const lru_cache<K, A>&)> purge_condition) 
-        : next_seq(0), size_(0), purge_condition(purge_condition) {}
-        lru_cache(int maxSize) : next_seq(0), size_(0), purge_condition(
+        : cleaning(false), next_seq(0), size_(0), purge_condition(purge_condition) {}
+        lru_cache(int maxSize) : cleaning(false), next_seq(0), size_(0), purge_condition(
             [maxSize] (const lru_cache<K,A>& cache) { return cache.size() > maxSize; }
         ) {}
     
         inline int size() const {return size_;}
 
+        /*!
+         * Return this cache with everything that was allocated in an arena copied to
+         * the heap, so it can outlive the arena.  See arena.h.
+         */
+        lru_cache<K, A> promote() const
+        {
+            return lru_cache(values.promote(), older.promote(), recency.promote(), cleaning, next_seq, size_,
+                             purge_condition);
+        }
+
+        /*!
+         * Look up the specified key and make it most recently used, returning its
+         * value and the new cache.  A hit takes one descent of the tree, up to
+         * CLEAN_STEP lookups if a cleaning pass is running, and a queue push, plus an
+         * eviction if the purge condition fires.  An eviction skips the stale records
+         * at the front of the queue, each with a lookup, and removes the oldest key.
+         * A miss returns boost::none and this cache unchanged.
+         */
+        std::tuple<boost::optional<A>, lru_cache<K, A>> get(const K& k) const
+        {
+            boost::optional<A> oa;
+            long long seq = next_seq;
+            auto vs = values.update(k, [&oa, seq] (const std::tuple<long long, A>& va) {
+                oa = std::get<1>(va);
+                return boost::make_optional(std::make_tuple(seq, std::get<1>(va)));
+            });
+            if (oa)
+                return std::make_tuple(oa, stamped(std::move(vs), k, size_));
+            else
+                return std::make_tuple(oa, *this);
+        }
+
         /*!
          * Make the specified key most recently used, no-op if the key doesn't exist.
          */
         lru_cache<K, A> touch(K k) const
         {
-            auto va0 = values.lookup(k);
-            if (va0) {
-                auto va = va0.get();
-                auto oldSeq = std::get<0>(va);
-                auto value = std::get<1>(va);
-                auto rit = recency.find(oldSeq).get();
-                return lru_cache(
-                    values.insert(k, std::make_tuple(next_seq, value)),
-                    rit.remove().insert(next_seq, k),
-                    next_seq+1,
-                    size_,
-                    purge_condition
-                ).purge();
-            }
-            else
-                return *this;
+            return std::get<1>(get(k));
         }
 
         /*!
@@ -83,44 +191,28 @@ namespace heist {
          */
         lru_cache<K, A> insert(K k, A a) const
         {
-            auto va0 = values.lookup(k);
-            if (va0) {  // exists already - update value & touch
-                auto va = va0.get();
-                auto oldSeq = std::get<0>(va);
-                auto rit = recency.find(oldSeq).get();
-                return lru_cache(
-                    values.insert(k, std::make_tuple(next_seq, a)),
-                    rit.remove().insert(next_seq, k),
-                    next_seq+1,
-                    size_,
-                    purge_condition
-                ).purge();
-            }
-            else  // adding a new item
-                return lru_cache(
-                    values.insert(k, std::make_tuple(next_seq, a)),
-                    recency.insert(next_seq, k),
-                    next_seq+1,
-                    size_+1,
-                    purge_condition
-                ).purge();
+            bool existed = false;
+            long long seq = next_seq;
+            auto vs = values.upsert(k, [&existed, &a, seq] (boost::optional<const std::tuple<long long, A>&> ova) {
+                existed = (bool)ova;
+                return std::make_tuple(seq, std::move(a));
+            });
+            return stamped(std::move(vs), k, existed ? size_ : size_+1);
         }
 
         lru_cache<K, A> remove(K k) const
         {
             auto vit0 = values.find(k);
-            if (vit0) {
-                auto vit = vit0.get();
-                auto oldSeq = std::get<0>(vit.get_value());
-                auto rit = recency.find(oldSeq).get();
+            if (vit0)
                 return lru_cache(
-                    vit.remove(),
-                    rit.remove(),
+                    vit0.get().remove(),
+                    older,      // Its record is stale now
+                    recency,
+                    cleaning,
                     next_seq,
                     size_-1,
                     purge_condition
                 ).purge();  // We want to support any merge condition so always check it.
-            }
             else
                 return *this;
         }
@@ -130,15 +222,16 @@ namespace heist {
          */
         boost::optional<std::tuple<K, A>> oldest() const
         {
-            auto oOldestK = recency.begin();
-            if (oOldestK) {
-                const auto& k = oOldestK.get().get_value();
-                return boost::make_optional(
-                    std::tuple<K, A>(k, lookup(k).get())
-                );
+            for (heist::queue<record> os = older, rs = recency; os || rs; ) {
+                heist::queue<record>& q = os ? os : rs;
+                auto p = q.pop();
+                const K& k = std::get<1>(std::get<0>(p));
+                auto ova = values.lookup(k);
+                if (ova && std::get<0>(ova.get()) == std::get<0>(std::get<0>(p)))
+                    return boost::make_optional(std::tuple<K, A>(k, std::get<1>(ova.get())));
+                q = std::get<1>(p);
             }
-            else
-                return boost::optional<std::tuple<K, A>>();
+            return boost::optional<std::tuple<K, A>>();
         }
     
         heist::list<std::tuple<K, A>> to_list() const
@@ -157,9 +250,9 @@ namespace heist {
          */
         lru_cache<K, A> purge() const
         {
-            auto rit0 = recency.begin();
-            if (rit0 && purge_condition(*this)) {
-                return remove(rit0.get().get_value());
+            if (size_ != 0 && purge_condition(*this)) {
+                lru_cache<K, A> c = without_stale();
+                return c.remove(std::get<1>(c.front()));
             }
             else
                 return *this;
@@ -177,11 +270,14 @@ namespace heist {
                 vuniqs = vuniqs.insert(std::get<0>(it.get_value()));
             }
             heist::set<long long> runiqs;
-            for (auto it0 = recency.begin(); it0; it0 = it0.get().next()) {
-                auto it = it0.get();
-                runiqs = runiqs.insert(it.get_key());
+            for (heist::queue<record> os = older, rs = recency; os || rs; ) {
+                heist::queue<record>& q = os ? os : rs;
+                auto p = q.pop();
+                if (is_fresh(values, std::get<0>(p)))
+                    runiqs = runiqs.insert(std::get<0>(std::get<0>(p)));
+                q = std::get<1>(p);
             }
-            return vuniqs == runiqs;
+            return vuniqs == runiqs && (int)vuniqs.size() == size_;
         }
     };
 
@@ -11,63 +11,114 @@
 
 
 namespace heist {
-    template <class K, class A>
+    /*!
+     * Compare orders the keys, as for set.
+     */
+    template <class K, class A, class Compare = std::less<K>>
     class map
     {
+        template <class K2, class A2, class Compare2> friend class map;
+        friend struct impl::access;
     private:
+        template <class KHash, class AHash>
+        struct entry_hash;
+
         struct entry {
-            entry(K k, A a)
-            : k(k),
-              oa(boost::make_optional(a))
+            /*!
+             * The hash of an entry's contents.  See set::content_hash().
+             */
+            typedef entry_hash<heist::content_hasher<K>, heist::content_hasher<A>> content_hasher;
+
+            template <class KArg, class AArg>
+            entry(KArg&& k, AArg&& a)
+            : k(std::forward<KArg>(k)),
+              oa(std::forward<AArg>(a))
             { }
-            entry(K k)  // For searching
-            : k(k)
+            template <class KArg, class... Args>
+            entry(KArg&& k, boost::in_place_init_t, Args&&... args)
+            : k(std::forward<KArg>(k)),
+              oa(boost::in_place_init, std::forward<Args>(args)...)
             { }
             K k;
-            long long unique;
             boost::optional<A> oa;
+        };
 
-            bool operator < (const entry& other) const { return k < other.k; }
-            bool operator == (const entry& other) const { return k == other.k; }
+        /*!
+         * Orders entries by key with a single three-way comparison.  It's
+         * transparent so the set can be searched by key (or anything that Compare
+         * can compare with a key) without constructing an entry.
+         */
+        struct entry_compare {
+            typedef void is_transparent;
+            entry_compare() {}
+            explicit entry_compare(const Compare& compare) : compare(compare) {}
+            Compare compare;
+            int operator () (const entry& x, const entry& y) const {
+                return impl::three_way<Compare, K, K>::compare(compare, x.k, y.k);
+            }
+            template <class Q>
+            int operator () (const Q& q, const entry& e) const {
+                return impl::three_way<Compare, Q, K>::compare(compare, q, e.k);
+            }
         };
 
-        set<entry> entries;
+        template <class KHash, class AHash>
+        struct entry_hash {
+            size_t operator () (const entry& e) const {
+                return impl::hash_combine(KHash()(e.k), AHash()(e.oa.get()));
+            }
+        };
 
-        map(const set<entry>& entries)
+        struct entry_equal {
+            bool operator () (const entry& x, const entry& y) const {
+                return x.k == y.k && x.oa.get() == y.oa.get();
+            }
+        };
+
+        typedef set<entry, entry_compare> entry_set;
+
+        entry_set entries;
+
+        map(const entry_set& entries)
             : entries(entries)
         {
         }
 
-        static map<K, A> from_list(const heist::list<std::tuple<K,A>>& pairs)
+        map(entry_set&& entries)
+            : entries(std::move(entries))
         {
-            return pairs.template foldl<map<K, A>>([] (const map<K, A>& m, const std::tuple<K, A>& ka) {
+        }
+
+        static map from_list(const heist::list<std::tuple<K,A>>& pairs, const Compare& compare)
+        {
+            return pairs.template foldl<map>([] (const map& m, const std::tuple<K, A>& ka) {
                     return m.insert(std::get<0>(ka), std::get<1>(ka));
-                }, map<K, A>());
+                }, map(compare));
         }
 
-        static map<K, A> from_pairs(const heist::list<std::pair<K,A>>& pairs)
+        static map from_pairs(const heist::list<std::pair<K,A>>& pairs, const Compare& compare)
         {
-            return pairs.template foldl<map<K, A>>([] (const map<K, A>& m, const std::pair<K, A>& ka) {
+            return pairs.template foldl<map>([] (const map& m, const std::pair<K, A>& ka) {
                     return m.insert(ka.first, ka.second);
-                }, map<K, A>());
+                }, map(compare));
         }
 
     public:
         class iterator {
-            friend class map<K,A>;
+            friend class map<K, A, Compare>;
         private:
-            iterator(typename set<entry>::iterator it) : it(it) {}
-            typename set<entry>::iterator it;
+            iterator(typename entry_set::iterator it) : it(std::move(it)) {}
+            typename entry_set::iterator it;
         public:
-            map<K, A> remove() const
+            map remove() const
             {
-                return map<K, A>(it.remove());
+                return map(it.remove());
             }
 
             boost::optional<iterator> next() const {
                 auto oit = it.next();
                 if (oit)
-                    return boost::make_optional(iterator(oit.get()));
+                    return boost::make_optional(iterator(std::move(oit.get())));
                 else
                     return boost::optional<iterator>();
             }
@@ -75,7 +126,7 @@ namespace heist {
             boost::optional<iterator> prev() const {
                 auto oit = it.prev();
                 if (oit)
-                    return boost::make_optional(iterator(oit.get()));
+                    return boost::make_optional(iterator(std::move(oit.get())));
                 else
                     return boost::optional<iterator>();
             }
@@ -84,34 +135,85 @@ namespace heist {
             const A& get_value() const {return it.get().oa.get();}
         };
 
+    private:
+        static boost::optional<iterator> wrap(boost::optional<typename entry_set::iterator> oit)
+        {
+            if (oit)
+                return boost::make_optional(iterator(std::move(oit.get())));
+            else
+                return boost::optional<iterator>();
+        }
+
+        template <class Q>
+        boost::optional<A> lookup_(const Q& k) const {
+            const entry* e = entries.search_(k);
+            if (e != NULL)
+                return e->oa;
+            else
+                return boost::optional<A>();
+        }
+
+    public:
         map() {}
 
-        map(const heist::list<std::pair<K,A>>& pairs) {
-            *this = from_pairs(pairs);
+        explicit map(const Compare& compare)
+            : entries(entry_compare(compare))
+        {
         }
 
-        map(const heist::list<std::tuple<K,A>>& tuples) {
-            *this = from_list(tuples);
+        map(const heist::list<std::pair<K,A>>& pairs, const Compare& compare = Compare()) {
+            *this = from_pairs(pairs, compare);
         }
 
-        map(std::initializer_list<std::pair<K,A>> il) {
-            *this = from_pairs(heist::list<std::pair<K,A>>(il));
+        map(const heist::list<std::tuple<K,A>>& tuples, const Compare& compare = Compare()) {
+            *this = from_list(tuples, compare);
         }
 
-        map<K, A> insert(K k, A a) const {
-            return map<K, A>(entries.insert(entry(k, a)));
+        map(std::initializer_list<std::pair<K,A>> il, const Compare& compare = Compare()) {
+            *this = from_pairs(heist::list<std::pair<K,A>>(il), compare);
         }
 
-        map<K, A> remove(K k) const {
+        /*!
+         * The ordering of the keys.
+         */
+        const Compare& key_comp() const { return entries.key_comp().compare; }
+
+        map insert(const K& k, const A& a) const {
+            return emplace(k, a);
+        }
+
+        map insert(const K& k, A&& a) const {
+            return emplace(k, std::move(a));
+        }
+
+        map insert(K&& k, const A& a) const {
+            return emplace(std::move(k), a);
+        }
+
+        map insert(K&& k, A&& a) const {
+            return emplace(std::move(k), std::move(a));
+        }
+
+        /*!
+         * Insert a value constructed in place from args.  The key and arguments are
+         * forwarded all the way to the new tree node, so nothing is copied.
+         */
+        template <class KArg, class... Args>
+        map emplace(KArg&& k, Args&&... args) const {
+            return map(entries.emplace(std::forward<KArg>(k), boost::in_place_init,
+                                             std::forward<Args>(args)...));
+        }
+
+        map remove(K k) const {
             auto oit = find(k);
             return oit ? oit.get().remove()
-                       : map<K, A>(*this);
+                       : map(*this);
         }
 
         boost::optional<iterator> begin() const {
             auto oit = entries.begin();
             if (oit)
-                return boost::make_optional(iterator(oit.get()));
+                return boost::make_optional(iterator(std::move(oit.get())));
             else
                 return boost::optional<iterator>();
         };
@@ -119,7 +221,7 @@ namespace heist {
         boost::optional<iterator> end() const {
             auto oit = entries.end();
             if (oit)
-                return boost::make_optional(iterator(oit.get()));
+                return boost::make_optional(iterator(std::move(oit.get())));
             else
                 return boost::optional<iterator>();
         };
@@ -129,11 +231,17 @@ namespace heist {
          * undefined if all values are < the pivot.
          */
         boost::optional<iterator> lower_bound(const K& k) const {
-            auto oit = entries.lower_bound(entry(k));
-            if (oit)
-                return boost::make_optional(iterator(oit.get()));
-            else
-                return boost::optional<iterator>();
+            return wrap(entries.lower_bound(k));
+        }
+
+        /*!
+         * Heterogeneous lower_bound: k can be of any type that K can be compared
+         * with, e.g. a const char* for a std::string key.  See set::lower_bound.
+         */
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, K, Q>::value, boost::optional<iterator>>::type
+            lower_bound(const Q& k) const {
+            return wrap(entries.lower_bound(k));
         }
 
         /*!
@@ -141,66 +249,103 @@ namespace heist {
          * undefined if all values are > the pivot.
          */
         boost::optional<iterator> upper_bound(const K& k) const {
-            auto oit = entries.upper_bound(entry(k));
-            if (oit)
-                return boost::make_optional(iterator(oit.get()));
-            else
-                return boost::optional<iterator>();
+            return wrap(entries.upper_bound(k));
+        }
+
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, K, Q>::value, boost::optional<iterator>>::type
+            upper_bound(const Q& k) const {
+            return wrap(entries.upper_bound(k));
         }
 
         boost::optional<iterator> find(const K& k) const {
-            auto oit = entries.find(entry(k));
-            if (oit)
-                return boost::make_optional(iterator(oit.get()));
-            else
-                return boost::optional<iterator>();
+            return wrap(entries.find(k));
+        }
+
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, K, Q>::value, boost::optional<iterator>>::type
+            find(const Q& k) const {
+            return wrap(entries.find(k));
+        }
+
+        bool contains(const K& k) const {
+            return entries.contains(k);
+        }
+
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, K, Q>::value, bool>::type
+            contains(const Q& k) const {
+            return entries.contains(k);
         }
 
         boost::optional<A> lookup(const K& k) const {
-            auto it0 = find(k);
-            if (it0)
-                return boost::make_optional(it0.get().get_value());
-            else
-                return boost::optional<A>();
+            return lookup_(k);
+        }
+
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, K, Q>::value, boost::optional<A>>::type
+            lookup(const Q& k) const {
+            return lookup_(k);
         }
 
         /*!
-         * Alter the specified entry in the map, where boost::optional<A>() means
-         * 'not present'.
+         * Alter the specified entry in the map in a single descent of the tree, where
+         * boost::optional<A>() means 'not present'.  See update() and upsert() for
+         * variants that pass the existing value to f by reference.
          */
-        map<K, A> alter(const K& k, std::function<boost::optional<A>(boost::optional<A>)> f) const {
-            auto it0 = find(k);
-            if (it0) {
-                auto it = it0.get();
-                auto newOA = f(boost::make_optional(it.get_value()));
-                if (newOA)
-                    return insert(k, newOA.get());
-                else
-                    return it.remove();
-            }
-            else {
-                auto newOA = f(boost::optional<A>());
+        template <class Fn>
+        map alter(const K& k, const Fn& f) const {
+            return map(entries.alter(k, [&k, &f] (boost::optional<const entry&> oe) -> boost::optional<entry> {
+                boost::optional<A> newOA = f(oe ? oe.get().oa : boost::optional<A>());
                 if (newOA)
-                    return insert(k, newOA.get());
-                else
-                    return *this;
-            }
+                    return boost::make_optional(entry(k, std::move(newOA.get())));
+                return boost::optional<entry>();
+            }));
         }
 
         /*!
          * Adjust the specified entry in the map if it's present, no-op otherwise.
          */
-        map<K, A> adjust(const K& k, std::function<A(A)> f) const {
-            auto it0 = find(k);
-            if (it0)
-                return insert(k, f(it0.get().get_value()));
-            else
-                return *this;
+        template <class Fn>
+        map adjust(const K& k, const Fn& f) const {
+            return update(k, [&f] (const A& a) { return boost::make_optional<A>(f(a)); });
+        }
+
+        /*!
+         * Update the specified entry in a single descent of the tree if it's present,
+         * no-op otherwise.  f returns the new value, or boost::none to indicate that
+         * the value is unchanged, in which case this map is returned untouched.
+         */
+        template <class Fn>
+        map update(const K& k, const Fn& f) const {
+            return map(entries.update(k, [&f] (boost::optional<const entry&> oe) -> boost::optional<entry> {
+                if (oe) {
+                    boost::optional<A> newOA = f(oe.get().oa.get());
+                    if (newOA)
+                        return boost::make_optional(entry(oe.get().k, std::move(newOA.get())));
+                }
+                return boost::optional<entry>();
+            }));
         }
 
-        bool operator == (const map<K, A>& other) const {
-            boost::optional<map<K, A>::iterator> it1 = begin();
-            boost::optional<map<K, A>::iterator> it2 = other.begin();
+        /*!
+         * Insert or update the specified entry in a single descent of the tree.  f is
+         * passed the existing value, or boost::none if the key isn't present, and
+         * returns the value to store.
+         */
+        template <class Fn>
+        map upsert(const K& k, const Fn& f) const {
+            return map(entries.update(k, [&k, &f] (boost::optional<const entry&> oe) {
+                return boost::make_optional(
+                    oe ? entry(oe.get().k, f(boost::optional<const A&>(oe.get().oa.get())))
+                       : entry(k, f(boost::optional<const A&>())));
+            }));
+        }
+
+        bool operator == (const map& other) const {
+            if (identical(other)) return true;
+            boost::optional<iterator> it1 = begin();
+            boost::optional<iterator> it2 = other.begin();
             while (it1 && it2) {
                 if (!(it1.get().get_key() == it2.get().get_key())) return false;
                 if (!(it1.get().get_value() == it2.get().get_value())) return false;
@@ -210,16 +355,16 @@ namespace heist {
             return !it1 && !it2;
         }
 
-        bool operator != (const map<K, A>& other) const {
+        bool operator != (const map& other) const {
             return ! (*this == other);
         }
 
-        bool operator < (const map<K, A>& other) const {
-            boost::optional<map<K, A>::iterator> it1 = begin();
-            boost::optional<map<K, A>::iterator> it2 = other.begin();
+        bool operator < (const map& other) const {
+            boost::optional<iterator> it1 = begin();
+            boost::optional<iterator> it2 = other.begin();
             while (it1 && it2) {
-                if (it1.get().get_key() < it2.get().get_key()) return true;
-                if (it2.get().get_key() < it1.get().get_key()) return false;
+                int c = impl::three_way<Compare, K, K>::compare(key_comp(), it1.get().get_key(), it2.get().get_key());
+                if (c != 0) return c < 0;
                 if (it1.get().get_value() < it2.get().get_value()) return true;
                 if (it2.get().get_value() < it1.get().get_value()) return false;
                 it1 = it1.get().next();
@@ -228,15 +373,15 @@ namespace heist {
             return (bool)it2;
         }
 
-        bool operator > (const map<K, A>& other) const {
+        bool operator > (const map& other) const {
             return other < *this;
         }
 
-        bool operator <= (const map<K, A>& other) const {
+        bool operator <= (const map& other) const {
             return !(*this > other);
         }
 
-        bool operator >= (const map<K, A>& other) const {
+        bool operator >= (const map& other) const {
             return !(*this < other);
         }
 
@@ -266,17 +411,33 @@ namespace heist {
          * map a function over the map elements.
          */
         template <class Fn>
-        map<K, typename std::result_of<Fn(A)>::type> map_(const Fn& f) const {
+        map<K, typename std::result_of<Fn(A)>::type, Compare> map_(const Fn& f) const {
+            return map_values(f);
+        }
+
+        /*!
+         * Map a function over the map's values in O(N).  The keys are unchanged, so
+         * the new map has exactly the same tree shape as this one and no key
+         * comparisons are made.  If parallel_depth > 0, the subtrees at the top
+         * parallel_depth levels of the tree are mapped on separate threads, in which
+         * case f must be thread-safe.  No more than std::thread::hardware_concurrency()
+         * threads run at once, counting the caller's; beyond that, subtrees are mapped
+         * on their parent's thread.
+         */
+        template <class Fn>
+        map<K, typename std::result_of<Fn(A)>::type, Compare> map_values(const Fn& f, int parallel_depth = 0) const {
             typedef typename std::result_of<Fn(A)>::type B;
-            return this->to_list().template foldl<map<K, B>>([f] (const map<K, B>& m, std::tuple<K, A> ka) {
-                    return m.insert(std::get<0>(ka), f(std::get<1>(ka)));
-                }, map<K, B>());
+            typedef typename map<K, B, Compare>::entry entryB;
+            typedef typename map<K, B, Compare>::entry_compare entry_compareB;
+            return map<K, B, Compare>(entries.template map_monotonic<entryB, entry_compareB>([&f] (const entry& e) {
+                    return entryB(e.k, f(e.oa.get()));
+                }, parallel_depth, entry_compareB(key_comp())));
         }
 
         template <class B>
         static
         B foldl(std::function<B(const B&, const K&, const A&)> f, B a,
-            boost::optional<typename heist::map<K,A>::iterator> oit)
+            boost::optional<iterator> oit)
         {
             while (oit) {
                 auto it = oit.get();
@@ -295,20 +456,75 @@ namespace heist {
             return foldl<B>(f, a, this->begin());
         }
 
+        /*!
+         * Return this map with everything that was allocated in an arena copied to
+         * the heap, so it can outlive the arena.  See arena.h.
+         */
+        map promote() const {
+            return map(entries.promote());
+        }
+
+        /*!
+         * Return this map with its entries and nodes replaced by canonical copies from
+         * a global intern table, so that equal entries and subtrees of all interned
+         * maps share memory, and interned maps with the same contents built in the
+         * same order are identical().  See set::intern().
+         */
+        template <class KHash = std::hash<K>, class AHash = std::hash<A>>
+        map intern() const {
+            return map(entries.template intern<entry_hash<KHash, AHash>, entry_equal>());
+        }
+
+        /*!
+         * True if this map and other have the same root node, which means they are
+         * equal.  O(1).
+         */
+        bool identical(const map& other) const {
+            return entries.identical(other.entries);
+        }
+
+        /*!
+         * A hash of the map's contents that doesn't depend on the shape of its tree.
+         * Maps with different hashes are certainly different.  Keys and values are
+         * hashed with heist::content_hasher.  See set::content_hash().
+         */
+        size_t content_hash() const {
+            return entries.content_hash();
+        }
+
+        /*!
+         * Call f(k, inThis, inOther) in key order for every key whose entry differs
+         * between this map and other, where inThis and inOther are its values in each
+         * map, or boost::none if it's missing.  Subtrees with the same contents are
+         * skipped using the cached hashes, even if they aren't shared, so it's cheap
+         * to compare e.g. a snapshot reloaded from disk with the live version.  Like
+         * set::diff(), it's probabilistic: A hash collision between two different
+         * subtrees hides their differences.
+         */
+        template <class Fn>
+        void diff(const map& other, const Fn& f) const {
+            entries.template diff<entry_equal>(other.entries,
+                [&f] (boost::optional<const entry&> x, boost::optional<const entry&> y) {
+                    f(x ? x.get().k : y.get().k,
+                      x ? boost::optional<const A&>(x.get().oa.get()) : boost::optional<const A&>(),
+                      y ? boost::optional<const A&>(y.get().oa.get()) : boost::optional<const A&>());
+                });
+        }
+
         /*!
          * Monoidal append = set union.
          */
-        map<K, A> operator + (const map<K, A>& other) const {
-            return other.template foldl<map<K, A>>([] (const map<K, A>& m, const K& k, const A& a)
+        map operator + (const map& other) const {
+            return other.template foldl<map>([] (const map& m, const K& k, const A& a)
                       {return m.insert(k, a);}, *this);
         }
 
         /*!
          * Return this map minus the specified keys.
          */
-        map<K, A> operator - (const list<K>& keys) const {
-            return keys.template foldl<map<K,A>>(
-                [] (const map<K, A>& m, const K& key) {
+        map operator - (const list<K>& keys) const {
+            return keys.template foldl<map>(
+                [] (const map& m, const K& key) {
                     return m.remove(key);
                 }, *this);
         }
@@ -316,13 +532,13 @@ namespace heist {
         /*!
          * Return this map minus the keys from the second map.
          */
-        map<K, A> operator - (const map<K, A>& other) const {
+        map operator - (const map& other) const {
             return *this - other.keys();
         }
 
-        map<K, A> filter(std::function<bool(const A&)> pred) const
+        map filter(std::function<bool(const A&)> pred) const
         {
-            map<K, A> out;
+            map out(key_comp());
             for (auto o_iter = begin(); o_iter; o_iter = o_iter.get().next()) {
                 const auto& key = o_iter.get().get_key();
                 const auto& value = o_iter.get().get_value();
@@ -332,9 +548,9 @@ namespace heist {
             return out;
         }
 
-        map<K, A> filter_with_key(std::function<bool(const K&, const A&)> pred) const
+        map filter_with_key(std::function<bool(const K&, const A&)> pred) const
         {
-            map<K, A> out;
+            map out(key_comp());
             for (auto o_iter = begin(); o_iter; o_iter = o_iter.get().next()) {
                 const auto& key = o_iter.get().get_key();
                 const auto& value = o_iter.get().get_value();
@@ -350,8 +566,8 @@ namespace heist {
         operator bool () const { return (bool)entries; }
     };
 
-    template <class K, class A>
-    std::ostream& operator << (std::ostream& os, const heist::map<K, A>& m)
+    template <class K, class A, class Compare>
+    std::ostream& operator << (std::ostream& os, const heist::map<K, A, Compare>& m)
     {
         os << "{";
         bool first = true;
@@ -366,4 +582,11 @@ namespace heist {
     }
 };
 
+namespace std {
+    template <class K, class A, class Compare>
+    struct hash<heist::map<K, A, Compare>> {
+        size_t operator () (const heist::map<K, A, Compare>& m) const { return m.content_hash(); }
+    };
+}
+
 #endif
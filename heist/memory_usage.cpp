@@ -0,0 +1,113 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#include <heist/memory_usage.h>
+
+
+namespace heist {
+    memory_stats& memory_stats::operator += (const memory_stats& other)
+    {
+        nodes += other.nodes;
+        elements += other.elements;
+        element_bytes += other.element_bytes;
+        overhead_bytes += other.overhead_bytes;
+        return *this;
+    }
+
+    memory_stats& memory_stats::operator -= (const memory_stats& other)
+    {
+        nodes -= other.nodes;
+        elements -= other.elements;
+        element_bytes -= other.element_bytes;
+        overhead_bytes -= other.overhead_bytes;
+        return *this;
+    }
+
+    namespace impl {
+        namespace {
+            void add_element(memory_stats& st, const Ptr& e, const element_sizer& size,
+                             const element_counter& count_of)
+            {
+                st.elements += count_of ? count_of(e.value) : 1;
+                st.element_bytes += size(e.value);
+                st.overhead_bytes += sizeof(count);
+            }
+
+            void add_node(memory_stats& st, const Node& n)
+            {
+                st.nodes++;
+                st.overhead_bytes += sizeof(Node) + sizeof(count) + n.payload_bytes();
+            }
+
+            /*!
+             * The root node is held by value in the container, so only its payload is
+             * separately allocated.  It's never shared.
+             */
+            void add_root(memory_stats& st, const Node& n)
+            {
+                st.nodes++;
+                st.overhead_bytes += n.payload_bytes();
+            }
+
+            void add_subtree(memory_stats& st, const Node& n, const element_sizer& size,
+                             const element_counter& count_of)
+            {
+                n.walk([&st] (const Node& c) { add_node(st, c); return true; },
+                       [&st, &size, &count_of] (const Ptr& e) { add_element(st, e, size, count_of); });
+            }
+        }
+
+        memory_stats tree_usage(const boost::optional<Node>& r, const element_sizer& size,
+                                const element_counter& count_of)
+        {
+            memory_stats st;
+            if (r) {
+                add_root(st, r.get());
+                add_subtree(st, r.get(), size, count_of);
+            }
+            return st;
+        }
+
+        memory_sharing tree_sharing(const boost::optional<Node>& a, const boost::optional<Node>& b,
+                                    const element_sizer& size, const element_counter& count_of)
+        {
+            std::unordered_set<const void*> inA;
+            memory_stats totalA;
+            if (a) {
+                add_root(totalA, a.get());
+                a.get().walk([&inA, &totalA] (const Node& c) {
+                                 inA.insert(&c);
+                                 add_node(totalA, c);
+                                 return true;
+                             },
+                             [&inA, &totalA, &size, &count_of] (const Ptr& e) {
+                                 inA.insert(e.value);
+                                 add_element(totalA, e, size, count_of);
+                             });
+            }
+            memory_sharing out;
+            if (b) {
+                add_root(out.only_second, b.get());
+                // A node that's in both trees means its whole subtree is shared.
+                b.get().walk([&inA, &out, &size, &count_of] (const Node& c) -> bool {
+                                 if (inA.count(&c) != 0) {
+                                     add_node(out.shared, c);
+                                     add_subtree(out.shared, c, size, count_of);
+                                     return false;
+                                 }
+                                 add_node(out.only_second, c);
+                                 return true;
+                             },
+                             [&inA, &out, &size, &count_of] (const Ptr& e) {
+                                 add_element(inA.count(e.value) != 0 ? out.shared : out.only_second,
+                                             e, size, count_of);
+                             });
+            }
+            out.only_first = totalA;
+            out.only_first -= out.shared;
+            return out;
+        }
+    }
+}
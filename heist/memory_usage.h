@@ -0,0 +1,268 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_MEMORY_USAGE_H_
+#define _HEIST_MEMORY_USAGE_H_
+/*
+ * Memory accounting for versions of data structures.
+ *
+ * Because versions share structure, the memory a version pins isn't the same as
+ * what dropping it would free.  memory_usage() reports everything a version holds;
+ * memory_sharing() splits two versions into what they share and what's unique to
+ * each, i.e. what dropping one of them would free while the other is retained.
+ * Sharing is detected by node identity, so the cost is linear in the sizes of the
+ * versions.
+ *
+ * Sizes are by sizeof, not counting allocator rounding.  Elements are counted as
+ * sizeof the element unless you pass a function that returns the bytes an element
+ * holds, e.g. including a string's characters.
+ */
+
+#include <heist/set.h>
+#include <heist/map.h>
+#include <heist/multimap.h>
+#include <heist/list.h>
+#include <unordered_set>
+
+namespace heist {
+    /*!
+     * Approximate memory held by a data structure, or part of one.
+     */
+    struct memory_stats {
+        memory_stats() : nodes(0), elements(0), element_bytes(0), overhead_bytes(0) {}
+        size_t nodes;           // Tree nodes or list cells
+        size_t elements;
+        size_t element_bytes;   // The elements themselves
+        size_t overhead_bytes;  // Nodes, reference counts and other bookkeeping
+        size_t bytes() const { return element_bytes + overhead_bytes; }
+        memory_stats& operator += (const memory_stats& other);
+        memory_stats& operator -= (const memory_stats& other);
+    };
+
+    /*!
+     * The memory of two versions, split three ways.
+     */
+    struct memory_sharing {
+        memory_stats shared;        // Held by both, so dropping either frees none of it
+        memory_stats only_first;    // Freed by dropping the first
+        memory_stats only_second;   // Freed by dropping the second
+    };
+
+    namespace impl {
+        typedef std::function<size_t(const void*)> element_sizer;
+        /*!
+         * How many elements a tree element counts as, where empty means one.
+         */
+        typedef std::function<size_t(const void*)> element_counter;
+
+        memory_stats tree_usage(const boost::optional<Node>& r, const element_sizer& size,
+                                const element_counter& count_of = element_counter());
+        memory_sharing tree_sharing(const boost::optional<Node>& a, const boost::optional<Node>& b,
+                                    const element_sizer& size,
+                                    const element_counter& count_of = element_counter());
+
+        struct access {
+            template <class A, class C>
+            static const boost::optional<Node>& root(const set<A, C>& s) { return s.r; }
+            template <class K, class A, class C>
+            static const boost::optional<Node>& root(const map<K, A, C>& m) { return m.entries.r; }
+            template <class K, class A, class C>
+            static const boost::optional<Node>& root(const multimap<K, A, C>& m) { return m.entries.r; }
+
+            template <class A>
+            static element_sizer sizer() {
+                return [] (const void*) { return sizeof(A); };
+            }
+            template <class A, class C, class Fn>
+            static element_sizer sizer(const set<A, C>&, const Fn& f) {
+                return [f] (const void* a) -> size_t { return f(*(const A*)a); };
+            }
+            template <class K, class A, class C>
+            static element_sizer sizer(const map<K, A, C>&) {
+                return sizer<typename map<K, A, C>::entry>();
+            }
+            template <class K, class A, class C, class Fn>
+            static element_sizer sizer(const map<K, A, C>&, const Fn& f) {
+                typedef typename map<K, A, C>::entry entry;
+                return [f] (const void* e) -> size_t {
+                    return f(((const entry*)e)->k, ((const entry*)e)->oa.get());
+                };
+            }
+            /*!
+             * A multimap entry holds all of one key's values.  The ones after the
+             * first are counted as if they were packed into the entry's overflow
+             * block, leaving out their seq's nodes.
+             */
+            template <class K, class A, class C>
+            static element_sizer sizer(const multimap<K, A, C>&) {
+                typedef typename multimap<K, A, C>::entry entry;
+                typedef typename multimap<K, A, C>::overflow overflow;
+                return [] (const void* e) -> size_t {
+                    const entry& en = *(const entry*)e;
+                    return sizeof(entry) + (en.more ? sizeof(overflow) + en.more->values.size() * sizeof(A) : 0);
+                };
+            }
+            template <class K, class A, class C, class Fn>
+            static element_sizer sizer(const multimap<K, A, C>&, const Fn& f) {
+                typedef typename multimap<K, A, C>::entry entry;
+                return [f] (const void* e) -> size_t {
+                    const entry& en = *(const entry*)e;
+                    return en.rest().template foldl<size_t>([&f, &en] (size_t n, const A& a) {
+                            return n + f(en.k, a);
+                        }, f(en.k, en.first));
+                };
+            }
+
+            /*!
+             * Each multimap entry counts as all of its key's values.
+             */
+            template <class K, class A, class C>
+            static element_counter counter(const multimap<K, A, C>&) {
+                typedef typename multimap<K, A, C>::entry entry;
+                return [] (const void* e) { return ((const entry*)e)->count(); };
+            }
+
+            template <class A, class Fn>
+            static void add_cell(memory_stats& st, const cons<A>* c, const Fn& f) {
+                st.nodes++;
+                st.elements++;
+                st.element_bytes += f(c->head);
+                st.overhead_bytes += sizeof(cons<A>) - sizeof(A);
+            }
+            template <class A, class Fn>
+            static memory_stats list_usage(const list<A>& l, const Fn& f) {
+                memory_stats st;
+                for (const cons<A>* c = l.ocons.get(); c != NULL; c = c->tail.get())
+                    add_cell(st, c, f);
+                return st;
+            }
+            /*!
+             * Lists can only share a suffix.
+             */
+            template <class A, class Fn>
+            static memory_sharing list_sharing(const list<A>& a, const list<A>& b, const Fn& f) {
+                std::unordered_set<const void*> inA;
+                memory_stats totalA;
+                for (const cons<A>* c = a.ocons.get(); c != NULL; c = c->tail.get()) {
+                    inA.insert(c);
+                    add_cell(totalA, c, f);
+                }
+                memory_sharing out;
+                const cons<A>* c = b.ocons.get();
+                for (; c != NULL && inA.count(c) == 0; c = c->tail.get())
+                    add_cell(out.only_second, c, f);
+                for (; c != NULL; c = c->tail.get())
+                    add_cell(out.shared, c, f);
+                out.only_first = totalA;
+                out.only_first -= out.shared;
+                return out;
+            }
+        };
+    }
+
+    template <class A, class C>
+    memory_stats memory_usage(const set<A, C>& s) {
+        return impl::tree_usage(impl::access::root(s), impl::access::sizer<A>());
+    }
+
+    /*!
+     * element_bytes(a) returns the bytes held by element a.
+     */
+    template <class A, class C, class Fn>
+    memory_stats memory_usage(const set<A, C>& s, const Fn& element_bytes) {
+        return impl::tree_usage(impl::access::root(s), impl::access::sizer(s, element_bytes));
+    }
+
+    template <class K, class A, class C>
+    memory_stats memory_usage(const map<K, A, C>& m) {
+        return impl::tree_usage(impl::access::root(m), impl::access::sizer(m));
+    }
+
+    /*!
+     * entry_bytes(k, a) returns the bytes held by the entry mapping k to a.
+     */
+    template <class K, class A, class C, class Fn>
+    memory_stats memory_usage(const map<K, A, C>& m, const Fn& entry_bytes) {
+        return impl::tree_usage(impl::access::root(m), impl::access::sizer(m, entry_bytes));
+    }
+
+    /*!
+     * A multimap's figures are approximate: Each key's values after the first are
+     * counted as if they were packed together, without the nodes of the seq that
+     * holds them.
+     */
+    template <class K, class A, class C>
+    memory_stats memory_usage(const multimap<K, A, C>& m) {
+        return impl::tree_usage(impl::access::root(m), impl::access::sizer(m), impl::access::counter(m));
+    }
+
+    template <class K, class A, class C, class Fn>
+    memory_stats memory_usage(const multimap<K, A, C>& m, const Fn& entry_bytes) {
+        return impl::tree_usage(impl::access::root(m), impl::access::sizer(m, entry_bytes),
+                                impl::access::counter(m));
+    }
+
+    template <class A>
+    memory_stats memory_usage(const list<A>& l) {
+        return impl::access::list_usage(l, [] (const A&) { return sizeof(A); });
+    }
+
+    template <class A, class Fn>
+    memory_stats memory_usage(const list<A>& l, const Fn& element_bytes) {
+        return impl::access::list_usage(l, element_bytes);
+    }
+
+    template <class A, class C>
+    memory_sharing shared_bytes(const set<A, C>& a, const set<A, C>& b) {
+        return impl::tree_sharing(impl::access::root(a), impl::access::root(b), impl::access::sizer<A>());
+    }
+
+    template <class A, class C, class Fn>
+    memory_sharing shared_bytes(const set<A, C>& a, const set<A, C>& b, const Fn& element_bytes) {
+        return impl::tree_sharing(impl::access::root(a), impl::access::root(b),
+                                  impl::access::sizer(a, element_bytes));
+    }
+
+    template <class K, class A, class C>
+    memory_sharing shared_bytes(const map<K, A, C>& a, const map<K, A, C>& b) {
+        return impl::tree_sharing(impl::access::root(a), impl::access::root(b), impl::access::sizer(a));
+    }
+
+    template <class K, class A, class C, class Fn>
+    memory_sharing shared_bytes(const map<K, A, C>& a, const map<K, A, C>& b, const Fn& entry_bytes) {
+        return impl::tree_sharing(impl::access::root(a), impl::access::root(b),
+                                  impl::access::sizer(a, entry_bytes));
+    }
+
+    /*!
+     * Approximate, as for memory_usage(const multimap&).  Sharing is only seen
+     * down to the tree's entries: A key's extra values count as unique to each
+     * version whose entry for that key isn't shared, even where the two versions
+     * share the seq nodes that hold them.
+     */
+    template <class K, class A, class C>
+    memory_sharing shared_bytes(const multimap<K, A, C>& a, const multimap<K, A, C>& b) {
+        return impl::tree_sharing(impl::access::root(a), impl::access::root(b), impl::access::sizer(a),
+                                  impl::access::counter(a));
+    }
+
+    template <class K, class A, class C, class Fn>
+    memory_sharing shared_bytes(const multimap<K, A, C>& a, const multimap<K, A, C>& b, const Fn& entry_bytes) {
+        return impl::tree_sharing(impl::access::root(a), impl::access::root(b),
+                                  impl::access::sizer(a, entry_bytes), impl::access::counter(a));
+    }
+
+    template <class A>
+    memory_sharing shared_bytes(const list<A>& a, const list<A>& b) {
+        return impl::access::list_sharing(a, b, [] (const A&) { return sizeof(A); });
+    }
+
+    template <class A, class Fn>
+    memory_sharing shared_bytes(const list<A>& a, const list<A>& b, const Fn& element_bytes) {
+        return impl::access::list_sharing(a, b, element_bytes);
+    }
+}
+
+#endif
@@ -7,135 +7,331 @@
 #define _HEIST_MULTIMAP_H_
 
 #include <heist/set.h>
-#include <heist/supply.h>
+#include <heist/seq.h>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <initializer_list>
 #include <iostream>
 
 
 namespace heist {
-    template <class K, class A>
+    /*!
+     * Compare orders the keys, as for set.
+     *
+     * The tree has one entry per key, holding that key's values in the order they
+     * were inserted: the first one in the entry itself, and the rest in a seq that
+     * the entry points to, so a key with one value only costs a null pointer more
+     * than it does in a map.  Finding a key, count() and inserting one or many
+     * values under a key are O(log N) in the number of keys.
+     */
+    template <class K, class A, class Compare = std::less<K>>
     class multimap
     {
+        template <class K2, class A2, class Compare2> friend class multimap;
+        friend struct impl::access;
     private:
+        /*!
+         * The values of a key after its first.
+         */
+        struct overflow : impl::pooled {
+            explicit overflow(seq<A> values) : ref_count(0), values(std::move(values)) {}
+            std::atomic<int> ref_count;
+            const seq<A> values;
+
+            friend void intrusive_ptr_add_ref(overflow* p) {
+                p->ref_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            friend void intrusive_ptr_release(overflow* p) {
+                if (p->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete p;
+            }
+        };
+
         struct entry {
-            entry(K k, long long unique, A a)
-            : k(k),
-              unique(unique),
-              oa(boost::make_optional(a))
-            { }
-            entry(K k)  // For searching
-            : k(k),
-              unique(0)
+            template <class KArg, class AArg>
+            entry(KArg&& k, AArg&& first, seq<A> rest = seq<A>())
+            : k(std::forward<KArg>(k)),
+              first(std::forward<AArg>(first)),
+              more(rest ? new overflow(std::move(rest)) : NULL)
             { }
             K k;
-            long long unique;
-            boost::optional<A> oa;
+            A first;
+            boost::intrusive_ptr<overflow> more;  // NULL if k has one value
+            const seq<A>& rest() const {
+                static const seq<A> none;
+                return more ? more->values : none;
+            }
+            size_t count() const { return more ? more->values.size() + 1 : 1; }
+            const A& operator [] (size_t i) const { return i == 0 ? first : more->values[i - 1]; }
+        };
 
-            bool operator < (const entry& other) const {
-                return k == other.k ? unique < other.unique
-                                    : k < other.k;
+        /*!
+         * Orders entries by key with a single three-way comparison, and is
+         * transparent so the set can be searched by key.
+         */
+        struct entry_compare {
+            typedef void is_transparent;
+            entry_compare() {}
+            explicit entry_compare(const Compare& compare) : compare(compare) {}
+            Compare compare;
+            int operator () (const entry& x, const entry& y) const {
+                return impl::three_way<Compare, K, K>::compare(compare, x.k, y.k);
             }
-            bool operator == (const entry& other) const {
-                return k == other.k && unique == other.unique;
+            template <class Q>
+            int operator () (const Q& q, const entry& e) const {
+                return impl::three_way<Compare, Q, K>::compare(compare, q, e.k);
             }
         };
 
-        set<entry> entries;
-        supply<long long> sup;     // We assume this supply's value has already been used,
-                                   // so it must always be split before using.
+        typedef set<entry, entry_compare> entry_set;
+
+        entry_set entries;
 
-        multimap(const set<entry>& entries, const supply<long long>& sup)
-            : entries(entries),
-              sup(sup)
+        multimap(const entry_set& entries)
+            : entries(entries)
         {
         }
 
-        static multimap<K, A> from_list(const heist::list<std::tuple<K,A>>& pairs)
+        multimap(entry_set&& entries)
+            : entries(std::move(entries))
         {
-            return pairs.template foldl<multimap<K, A>>([] (const multimap<K, A>& m, const std::tuple<K, A>& ka) {
+        }
+
+        static multimap from_list(const heist::list<std::tuple<K,A>>& pairs, const Compare& compare)
+        {
+            return pairs.template foldl<multimap>([] (const multimap& m, const std::tuple<K, A>& ka) {
                     return m.insert(std::get<0>(ka), std::get<1>(ka));
-                }, multimap<K, A>());
+                }, multimap(compare));
         }
 
-        static multimap<K, A> from_pairs(const heist::list<std::pair<K,A>>& pairs)
+        static multimap from_pairs(const heist::list<std::pair<K,A>>& pairs, const Compare& compare)
         {
-            return pairs.template foldl<multimap<K, A>>([] (const multimap<K, A>& m, const std::pair<K, A>& ka) {
+            return pairs.template foldl<multimap>([] (const multimap& m, const std::pair<K, A>& ka) {
                     return m.insert(ka.first, ka.second);
-                }, multimap<K, A>());
+                }, multimap(compare));
         }
 
     public:
         class iterator {
-            friend class multimap<K,A>;
+            friend class multimap<K, A, Compare>;
         private:
-            iterator(typename set<entry>::iterator it, supply<long long> sup) : it(it), sup(sup) {}
-            typename set<entry>::iterator it;
-            supply<long long> sup;
+            iterator(typename entry_set::iterator it, size_t i) : it(std::move(it)), i(i) {}
+            typename entry_set::iterator it;
+            size_t i;   // The position of the value within its key's values
         public:
-            multimap<K, A> remove() const
+            /*!
+             * Return the multimap without this value.  O(log N).
+             */
+            multimap remove() const
             {
-                return multimap<K, A>(it.remove(), sup);
+                const entry& e = it.get();
+                multimap m(it.remove());
+                if (!e.more)
+                    return m;
+                seq<A> before, after;
+                std::tie(before, after) = e.rest().split_at(i == 0 ? 0 : i - 1);
+                after = std::get<1>(after.split_at(1));
+                return multimap(i == 0 ? m.entries.emplace(e.k, e.rest()[0], after)
+                                       : m.entries.emplace(e.k, e.first, before + after));
             }
 
             boost::optional<iterator> next() const {
+                if (i + 1 < it.get().count())
+                    return boost::make_optional(iterator(it, i + 1));
                 auto oit = it.next();
                 if (oit)
-                    return boost::make_optional(iterator(oit.get(), sup));
+                    return boost::make_optional(iterator(std::move(oit.get()), 0));
                 else
                     return boost::optional<iterator>();
             }
 
             boost::optional<iterator> prev() const {
+                if (i > 0)
+                    return boost::make_optional(iterator(it, i - 1));
                 auto oit = it.prev();
-                if (oit)
-                    return boost::make_optional(iterator(oit.get(), sup));
+                if (oit) {
+                    size_t last = oit.get().get().count() - 1;
+                    return boost::make_optional(iterator(std::move(oit.get()), last));
+                }
                 else
                     return boost::optional<iterator>();
             }
 
             const K& get_key() const {return it.get().k;}
-            const A& get_value() const {return it.get().oa.get();}
+            const A& get_value() const {return it.get()[i];}
         };
 
-        multimap() : sup(0) {}
+        /*!
+         * The values of one key, in the order they were inserted.
+         */
+        class range {
+            friend class multimap<K, A, Compare>;
+        private:
+            range() {}
+            explicit range(typename entry_set::iterator it) : oit(std::move(it)) {}
+            boost::optional<typename entry_set::iterator> oit;
+        public:
+            /*!
+             * The number of values.  O(1).
+             */
+            size_t size() const { return oit ? oit.get().get().count() : 0; }
+
+            /*!
+             * True if there are any values.
+             */
+            operator bool () const { return (bool)oit; }
+
+            /*!
+             * Caller must ensure that i < size().  O(log32 N).
+             */
+            const A& operator [] (size_t i) const { return oit.get().get()[i]; }
+
+            /*!
+             * An iterator pointing at the first value, which continues past the last
+             * one into the rest of the multimap.
+             */
+            boost::optional<iterator> begin() const {
+                if (oit)
+                    return boost::make_optional(iterator(oit.get(), 0));
+                else
+                    return boost::optional<iterator>();
+            }
 
-        multimap(const heist::list<std::pair<K,A>>& pairs) : sup(0) {
-            *this = from_pairs(pairs);
+            /*!
+             * An iterator pointing at the last value.
+             */
+            boost::optional<iterator> end() const {
+                if (oit)
+                    return boost::make_optional(iterator(oit.get(), size() - 1));
+                else
+                    return boost::optional<iterator>();
+            }
+
+            template <class B>
+            B foldl(std::function<B(const B&, const A&)> f, B b) const
+            {
+                if (oit) {
+                    const entry& e = oit.get().get();
+                    b = f(b, e.first);
+                    b = e.rest().template foldl<B>(f, b);
+                }
+                return b;
+            }
+
+            heist::list<A> to_list() const {
+                heist::list<A> acc;
+                for (size_t i = size(); i > 0; i--)
+                    acc = (*this)[i - 1] %= acc;
+                return acc;
+            }
+        };
+
+    private:
+        static boost::optional<iterator> wrap(boost::optional<typename entry_set::iterator> oit, bool last = false)
+        {
+            if (oit) {
+                size_t i = last ? oit.get().get().count() - 1 : 0;
+                return boost::make_optional(iterator(std::move(oit.get()), i));
+            }
+            else
+                return boost::optional<iterator>();
+        }
+
+    public:
+        multimap() {}
+
+        explicit multimap(const Compare& compare)
+            : entries(entry_compare(compare))
+        {
         }
 
-        multimap(const heist::list<std::tuple<K,A>>& tuples) : sup(0) {
-            *this = from_list(tuples);
+        multimap(const heist::list<std::pair<K,A>>& pairs, const Compare& compare = Compare()) {
+            *this = from_pairs(pairs, compare);
         }
 
-        multimap(std::initializer_list<std::pair<K,A>> il) : sup(0) {
-            *this = from_pairs(heist::list<std::pair<K,A>>(il));
+        multimap(const heist::list<std::tuple<K,A>>& tuples, const Compare& compare = Compare()) {
+            *this = from_list(tuples, compare);
         }
 
-        multimap<K, A> insert(K k, A a) const {
-            auto p = sup.split2();
-            long long unique = std::get<0>(p).get();
-            return multimap<K, A>(entries.insert(entry(k, unique, a)), std::get<1>(p));
+        multimap(std::initializer_list<std::pair<K,A>> il, const Compare& compare = Compare()) {
+            *this = from_pairs(heist::list<std::pair<K,A>>(il), compare);
         }
 
-        multimap<K, A> remove(K k) const {
+        /*!
+         * The ordering of the keys.
+         */
+        const Compare& key_comp() const { return entries.key_comp().compare; }
+
+        /*!
+         * Add a value after any that k already has.  O(log N).
+         */
+        multimap insert(const K& k, A a) const {
+            return multimap(entries.update(k, [&k, &a] (boost::optional<const entry&> oe) {
+                return boost::make_optional(
+                    oe ? entry(oe.get().k, oe.get().first, oe.get().rest().append(std::move(a)))
+                       : entry(k, std::move(a)));
+            }));
+        }
+
+        /*!
+         * Add the values in [first, last) after any that k already has, in a single
+         * descent of the tree.
+         */
+        template <class It>
+        multimap insert_many(const K& k, It first, It last) const {
+            if (first == last)
+                return *this;
+            return multimap(entries.update(k, [&k, &first, &last] (boost::optional<const entry&> oe) {
+                boost::optional<entry> out = oe ? boost::make_optional(oe.get())
+                                                : boost::make_optional(entry(k, *first++));
+                seq<A> rest = out.get().rest();
+                for (; first != last; ++first)
+                    rest = rest.append(*first);
+                return boost::make_optional(entry(std::move(out.get().k), std::move(out.get().first), std::move(rest)));
+            }));
+        }
+
+        multimap insert_many(const K& k, std::initializer_list<A> il) const {
+            return insert_many(k, il.begin(), il.end());
+        }
+
+        multimap insert_many(const K& k, const heist::list<A>& as) const {
+            seq<A> more = as.template foldl<seq<A>>([] (const seq<A>& s, const A& a) {
+                    return s.append(a);
+                }, seq<A>());
+            if (!more)
+                return *this;
+            return multimap(entries.update(k, [&k, &more] (boost::optional<const entry&> oe) {
+                return boost::make_optional(
+                    oe ? entry(oe.get().k, oe.get().first, oe.get().rest() + more)
+                       : entry(k, more[0], std::get<1>(more.split_at(1))));
+            }));
+        }
+
+        /*!
+         * Remove k's first value, if it has any.
+         */
+        multimap remove(const K& k) const {
             auto oit = find(k);
             return oit ? oit.get().remove()
-                       : multimap<K, A>(*this);
+                       : multimap(*this);
+        }
+
+        /*!
+         * Remove all of k's values.  O(log N).
+         */
+        multimap remove_all(const K& k) const {
+            auto oit = entries.find(k);
+            return oit ? multimap(oit.get().remove())
+                       : multimap(*this);
         }
 
         boost::optional<iterator> begin() const {
-            auto oit = entries.begin();
-            if (oit)
-                return boost::make_optional(iterator(oit.get(), sup));
-            else
-                return boost::optional<iterator>();
+            return wrap(entries.begin());
         };
 
         boost::optional<iterator> end() const {
-            auto oit = entries.end();
-            if (oit)
-                return boost::make_optional(iterator(oit.get(), sup));
-            else
-                return boost::optional<iterator>();
+            return wrap(entries.end(), true);
         };
 
         /*!
@@ -143,11 +339,7 @@ namespace heist {
          * undefined if all values are < the pivot.
          */
         boost::optional<iterator> lower_bound(const K& k) const {
-            auto oit = entries.lower_bound(entry(k));
-            if (oit)
-                return boost::make_optional(iterator(oit.get(), sup));
-            else
-                return boost::optional<iterator>();
+            return wrap(entries.lower_bound(k));
         }
 
         /*!
@@ -155,16 +347,39 @@ namespace heist {
          * undefined if all values are > the pivot.
          */
         boost::optional<iterator> upper_bound(const K& k) const {
-            auto oit = entries.upper_bound(entry(k));
-            if (oit)
-                return boost::make_optional(iterator(oit.get(), sup));
-            else
-                return boost::optional<iterator>();
+            return wrap(entries.upper_bound(k), true);
+        }
+
+        /*!
+         * An iterator pointing to k's first value.
+         */
+        boost::optional<iterator> find(const K& k) const {
+            return wrap(entries.find(k));
+        }
+
+        bool contains(const K& k) const {
+            return entries.contains(k);
+        }
+
+        /*!
+         * The number of values k has.  O(log N).
+         */
+        size_t count(const K& k) const {
+            auto oit = entries.find(k);
+            return oit ? oit.get().get().count() : 0;
         }
 
-        bool operator == (const multimap<K, A><A>& other) const {
-            boost::optional<multimap<K, A><A>::iterator> it1 = begin();
-            boost::optional<multimap<K, A><A>::iterator> it2 = other.begin();
+        /*!
+         * A view of k's values.  O(log N).
+         */
+        range equal_range(const K& k) const {
+            auto oit = entries.find(k);
+            return oit ? range(std::move(oit.get())) : range();
+        }
+
+        bool operator == (const multimap& other) const {
+            boost::optional<iterator> it1 = begin();
+            boost::optional<iterator> it2 = other.begin();
             while (it1 && it2) {
                 if (!(it1.get().get_key() == it2.get().get_key())) return false;
                 if (!(it1.get().get_value() == it2.get().get_value())) return false;
@@ -174,16 +389,16 @@ namespace heist {
             return !it1 && !it2;
         }
 
-        bool operator != (const multimap<K, A><A>& other) const {
+        bool operator != (const multimap& other) const {
             return ! (*this == other);
         }
 
-        bool operator < (const multimap<K, A><A>& other) const {
-            boost::optional<multimap<K, A><A>::iterator> it1 = begin();
-            boost::optional<multimap<K, A><A>::iterator> it2 = other.begin();
+        bool operator < (const multimap& other) const {
+            boost::optional<iterator> it1 = begin();
+            boost::optional<iterator> it2 = other.begin();
             while (it1 && it2) {
-                if (it1.get().get_key() < it2.get().get_key()) return true;
-                if (it2.get().get_key() < it1.get().get_key()) return false;
+                int c = impl::three_way<Compare, K, K>::compare(key_comp(), it1.get().get_key(), it2.get().get_key());
+                if (c != 0) return c < 0;
                 if (it1.get().get_value() < it2.get().get_value()) return true;
                 if (it2.get().get_value() < it1.get().get_value()) return false;
                 it1 = it1.get().next();
@@ -192,55 +407,72 @@ namespace heist {
             return (bool)it2;
         }
 
-        bool operator > (const multimap<K, A><A>& other) const {
+        bool operator > (const multimap& other) const {
             return other < *this;
         }
 
-        bool operator <= (const multimap<K, A><A>& other) const {
+        bool operator <= (const multimap& other) const {
             return !(*this > other);
         }
 
-        bool operator >= (const multimap<K, A><A>& other) const {
+        bool operator >= (const multimap& other) const {
             return !(*this < other);
         }
 
         heist::list<std::tuple<K, A>> to_list() const {
-            return entries.to_list().map(
-                [] (const entry& e) {return std::make_tuple(e.k, e.oa.get());});
+            heist::list<std::tuple<K, A>> acc;
+            for (auto oit = end(); oit; oit = oit.get().prev())
+                acc = std::make_tuple(oit.get().get_key(), oit.get().get_value()) %= acc;
+            return acc;
         }
 
+        /*!
+         * The key of each value, so a key appears as many times as it has values.
+         */
         heist::list<K> keys() const {
-            return entries.to_list().map(
-                [] (const entry& e) {return e.k;});
+            heist::list<K> acc;
+            for (auto oit = end(); oit; oit = oit.get().prev())
+                acc = oit.get().get_key() %= acc;
+            return acc;
         }
 
         heist::list<A> values() const {
-            return entries.to_list().map(
-                [] (const entry& e) {return e.oa.get();});
+            heist::list<A> acc;
+            for (auto oit = end(); oit; oit = oit.get().prev())
+                acc = oit.get().get_value() %= acc;
+            return acc;
         }
 
+        /*!
+         * The number of values.  O(N) in the number of keys.
+         */
         size_t size() const {
-            size_t len = 0;
-            auto oit = begin();
-            while (oit) {len++; oit = oit.get().next();}
-            return len;
+            return entries.template foldl<size_t>([] (size_t n, const entry& e) {
+                    return n + e.count();
+                }, 0);
         }
 
         /*!
-         * map a function over the map elements.
+         * map a function over the map elements.  The keys are unchanged, so no key
+         * comparisons are made.
          */
         template <class Fn>
-        multimap<K, typename std::result_of<Fn(A)>::type> map(const Fn& f) const {
+        multimap<K, typename std::result_of<Fn(A)>::type, Compare> map(const Fn& f) const {
             typedef typename std::result_of<Fn(A)>::type B;
-            return this->to_list().template foldl<multimap<K, B>>([f] (const multimap<K, B>& m, std::tuple<K, A> ka) {
-                    return m.insert(std::get<0>(ka), f(std::get<1>(ka)));
-                }, multimap<K, B>());
+            typedef typename multimap<K, B, Compare>::entry entryB;
+            typedef typename multimap<K, B, Compare>::entry_compare entry_compareB;
+            return multimap<K, B, Compare>(entries.template map_monotonic<entryB, entry_compareB>([&f] (const entry& e) {
+                    seq<B> rest = e.rest().template foldl<seq<B>>([&f] (const seq<B>& bs, const A& a) {
+                            return bs.append(f(a));
+                        }, seq<B>());
+                    return entryB(e.k, f(e.first), std::move(rest));
+                }, 0, entry_compareB(key_comp())));
         }
 
         template <class B>
         static
         B foldl(std::function<B(const B&, const K&, const A&)> f, B a,
-            boost::optional<typename heist::multimap<K,A>::iterator> oit)
+            boost::optional<iterator> oit)
         {
             while (oit) {
                 auto it = oit.get();
@@ -259,17 +491,25 @@ namespace heist {
             return foldl<B>(f, a, this->begin());
         }
 
+        /*!
+         * Return this map with everything that was allocated in an arena copied to
+         * the heap, so it can outlive the arena.  See arena.h.
+         */
+        multimap promote() const {
+            return multimap(entries.promote());
+        }
+
         /*!
          * Monoidal append = set union.
          */
-        multimap<K, A> operator + (const multimap<K, A>& other) const {
-            return other.foldl<multimap<K, A>>([] (const multimap<K, A>& m, const K& k, const A& a)
+        multimap operator + (const multimap& other) const {
+            return other.foldl<multimap>([] (const multimap& m, const K& k, const A& a)
                       {return m.insert(k, a);}, *this);
         }
 
-        multimap<K, A> filter(std::function<bool(const A&)> pred) const
+        multimap filter(std::function<bool(const A&)> pred) const
         {
-            multimap<K, A> out;
+            multimap out(key_comp());
             for (auto o_iter = begin(); o_iter; o_iter = o_iter.get().next()) {
                 const auto& key = o_iter.get().get_key();
                 const auto& value = o_iter.get().get_value();
@@ -279,9 +519,9 @@ namespace heist {
             return out;
         }
 
-        multimap<K, A> filter_with_key(std::function<bool(const K&, const A&)> pred) const
+        multimap filter_with_key(std::function<bool(const K&, const A&)> pred) const
         {
-            multimap<K, A> out;
+            multimap out(key_comp());
             for (auto o_iter = begin(); o_iter; o_iter = o_iter.get().next()) {
                 const auto& key = o_iter.get().get_key();
                 const auto& value = o_iter.get().get_value();
@@ -297,8 +537,8 @@ namespace heist {
         operator bool () const { return (bool)entries; }
     };
 
-    template <class K, class A>
-    std::ostream& operator << (std::ostream& os, const heist::multimap<K, A>& m)
+    template <class K, class A, class Compare>
+    std::ostream& operator << (std::ostream& os, const heist::multimap<K, A, Compare>& m)
     {
         os << "{";
         bool first = true;
@@ -0,0 +1,149 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#include <heist/node_pool.h>
+#include <mutex>
+
+
+namespace heist {
+    namespace impl {
+        namespace {
+            const size_t GRANULE = 16;
+            const size_t NO_OF_CLASSES = pool_allocator::max_size / GRANULE;
+            const int BATCH = 64;           // Blocks moved between a thread and the depot at once
+            const size_t CHUNK = 16384;     // Bytes carved into blocks when the depot is empty
+
+            struct block {
+                block* next;
+            };
+
+            struct free_list {
+                block* head;
+                int length;
+
+                inline void push(block* b) {
+                    b->next = head;
+                    head = b;
+                    length++;
+                }
+                inline block* pop() {
+                    block* b = head;
+                    head = b->next;
+                    length--;
+                    return b;
+                }
+                /*!
+                 * Move up to n blocks onto the specified list.
+                 */
+                void transfer(free_list& to, int n) {
+                    while (n-- > 0 && head != NULL)
+                        to.push(pop());
+                }
+            };
+
+            struct thread_cache {
+                free_list lists[NO_OF_CLASSES];
+                bool dead;  // This thread's cache has been flushed at thread exit
+            };
+
+            // Trivially constructed and destructed, so it's safe to use at any point
+            // during thread or process teardown.
+            thread_local thread_cache cache;
+
+            struct depot {
+                depot() : lists() {}
+                std::mutex m;
+                free_list lists[NO_OF_CLASSES];
+            };
+
+            // Deliberately never destroyed, because nodes can be freed by static
+            // destructors after this translation unit's statics are gone.
+            depot& the_depot()
+            {
+                static depot* d = new depot;
+                return *d;
+            }
+
+            struct cache_flusher {
+                ~cache_flusher() {
+                    depot& d = the_depot();
+                    std::lock_guard<std::mutex> lg(d.m);
+                    for (size_t c = 0; c < NO_OF_CLASSES; c++)
+                        cache.lists[c].transfer(d.lists[c], cache.lists[c].length);
+                    cache.dead = true;
+                }
+            };
+
+            /*!
+             * Make sure this thread's blocks go back to the depot when it exits.
+             */
+            inline void register_flusher()
+            {
+                static thread_local cache_flusher flusher;
+                (void)flusher;
+            }
+
+            inline size_t class_of(size_t size)
+            {
+                return (size - 1) / GRANULE;
+            }
+
+            void* refill(size_t c)
+            {
+                size_t size = (c + 1) * GRANULE;
+                if (cache.dead)
+                    return ::operator new(size);
+                register_flusher();
+                free_list& l = cache.lists[c];
+                {
+                    depot& d = the_depot();
+                    std::lock_guard<std::mutex> lg(d.m);
+                    d.lists[c].transfer(l, BATCH);
+                }
+                if (l.head == NULL) {
+                    char* chunk = (char*)::operator new(CHUNK);
+                    for (size_t i = CHUNK / size; i > 0; i--)
+                        l.push((block*)(chunk + (i - 1) * size));
+                }
+                return l.pop();
+            }
+        }
+
+        void* pool_allocator::allocate(size_t size)
+        {
+            if (size > max_size || size == 0)
+                return ::operator new(size);
+            size_t c = class_of(size);
+            free_list& l = cache.lists[c];
+            if (l.head != NULL)
+                return l.pop();
+            return refill(c);
+        }
+
+        void pool_allocator::deallocate(void* p, size_t size)
+        {
+            if (size > max_size || size == 0) {
+                ::operator delete(p);
+                return;
+            }
+            size_t c = class_of(size);
+            if (cache.dead) {
+                depot& d = the_depot();
+                std::lock_guard<std::mutex> lg(d.m);
+                d.lists[c].push((block*)p);
+                return;
+            }
+            free_list& l = cache.lists[c];
+            if (l.head == NULL)
+                register_flusher();
+            l.push((block*)p);
+            if (l.length > 2 * BATCH) {
+                depot& d = the_depot();
+                std::lock_guard<std::mutex> lg(d.m);
+                l.transfer(d.lists[c], BATCH);
+            }
+        }
+    }
+}
@@ -0,0 +1,153 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_NODE_POOL_H_
+#define _HEIST_NODE_POOL_H_
+
+#include <new>
+#include <stddef.h>
+
+namespace heist {
+    namespace impl {
+        /*!
+         * Allocates the small fixed-size objects that make up heist's data structures
+         * (tree nodes, reference counts, list cells) from size-classed pools.  Each
+         * thread has its own free lists, so the common case takes no lock.  A block
+         * may be freed on any thread: it goes onto the freeing thread's list, and
+         * surplus blocks are handed back in batches through a shared depot, which is
+         * also where a thread's blocks go when it exits.  Memory is recycled but
+         * never returned to the system.  Sizes above max_size go to ::operator new.
+         */
+        struct pool_allocator {
+            static const size_t max_size = 128;
+            static void* allocate(size_t size);
+            static void deallocate(void* p, size_t size);
+        };
+
+        /*!
+         * Plain ::operator new and delete.  Useful with memory checkers, which can't
+         * see use-after-free inside a pool.
+         */
+        struct malloc_allocator {
+            static void* allocate(size_t size)          { return ::operator new(size); }
+            static void deallocate(void* p, size_t)     { ::operator delete(p); }
+        };
+
+        // The allocation policy for nodes can be chosen at build time by defining
+        // HEIST_NODE_ALLOCATOR as a class with the same static interface as the above,
+        // or HEIST_NO_NODE_POOL to use malloc_allocator.  It must be the same
+        // everywhere in the program.
+#if !defined(HEIST_NODE_ALLOCATOR)
+#if defined(HEIST_NO_NODE_POOL)
+#define HEIST_NODE_ALLOCATOR heist::impl::malloc_allocator
+#else
+#define HEIST_NODE_ALLOCATOR heist::impl::pool_allocator
+#endif
+#endif
+        typedef HEIST_NODE_ALLOCATOR node_allocator;
+
+        /*!
+         * Memory that nodes are bump-allocated from while a heist::arena is active on
+         * this thread.  Nothing allocated from it is freed individually: Finalizers
+         * registered with it run, newest first, and then all its memory is released
+         * at once.  See arena.h.
+         */
+        struct region {
+            region();
+            ~region();
+
+            inline void* allocate(size_t size) {
+                size = (size + 15) & ~(size_t)15;
+                if ((size_t)(end - next) >= size) {
+                    void* p = next;
+                    next += size;
+                    return p;
+                }
+                return allocate_chunk(size);
+            }
+
+            /*!
+             * True if p was allocated from this region or one enclosing it.  O(1):
+             * It's one lookup in a hash set of the pages that this thread's regions
+             * have allocated.
+             */
+            bool owns(const void* p) const;
+
+            /*!
+             * Call fn(obj) when the region is released.
+             */
+            void finalize_with(void (*fn)(void*), void* obj);
+
+            char* next;
+            char* end;
+            struct chunk* chunks;
+            struct finalizer* finalizers;
+            region* outer;
+            bool suspended;   // Allocate from node_allocator while promoting out of the region
+
+          private:
+            region(const region&) = delete;
+            region& operator = (const region&) = delete;
+            void* allocate_chunk(size_t size);
+        };
+
+        extern thread_local region* current_region;
+
+        /*!
+         * The region that new nodes on this thread come from, or NULL if they come
+         * from node_allocator.
+         */
+        inline region* allocating_region()
+        {
+            region* r = current_region;
+            return r != NULL && !r->suspended ? r : NULL;
+        }
+
+        /*!
+         * While one of these exists, new nodes on this thread are allocated from
+         * node_allocator even if an arena is active.  Used to copy nodes out of it.
+         */
+        struct region_suspender {
+            region_suspender() : r(current_region), was(r != NULL && r->suspended) {
+                if (r != NULL) r->suspended = true;
+            }
+            ~region_suspender() {
+                if (r != NULL) r->suspended = was;
+            }
+            region* r;
+            bool was;
+        };
+
+        /*!
+         * Deriving from this routes a class's new and delete through node_allocator.
+         * The sized delete tells the allocator which size class the block came from,
+         * so blocks carry no header.
+         */
+        struct pooled {
+            static void* operator new(size_t size)             { return node_allocator::allocate(size); }
+            static void operator delete(void* p, size_t size)  { node_allocator::deallocate(p, size); }
+        };
+
+        /*!
+         * Like pooled, but allocates from the current arena's region if there is one.
+         * Only for objects that are shared through reference counts, which the arena
+         * takes over; objects owned by value must always come from node_allocator,
+         * or copying their owner inside an arena would tie it to the arena.
+         */
+        struct arena_pooled {
+            static void* operator new(size_t size) {
+                region* r = allocating_region();
+                return r != NULL ? r->allocate(size) : node_allocator::allocate(size);
+            }
+            static void operator delete(void* p, size_t size) {
+                region* r = current_region;
+                if (r == NULL || !r->owns(p))
+                    node_allocator::deallocate(p, size);
+            }
+        };
+    }
+}
+
+#endif
@@ -6,36 +6,108 @@
 #ifndef _HEIST_QUEUE_H_
 #define _HEIST_QUEUE_H_
 
-#include <heist/map.h>
+#include <heist/list.h>
+#include <heist/unrolled_list.h>
+#include <initializer_list>
 #include <stdexcept>
+#include <tuple>
 
 namespace heist {
 
+    /*!
+     * An immutable first-in first-out queue.  It's a pair of lists: Items are
+     * popped from the front, and pushed onto the back, which is kept in reverse
+     * order.  When the front runs out, the back is reversed to become the new front.
+     * Both are unrolled_lists, so a push usually fills a free slot in the back's
+     * head cell instead of allocating, and the reversed front is packed into full
+     * cells.
+     *
+     * push, pop and size are O(1), amortized over the pops that a reversal pays for.
+     * As long as each version is only popped from once, that holds for any sequence
+     * of operations.  Popping the same version repeatedly at the point where its
+     * back is reversed repeats the reversal each time.
+     *
+     * Its cells aren't allocated from arenas.
+     */
     template <class A>
     class queue {
         private:
-            map<int, A> m;
-            int head, tail;
+            unrolled_list<A> front;     // Only empty if the queue is
+            unrolled_list<A> back;      // Newest first
+            size_t n;
 
         private:
-            queue(map<int, A> m, int head, int tail) : m(m), head(head), tail(tail) {}
+            queue(unrolled_list<A> front, unrolled_list<A> back, size_t n)
+                : front(std::move(front)), back(std::move(back)), n(n)
+            {
+                if (!this->front && this->back) {
+                    this->front = this->back.reverse();
+                    this->back = unrolled_list<A>();
+                }
+            }
 
         public:
-            queue() : head(0), tail(0) {}
+            queue() : n(0) {}
 
             /*!
              * True if this queue has anything in it.
              */
             operator bool() const
             {
-                return head != tail;
+                return n != 0;
+            }
+
+            /*!
+             * The number of items in the queue.  O(1).
+             */
+            size_t size() const
+            {
+                return n;
             }
 
-            /*! 
+            /*!
              * Push an item onto the tail of the queue.
              */
-            queue<A> push(A a) const {
-                return queue<A>(m.insert(tail, a), head, tail+1);
+            queue<A> push(const A& a) const {
+                return queue<A>(front, unrolled_list<A>(a, back), n+1);
+            }
+
+            queue<A> push(A&& a) const {
+                return queue<A>(front, unrolled_list<A>(std::move(a), back), n+1);
+            }
+
+            /*!
+             * Push the items in [begin, end) onto the tail of the queue, in order.
+             */
+            template <class It>
+            queue<A> push_many(It begin, It end) const {
+                unrolled_list<A> b = back;
+                size_t m = n;
+                for (It it = begin; it != end; ++it, ++m)
+                    b = unrolled_list<A>(*it, b);
+                return queue<A>(front, std::move(b), m);
+            }
+
+            queue<A> push_many(std::initializer_list<A> il) const {
+                return push_many(il.begin(), il.end());
+            }
+
+            /*!
+             * Push the items in xs onto the tail of the queue, in order.
+             */
+            queue<A> push_many(const list<A>& xs) const {
+                unrolled_list<A> b = back;
+                size_t m = n;
+                for (list<A> l = xs; l; l = l.tail(), ++m)
+                    b = unrolled_list<A>(l.head(), b);
+                return queue<A>(front, std::move(b), m);
+            }
+
+            /*!
+             * Its cells never come from an arena, so this queue is returned unchanged.
+             */
+            queue<A> promote() const {
+                return *this;
             }
 
             /*!
@@ -43,15 +115,32 @@ namespace heist {
              * if the queue is empty.
              */
             std::tuple<A, queue<A>> pop() const {
-                auto oit = m.find(head);
-                if (oit)
-                    return std::make_tuple(oit.get().get_value(), queue<A>(oit.get().remove(), head+1, tail));
-                else
+                if (n == 0)
                     throw std::runtime_error("queue::pop() empty");
+                return std::make_tuple(front.head(), queue<A>(front.tail(), back, n-1));
+            }
+
+            /*!
+             * Pop up to max_items items from the head of the queue, returning them in
+             * the order they were pushed.  Returns an empty list if the queue is empty.
+             */
+            std::tuple<list<A>, queue<A>> pop_many(size_t max_items) const {
+                impl::list_builder<A> out;
+                unrolled_list<A> f = front;
+                unrolled_list<A> b = back;
+                size_t m = n;
+                for (; max_items > 0 && m > 0; max_items--, m--) {
+                    if (!f) {
+                        f = b.reverse();
+                        b = unrolled_list<A>();
+                    }
+                    out.push_back(f.head());
+                    f = f.tail();
+                }
+                return std::make_tuple(out.finish(), queue<A>(std::move(f), std::move(b), m));
             }
     };
 
 };
 
 #endif
-
@@ -0,0 +1,582 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_RA_LIST_H_
+#define _HEIST_RA_LIST_H_
+
+#include <heist/list.h>
+#include <heist/node_pool.h>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/optional.hpp>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <list>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <assert.h>
+
+namespace heist {
+    namespace impl {
+        /*!
+         * A node of one of the complete binary trees that make up an ra_list.  Its
+         * element comes first in the list, followed by its left subtree, then its
+         * right subtree.
+         */
+        template <class A>
+        struct ra_node : pooled {
+            template <class... Args>
+            ra_node(const boost::intrusive_ptr<ra_node>& left,
+                    const boost::intrusive_ptr<ra_node>& right,
+                    Args&&... args)
+                : ref_count(0), x(std::forward<Args>(args)...), left(left), right(right) {}
+            std::atomic<int> ref_count;
+            A x;
+            boost::intrusive_ptr<ra_node> left;
+            boost::intrusive_ptr<ra_node> right;
+        };
+
+        template <class A>
+        void intrusive_ptr_add_ref(ra_node<A>* p)
+        {
+            p->ref_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        template <class A>
+        void intrusive_ptr_release(ra_node<A>* p)
+        {
+            if (p->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete p;
+        }
+    }
+
+    /*!
+     * An immutable list with the same interface as heist::list, that also has
+     * O(log N) indexing and update, and O(1) size.  cons, head and tail are O(1).
+     * It's Okasaki's skew binary random-access list: A list of complete binary
+     * trees whose sizes are the digits of a skew binary number.
+     *
+     * Its tree nodes aren't allocated from arenas.
+     */
+    template <class A>
+    class ra_list
+    {
+        template <class B> friend class ra_list;
+        private:
+            typedef impl::ra_node<A> node;
+            typedef boost::intrusive_ptr<node> node_ptr;
+            struct digit {
+                digit(size_t weight, const node_ptr& tree) : weight(weight), tree(tree) {}
+                size_t weight;  // The number of elements in tree, 2^k - 1
+                node_ptr tree;
+            };
+            list<digit> digits;
+            size_t n;
+
+            ra_list(const list<digit>& digits, size_t n) : digits(digits), n(n) {}
+            ra_list(list<digit>&& digits, size_t n) : digits(std::move(digits)), n(n) {}
+
+            template <class... Args>
+            static ra_list make_cons(const ra_list& tail, Args&&... args)
+            {
+                const list<digit>& ds = tail.digits;
+                if (ds) {
+                    list<digit> rest = ds.tail();
+                    // Two trees of the same size and the new element make a tree.
+                    if (rest && ds.head().weight == rest.head().weight) {
+                        const digit& d1 = ds.head();
+                        const digit& d2 = rest.head();
+                        return ra_list(digit(2 * d1.weight + 1,
+                                             node_ptr(new node(d1.tree, d2.tree, std::forward<Args>(args)...)))
+                                       %= rest.tail(), tail.n + 1);
+                    }
+                }
+                return ra_list(digit(1, node_ptr(new node(node_ptr(), node_ptr(), std::forward<Args>(args)...)))
+                               %= ds, tail.n + 1);
+            }
+
+            /*!
+             * Build a list of the elements in order, consing from the back.
+             */
+            template <class It>
+            static ra_list from_reversed(It begin, It end)
+            {
+                ra_list out;
+                for (It it = begin; it != end; ++it)
+                    out = make_cons(out, std::move(*it));
+                return out;
+            }
+
+            template <class It>
+            static ra_list from_pointers_reversed(It begin, It end)
+            {
+                ra_list out;
+                for (It it = begin; it != end; ++it)
+                    out = make_cons(out, **it);
+                return out;
+            }
+
+            /*!
+             * Call f on each element in order until it returns false.
+             */
+            template <class Fn>
+            bool each(const Fn& f) const
+            {
+                std::vector<const node*> stack;
+                for (list<digit> ds = digits; ds; ds = ds.tail()) {
+                    stack.push_back(ds.head().tree.get());
+                    while (!stack.empty()) {
+                        const node* t = stack.back();
+                        stack.pop_back();
+                        if (!f(t->x))
+                            return false;
+                        if (t->right) {
+                            stack.push_back(t->right.get());
+                            stack.push_back(t->left.get());
+                        }
+                    }
+                }
+                return true;
+            }
+
+            std::vector<const A*> pointers() const {
+                std::vector<const A*> out;
+                out.reserve(n);
+                each([&out] (const A& a) { out.push_back(&a); return true; });
+                return out;
+            }
+
+            static const A& lookup(const node* t, size_t weight, size_t ix)
+            {
+                while (ix != 0) {
+                    weight /= 2;
+                    if (ix <= weight) {
+                        t = t->left.get();
+                        ix -= 1;
+                    }
+                    else {
+                        t = t->right.get();
+                        ix -= 1 + weight;
+                    }
+                }
+                return t->x;
+            }
+
+            static node_ptr update(const node* t, size_t weight, size_t ix, const A& a)
+            {
+                if (ix == 0)
+                    return node_ptr(new node(t->left, t->right, a));
+                weight /= 2;
+                if (ix <= weight)
+                    return node_ptr(new node(update(t->left.get(), weight, ix - 1, a), t->right, t->x));
+                else
+                    return node_ptr(new node(t->left, update(t->right.get(), weight, ix - 1 - weight, a), t->x));
+            }
+
+            template <class B, class Fn>
+            static boost::intrusive_ptr<impl::ra_node<B>> map_tree(const node* t, const Fn& f)
+            {
+                if (t == NULL)
+                    return boost::intrusive_ptr<impl::ra_node<B>>();
+                B b = f(t->x);
+                return boost::intrusive_ptr<impl::ra_node<B>>(
+                    new impl::ra_node<B>(map_tree<B>(t->left.get(), f), map_tree<B>(t->right.get(), f), std::move(b)));
+            }
+
+        public:
+            typedef A value_type;
+
+            /*!
+             * An empty list.
+             */
+            ra_list() : n(0) {}
+            /*!
+             * construct a list.  Better to use % operator.
+             */
+            ra_list(const A& head, const ra_list& tail) : n(0) { *this = make_cons(tail, head); }
+            ra_list(A&& head, const ra_list& tail) : n(0) { *this = make_cons(tail, std::move(head)); }
+            /*!
+             * construct a list from a C++11 initializer list.
+             */
+            ra_list(std::initializer_list<A> il) : n(0) {
+                *this = from_reversed(std::reverse_iterator<const A*>(il.end()),
+                                      std::reverse_iterator<const A*>(il.begin()));
+            }
+            /*!
+             * construct a list with the same elements as a heist::list.
+             */
+            explicit ra_list(const list<A>& xs) : n(0) {
+                std::vector<const A*> ps;
+                for (list<A> l = xs; l; l = l.tail())
+                    ps.push_back(&l.head());
+                *this = from_pointers_reversed(ps.rbegin(), ps.rend());
+            }
+
+            /*!
+             * Return this list with a new head constructed in place from the specified
+             * arguments.
+             */
+            template <class... Args>
+            ra_list emplace_front(Args&&... args) const {
+                return make_cons(*this, std::forward<Args>(args)...);
+            }
+
+            /*!
+             * Check whether this list is non-empty.  If it returns true, then it's valid to
+             * use head() and tail().
+             */
+            inline operator bool() const
+            {
+                return n != 0;
+            }
+
+            /*!
+             * Return the head of this list.  Caller must ensure that this list isn't
+             * empty before calling, by casting to bool.
+             */
+            const A& head() const {return digits.head().tree->x;}
+
+            /*!
+             * Return the tail of this list.  Caller must ensure that this list isn't
+             * empty before calling, by casting to bool.
+             */
+            ra_list tail() const {
+                const digit& d = digits.head();
+                if (d.weight == 1)
+                    return ra_list(digits.tail(), n - 1);
+                size_t w = d.weight / 2;
+                return ra_list(digit(w, d.tree->left) %= digit(w, d.tree->right) %= digits.tail(), n - 1);
+            }
+
+            bool operator == (const ra_list& other) const {
+                if (n != other.n) return false;
+                std::vector<const A*> one = pointers();
+                size_t i = 0;
+                return other.each([&one, &i] (const A& a) { return *one[i++] == a; });
+            }
+
+            bool operator != (const ra_list& other) const {
+                return !(*this == other);
+            }
+
+            bool operator < (const ra_list& other) const {
+                std::vector<const A*> one = pointers();
+                size_t i = 0;
+                int result = 0;
+                other.each([&] (const A& a) {
+                    if (i == one.size()) { result = -1; return false; }
+                    if (*one[i] < a) { result = -1; return false; }
+                    if (a < *one[i]) { result = 1; return false; }
+                    i++;
+                    return true;
+                });
+                return result < 0;
+            }
+
+            bool operator > (const ra_list& other) const {
+                return other < *this;
+            }
+
+            bool operator <= (const ra_list& other) const {
+                return !(*this > other);
+            }
+
+            bool operator >= (const ra_list& other) const {
+                return !(*this < other);
+            }
+
+            /*!
+             * O(log N).
+             */
+            A operator [] (int ix) const {
+                size_t i = ix;
+                for (list<digit> ds = digits; ; ds = ds.tail()) {
+                    const digit& d = ds.head();
+                    if (i < d.weight)
+                        return lookup(d.tree.get(), d.weight, i);
+                    i -= d.weight;
+                }
+            };
+
+            /*!
+             * Return this list with the element at index ix replaced by a.  O(log N).
+             */
+            ra_list update(int ix, const A& a) const {
+                size_t i = ix;
+                impl::list_builder<digit> prefix;
+                for (list<digit> ds = digits; ; ds = ds.tail()) {
+                    const digit& d = ds.head();
+                    if (i < d.weight) {
+                        prefix.push_back(digit(d.weight, update(d.tree.get(), d.weight, i, a)));
+                        return ra_list(prefix.finish(ds.tail()), n);
+                    }
+                    prefix.push_back(d);
+                    i -= d.weight;
+                }
+            }
+
+            /*!
+             * Return this list with the cells that were allocated in an arena copied to
+             * the heap, so it can outlive the arena.  See arena.h.
+             */
+            ra_list promote() const
+            {
+                return ra_list(digits.promote(), n);
+            }
+
+            /*!
+             * O(1).
+             */
+            size_t size() const
+            {
+                return n;
+            }
+
+            /*!
+             * Map a function over the list, producing a new list of modified values.
+             * The trees keep their shapes, so nothing is rebuilt.
+             */
+            template <class Fn>
+            ra_list<typename std::result_of<Fn(A)>::type> map(const Fn& f) const {
+                typedef typename std::result_of<Fn(A)>::type B;
+                typedef typename ra_list<B>::digit digitB;
+                impl::list_builder<digitB> out;
+                for (list<digit> ds = digits; ds; ds = ds.tail())
+                    out.push_back(digitB(ds.head().weight, map_tree<B>(ds.head().tree.get(), f)));
+                return ra_list<B>(out.finish(), n);
+            }
+
+            ra_list filter(std::function<bool(const A&)> pred) const
+            {
+                std::vector<const A*> ys;
+                each([&] (const A& a) { if (pred(a)) ys.push_back(&a); return true; });
+                return from_pointers_reversed(ys.rbegin(), ys.rend());
+            }
+
+            ra_list reverse() const
+            {
+                ra_list acc;
+                each([&acc] (const A& a) { acc = make_cons(acc, a); return true; });
+                return acc;
+            }
+
+            /*!
+             * Map then concat.
+             */
+            template <class Fn>
+            ra_list<typename std::result_of<Fn(A)>::type::value_type> concat_map(const Fn& f) const {
+                return concat(this->map(f));
+            }
+
+            /*!
+             * Map A's to optional Bs, then take the defined values.
+             */
+            template <class Fn>
+            ra_list<typename std::result_of<Fn(A)>::type::value_type>
+                    map_optional(const Fn& f) const {
+                typedef typename std::result_of<Fn(A)>::type::value_type B;
+                std::vector<B> out;
+                each([&] (const A& a) {
+                    boost::optional<B> ob = f(a);
+                    if (ob)
+                        out.push_back(std::move(ob.get()));
+                    return true;
+                });
+                return ra_list<B>::from_reversed(out.rbegin(), out.rend());
+            }
+
+            std::tuple<ra_list, ra_list> split_at(int i) const {
+                std::vector<const A*> fst;
+                ra_list xs = *this;
+                while (i > 0 && xs) {
+                    fst.push_back(&xs.head());
+                    xs = xs.tail();
+                    i--;
+                }
+                return std::tuple<ra_list, ra_list>(from_pointers_reversed(fst.rbegin(), fst.rend()), xs);
+            }
+
+            ra_list intersperse(A x) const {
+                std::vector<const A*> xs = pointers();
+                ra_list out;
+                for (auto it = xs.rbegin(); it != xs.rend(); ++it) {
+                    if (it != xs.rbegin())
+                        out = make_cons(out, x);
+                    out = make_cons(out, **it);
+                }
+                return out;
+            }
+
+            bool any(std::function<bool(const A&)> pred) const {
+                return !each([&pred] (const A& a) { return !pred(a); });
+            }
+
+            std::list<A> to_std_list() const {
+                std::list<A> out;
+                each([&out] (const A& a) { out.push_back(a); return true; });
+                return out;
+            }
+
+            bool contains(const A& a) const
+            {
+                return !each([&a] (const A& b) { return !(b == a); });
+            }
+
+            template <class B>
+            B foldl(std::function<B(const B&,const A&)> f, B b) const
+            {
+                each([&] (const A& a) { b = f(b, a); return true; });
+                return b;
+            }
+
+            template <class B>
+            B foldr(std::function<B(const A&,const B&)> f, B b) const
+            {
+                std::vector<const A*> xs = pointers();
+                for (auto it = xs.rbegin(); it != xs.rend(); ++it)
+                    b = f(**it, b);
+                return b;
+            }
+
+            /*!
+             * Fold a non-empty set with no initial value.
+             */
+            A foldl1(std::function<A(const A&, const A&)> f) const
+            {
+                assert(*this);
+                return this->tail().foldl(f, this->head());
+            }
+
+            /*!
+             * Fold a non-empty set with no initial value.
+             */
+            A foldr1(std::function<A(const A&, const A&)> f) const
+            {
+                assert(*this);
+                return this->tail().foldr(f, this->head());
+            }
+
+            /*!
+             * Return the lists of items from xs that do and do not match the predicate,
+             * respectively.
+             */
+            std::tuple<ra_list, ra_list> partition(std::function<bool(const A&)> pred) const
+            {
+                std::vector<const A*> ins, outs;
+                each([&] (const A& a) { (pred(a) ? ins : outs).push_back(&a); return true; });
+                return std::make_tuple(from_pointers_reversed(ins.rbegin(), ins.rend()),
+                                       from_pointers_reversed(outs.rbegin(), outs.rend()));
+            }
+
+            /*!
+             * Append other to this list, sharing other.
+             */
+            ra_list append(const ra_list& other) const
+            {
+                std::vector<const A*> xs = pointers();
+                ra_list out = other;
+                for (auto it = xs.rbegin(); it != xs.rend(); ++it)
+                    out = make_cons(out, **it);
+                return out;
+            }
+
+            /*!
+             * Convert to a heist::list.
+             */
+            list<A> to_list() const
+            {
+                impl::list_builder<A> out;
+                each([&out] (const A& a) { out.push_back(a); return true; });
+                return out.finish();
+            }
+    };
+
+    /*!
+     * Operator synonym for list constructor - right-associative.
+     */
+    template <class A>
+    inline ra_list<A> operator %= (const A& x, const ra_list<A>& xs)
+    {
+        return ra_list<A>(x, xs);
+    }
+
+    template <class A>
+    inline ra_list<A> operator %= (A&& x, const ra_list<A>& xs)
+    {
+        return ra_list<A>(std::move(x), xs);
+    }
+
+    template <class A>
+    ra_list<A> operator + (const ra_list<A>& one, const ra_list<A>& tother)
+    {
+        return one.append(tother);
+    }
+
+    template <class A>
+    std::ostream& operator << (std::ostream& os, const ra_list<A>& xs) {
+        os << "[";
+        bool first = true;
+        xs.template foldl<int>([&os, &first] (const int&, const A& a) {
+            os << (first ? "" : ",") << a;
+            first = false;
+            return 0;
+        }, 0);
+        os << "]";
+        return os;
+    }
+
+    /*!
+     * Concatenate the list of lists into a single list.
+     */
+    template <class A>
+    ra_list<A> concat(const ra_list<ra_list<A>>& lists) {
+        return lists.template foldr<ra_list<A>>([] (const ra_list<A>& a, const ra_list<A>& b) {
+                return a + b;
+            }, ra_list<A>());
+    }
+
+    /*!
+     * Filter the defined values and put them into the output list.
+     */
+    template <class A>
+    ra_list<A> cat_optional(const ra_list<boost::optional<A>>& xs) {
+        return xs.map_optional([] (const boost::optional<A>& oa) { return oa; });
+    }
+
+    template <class A, class B, class C>
+    ra_list<C> zip_with(std::function<C(const A&,const B&)> f, ra_list<A> as, ra_list<B> bs)
+    {
+        ra_list<C> cs;
+        while (as && bs) {
+            cs = f(as.head(), bs.head()) %= cs;
+            as = as.tail();
+            bs = bs.tail();
+        }
+        return cs.reverse();
+    }
+
+    template <class A, class B>
+    std::tuple<ra_list<A>, ra_list<B>> unzip(const ra_list<std::tuple<A, B>>& tuples)
+    {
+        return std::make_tuple(
+                tuples.map([] (const std::tuple<A,B>& t) {return std::get<0>(t);}),
+                tuples.map([] (const std::tuple<A,B>& t) {return std::get<1>(t);})
+            );
+    }
+
+    template <class A, class B, class C>
+    std::tuple<ra_list<A>, ra_list<B>, ra_list<C>> unzip3(const ra_list<std::tuple<A, B, C>>& tuples)
+    {
+        return std::make_tuple(
+                tuples.map([] (const std::tuple<A,B,C>& t) {return std::get<0>(t);}),
+                tuples.map([] (const std::tuple<A,B,C>& t) {return std::get<1>(t);}),
+                tuples.map([] (const std::tuple<A,B,C>& t) {return std::get<2>(t);})
+            );
+    }
+}
+
+#endif
@@ -0,0 +1,96 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#include <heist/reclaimer.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace heist {
+    namespace impl {
+        std::atomic<bool> background_reclaim(false);
+
+        namespace {
+            thread_local bool is_reclaimer = false;
+
+            struct job {
+                void* p;
+                void (*drop)(void*);
+            };
+
+            struct reclaimer {
+                reclaimer() : busy(false), started(false) {}
+                std::mutex m;
+                std::condition_variable work;
+                std::condition_variable idle;
+                std::vector<job> jobs;
+                bool busy;
+                bool started;
+
+                void run() {
+                    is_reclaimer = true;
+                    std::vector<job> batch;
+                    std::unique_lock<std::mutex> lk(m);
+                    while (true) {
+                        work.wait(lk, [this] { return !jobs.empty(); });
+                        batch.swap(jobs);
+                        busy = true;
+                        lk.unlock();
+                        for (const job& j : batch)
+                            j.drop(j.p);
+                        batch.clear();
+                        lk.lock();
+                        busy = false;
+                        if (jobs.empty())
+                            idle.notify_all();
+                    }
+                }
+            };
+
+            // Deliberately never destroyed, and its thread is never joined, because
+            // lists can be freed by static destructors.  Anything still queued at
+            // exit is left to the operating system.
+            reclaimer& the_reclaimer()
+            {
+                static reclaimer* r = new reclaimer;
+                return *r;
+            }
+        }
+
+        bool in_reclaimer()
+        {
+            return is_reclaimer;
+        }
+
+        void reclaim_later(void* p, void (*drop)(void*))
+        {
+            reclaimer& r = the_reclaimer();
+            {
+                std::lock_guard<std::mutex> lg(r.m);
+                if (!r.started) {
+                    std::thread(&reclaimer::run, &r).detach();
+                    r.started = true;
+                }
+                job j = { p, drop };
+                r.jobs.push_back(j);
+            }
+            r.work.notify_one();
+        }
+    }
+
+    void set_background_reclaim(bool enabled)
+    {
+        impl::background_reclaim.store(enabled, std::memory_order_relaxed);
+    }
+
+    void reclaim_sync()
+    {
+        impl::reclaimer& r = impl::the_reclaimer();
+        std::unique_lock<std::mutex> lk(r.m);
+        r.idle.wait(lk, [&r] { return r.jobs.empty() && !r.busy; });
+    }
+}
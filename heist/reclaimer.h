@@ -0,0 +1,50 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_RECLAIMER_H_
+#define _HEIST_RECLAIMER_H_
+
+#include <atomic>
+
+namespace heist {
+    /*!
+     * Opt in to (or out of) freeing long lists on a background thread.  When it's
+     * on, dropping the last reference to a list frees a bounded number of its cells
+     * on the calling thread and hands the rest to a reclaimer thread, so it's O(1)
+     * however long the list is.  The elements' destructors then run on the
+     * reclaimer thread, so they must be safe to run there.  Off by default.
+     */
+    void set_background_reclaim(bool enabled);
+
+    /*!
+     * Wait until everything handed to the reclaimer so far has been freed.  Mustn't
+     * be called from an element's destructor.
+     */
+    void reclaim_sync();
+
+    namespace impl {
+        /*!
+         * How many cells are freed on the calling thread before the rest of a chain
+         * is handed to the reclaimer.
+         */
+        static const int RECLAIM_AFTER = 256;
+
+        extern std::atomic<bool> background_reclaim;
+
+        bool in_reclaimer();
+
+        inline bool reclaiming_in_background()
+        {
+            return background_reclaim.load(std::memory_order_relaxed) && !in_reclaimer();
+        }
+
+        /*!
+         * Have the reclaimer thread call drop(p).
+         */
+        void reclaim_later(void* p, void (*drop)(void*));
+    }
+}
+
+#endif
@@ -6,87 +6,813 @@
 #ifndef _HEIST_SEQ_H_
 #define _HEIST_SEQ_H_
 
-#include <heist/map.h>
+#include <heist/node_pool.h>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/optional.hpp>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 namespace heist {
+    namespace impl {
+        const int RRB_BITS = 5;
+        const int RRB_WIDTH = 1 << RRB_BITS;
+        /*!
+         * How many more nodes than the fewest that could hold them a level may have
+         * where two trees were concatenated, before it's repacked.
+         */
+        const int RRB_EXTRAS = 2;
+
+        template <class A>
+        struct rrb_node {
+            explicit rrb_node(int height) : ref_count(0), height(height) {}
+            std::atomic<int> ref_count;
+            int height;  // 0 for a leaf
+        };
+
+        /*!
+         * Up to RRB_WIDTH contiguous elements.  The slots from lo to hi hold elements.
+         * A seq whose buffer ends at lo or hi may claim the free slot next to it, so
+         * pushing onto a seq that nobody else has pushed onto at that end fills its
+         * buffer instead of copying it.  The slots never change once filled, and
+         * everything that refers to a leaf says which of its slots it means, so seqs
+         * that share a leaf can't see each other's elements.
+         */
+        template <class A>
+        struct rrb_leaf : rrb_node<A>, pooled {
+            explicit rrb_leaf(int at) : rrb_node<A>(0), lo(at), hi(at) {}
+            ~rrb_leaf() {
+                for (int i = lo.load(std::memory_order_relaxed); i < hi.load(std::memory_order_relaxed); i++)
+                    slot(i)->~A();
+            }
+            A* slot(int i) { return reinterpret_cast<A*>(&slots[i]); }
+
+            std::atomic<int> lo, hi;
+            typename std::aligned_storage<sizeof(A), alignof(A)>::type slots[RRB_WIDTH];
+
+          private:
+            rrb_leaf(const rrb_leaf&) = delete;
+            rrb_leaf& operator = (const rrb_leaf&) = delete;
+        };
+
+        template <class A> struct rrb_inner;
+
+        /*!
+         * A reference to a node.  For a leaf, the slots lo to hi are the ones meant.
+         */
+        template <class A>
+        struct rrb_ref {
+            rrb_ref() : lo(0), hi(0) {}
+            rrb_ref(rrb_node<A>* p, int lo, int hi) : p(p), lo(lo), hi(hi) {}
+            explicit rrb_ref(rrb_inner<A>* p) : p(p), lo(0), hi(0) {}
+
+            int height() const { return p->height; }
+            rrb_leaf<A>* leaf() const { return static_cast<rrb_leaf<A>*>(p.get()); }
+            const rrb_inner<A>* inner() const { return static_cast<const rrb_inner<A>*>(p.get()); }
+            /*!
+             * The number of elements in the subtree.
+             */
+            size_t size() const {
+                return !p ? 0 : p->height == 0 ? hi - lo : inner()->sizes[inner()->n - 1];
+            }
+            /*!
+             * The number of leaf elements or children.
+             */
+            int slots() const {
+                return p->height == 0 ? hi - lo : inner()->n;
+            }
+
+            boost::intrusive_ptr<rrb_node<A>> p;
+            int lo, hi;
+        };
+
+        /*!
+         * An internal node of a relaxed radix balanced tree.  Its children all have
+         * the same height, but they needn't be full, so it keeps a table of their
+         * sizes.
+         */
+        template <class A>
+        struct rrb_inner : rrb_node<A>, pooled {
+            explicit rrb_inner(int height) : rrb_node<A>(height), n(0) {}
+            void push(const rrb_ref<A>& r) {
+                kids[n] = r;
+                sizes[n] = (n == 0 ? 0 : sizes[n - 1]) + r.size();
+                n++;
+            }
+            /*!
+             * Append from's children i to j, taking their sizes from its table rather
+             * than visiting them.
+             */
+            void push_range(const rrb_inner& from, int i, int j) {
+                for (int k = i; k < j; k++) {
+                    kids[n] = from.kids[k];
+                    sizes[n] = (n == 0 ? 0 : sizes[n - 1]) + from.sizes[k] - (k == 0 ? 0 : from.sizes[k - 1]);
+                    n++;
+                }
+            }
+
+            int n;
+            rrb_ref<A> kids[RRB_WIDTH];
+            size_t sizes[RRB_WIDTH];  // The number of elements in kids 0 to i
+
+          private:
+            rrb_inner(const rrb_inner&) = delete;
+            rrb_inner& operator = (const rrb_inner&) = delete;
+        };
+
+        template <class A>
+        void intrusive_ptr_add_ref(rrb_node<A>* p)
+        {
+            p->ref_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        template <class A>
+        void intrusive_ptr_release(rrb_node<A>* p)
+        {
+            if (p->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                if (p->height == 0)
+                    delete static_cast<rrb_leaf<A>*>(p);
+                else
+                    delete static_cast<rrb_inner<A>*>(p);
+            }
+        }
+    }
+
     /*!
-     * A sequence of values, essentially an immutable equivalent of a doubly-linked list.
+     * A sequence of values, essentially an immutable equivalent of a doubly-linked
+     * list, that also has indexing, concatenation and splitting.  It's a relaxed
+     * radix balanced tree (RRB vector) of leaves of up to 32 elements, with a leaf
+     * at each end outside the tree as a buffer.
+     *
+     *  - prepend and append are O(1), plus O(log N) every 32 elements to move a full
+     *    buffer into the tree.  As long as each version is only pushed onto once at
+     *    each end, they fill the buffer in place without copying it.
+     *  - Indexing and update are O(log32 N).  size() is O(1).
+     *  - Concatenation and split_at are O(log N).
+     *  - Iteration walks each leaf's elements contiguously.
+     *
+     * Its nodes aren't allocated from arenas.
      */
     template <class A>
     class seq
     {
         private:
-            map<int, A> m;
-            seq(const map<int, A>& m) : m(m) {}
+            typedef impl::rrb_leaf<A> leaf;
+            typedef impl::rrb_inner<A> inner;
+            typedef impl::rrb_ref<A> ref;
+            static const int WIDTH = impl::RRB_WIDTH;
+
+            ref front;   // A leaf that prepend fills downwards
+            ref root;    // The tree in between
+            ref back;    // A leaf that append fills upwards
+            size_t n;
+
+            seq(const ref& front, const ref& root, const ref& back, size_t n)
+                : front(front), root(root), back(back), n(n) {}
+
+            static const A& element(const ref& l, int k) { return *l.leaf()->slot(l.lo + k); }
+
+            /*!
+             * Append a to a leaf that nothing else can see yet.
+             */
+            static void leaf_push(ref& l, const A& a) {
+                new (l.leaf()->slot(l.hi)) A(a);
+                l.leaf()->hi.store(++l.hi, std::memory_order_relaxed);
+            }
+
+            /*!
+             * A new leaf with l's elements starting at slot at.
+             */
+            static ref copy_leaf(const ref& l, int at) {
+                ref out(new leaf(at), at, at);
+                for (int k = l.lo; k < l.hi; k++)
+                    leaf_push(out, *l.leaf()->slot(k));
+                return out;
+            }
+
+            static ref slice(const ref& l, int lo, int hi) {
+                return lo == hi ? ref() : ref(l.p.get(), lo, hi);
+            }
+
+            /*!
+             * Construct an element in the free slot after the end of l, if nothing else
+             * has claimed it.
+             */
+            template <class... Args>
+            static bool claim_back(ref& l, Args&&... args) {
+                int expected = l.hi;
+                if (l.hi == WIDTH || !l.leaf()->hi.compare_exchange_strong(expected, l.hi + 1, std::memory_order_acq_rel))
+                    return false;
+                // The slot is ours, and until we return, no one else can claim the one
+                // after it.
+                try {
+                    new (l.leaf()->slot(l.hi)) A(std::forward<Args>(args)...);
+                }
+                catch (...) {
+                    l.leaf()->hi.store(l.hi, std::memory_order_release);
+                    throw;
+                }
+                l.hi++;
+                return true;
+            }
+
+            template <class... Args>
+            static bool claim_front(ref& l, Args&&... args) {
+                int expected = l.lo;
+                if (l.lo == 0 || !l.leaf()->lo.compare_exchange_strong(expected, l.lo - 1, std::memory_order_acq_rel))
+                    return false;
+                try {
+                    new (l.leaf()->slot(l.lo - 1)) A(std::forward<Args>(args)...);
+                }
+                catch (...) {
+                    l.leaf()->lo.store(l.lo, std::memory_order_release);
+                    throw;
+                }
+                l.lo--;
+                return true;
+            }
+
+            /*!
+             * A path of single-child nodes from height down to t.
+             */
+            static ref path_to(const ref& t, int height) {
+                ref r = t;
+                for (int h = t.height() + 1; h <= height; h++) {
+                    inner* in = new inner(h);
+                    in->push(r);
+                    r = ref(in);
+                }
+                return r;
+            }
+
+            /*!
+             * t with leaf l added at the end, or boost::none if t is full.
+             */
+            static boost::optional<ref> push_back_into(const ref& t, const ref& l) {
+                if (t.height() == 0)
+                    return boost::none;
+                const inner* in = t.inner();
+                if (in->height > 1) {
+                    boost::optional<ref> last = push_back_into(in->kids[in->n - 1], l);
+                    if (last) {
+                        inner* out = new inner(in->height);
+                        ref r(out);
+                        out->push_range(*in, 0, in->n - 1);
+                        out->push(last.get());
+                        return r;
+                    }
+                }
+                if (in->n == WIDTH)
+                    return boost::none;
+                inner* out = new inner(in->height);
+                ref r(out);
+                out->push_range(*in, 0, in->n);
+                out->push(path_to(l, in->height - 1));
+                return r;
+            }
+
+            static boost::optional<ref> push_front_into(const ref& t, const ref& l) {
+                if (t.height() == 0)
+                    return boost::none;
+                const inner* in = t.inner();
+                if (in->height > 1) {
+                    boost::optional<ref> first = push_front_into(in->kids[0], l);
+                    if (first) {
+                        inner* out = new inner(in->height);
+                        ref r(out);
+                        out->push(first.get());
+                        out->push_range(*in, 1, in->n);
+                        return r;
+                    }
+                }
+                if (in->n == WIDTH)
+                    return boost::none;
+                inner* out = new inner(in->height);
+                ref r(out);
+                out->push(path_to(l, in->height - 1));
+                out->push_range(*in, 0, in->n);
+                return r;
+            }
+
+            static ref push_back_leaf(const ref& t, const ref& l) {
+                if (!t.p)
+                    return l;
+                boost::optional<ref> r = push_back_into(t, l);
+                if (r)
+                    return r.get();
+                inner* top = new inner(t.height() + 1);
+                ref out(top);
+                top->push(t);
+                top->push(path_to(l, t.height()));
+                return out;
+            }
+
+            static ref push_front_leaf(const ref& t, const ref& l) {
+                if (!t.p)
+                    return l;
+                boost::optional<ref> r = push_front_into(t, l);
+                if (r)
+                    return r.get();
+                inner* top = new inner(t.height() + 1);
+                ref out(top);
+                top->push(path_to(l, t.height()));
+                top->push(t);
+                return out;
+            }
+
+            /*!
+             * The child of in that holds element i, adjusting i to be its index there.
+             * No child holds more than 32^height elements, so the radix guess is never
+             * past it, and it's usually right.
+             */
+            static int child_index(const inner* in, size_t& i) {
+                int shift = impl::RRB_BITS * in->height;
+                int j = shift >= (int)(8 * sizeof(size_t)) ? 0 : std::min((int)(i >> shift), in->n - 1);
+                while (in->sizes[j] <= i)
+                    j++;
+                if (j > 0)
+                    i -= in->sizes[j - 1];
+                return j;
+            }
+
+            /*!
+             * The leaf of t that holds element i, adjusting i to be its index there.
+             */
+            static const ref& leaf_of(const ref& t, size_t& i) {
+                const ref* r = &t;
+                while (r->height() > 0) {
+                    const inner* in = r->inner();
+                    r = &in->kids[child_index(in, i)];
+                }
+                return *r;
+            }
+
+            static ref update_leaf(const ref& l, size_t i, const A& a) {
+                ref out(new leaf(l.lo), l.lo, l.lo);
+                for (int k = 0; k < l.hi - l.lo; k++)
+                    leaf_push(out, (size_t)k == i ? a : element(l, k));
+                return out;
+            }
+
+            static ref update_tree(const ref& t, size_t i, const A& a) {
+                if (t.height() == 0)
+                    return update_leaf(t, i, a);
+                const inner* in = t.inner();
+                int j = child_index(in, i);
+                inner* out = new inner(in->height);
+                ref r(out);
+                out->push_range(*in, 0, j);
+                out->push(update_tree(in->kids[j], i, a));
+                out->push_range(*in, j + 1, in->n);
+                return r;
+            }
+
+            /*!
+             * The first k elements of t, where 0 < k < t.size().  Only the path to
+             * element k is copied.
+             */
+            static ref take_tree(const ref& t, size_t k) {
+                if (t.height() == 0)
+                    return ref(t.p.get(), t.lo, t.lo + (int)k);
+                const inner* in = t.inner();
+                size_t i = k - 1;
+                int j = child_index(in, i);
+                inner* out = new inner(in->height);
+                ref r(out);
+                out->push_range(*in, 0, j);
+                out->push(i + 1 == in->kids[j].size() ? in->kids[j] : take_tree(in->kids[j], i + 1));
+                return r;
+            }
+
+            /*!
+             * t without its first k elements, where 0 < k < t.size().
+             */
+            static ref drop_tree(const ref& t, size_t k) {
+                if (t.height() == 0)
+                    return ref(t.p.get(), t.lo + (int)k, t.hi);
+                const inner* in = t.inner();
+                size_t i = k;
+                int j = child_index(in, i);
+                inner* out = new inner(in->height);
+                ref r(out);
+                out->push(i == 0 ? in->kids[j] : drop_tree(in->kids[j], i));
+                out->push_range(*in, j + 1, in->n);
+                return r;
+            }
+
+            /*!
+             * Remove single-child nodes from the top of a tree.
+             */
+            static ref trim(ref t) {
+                while (t.p && t.height() > 0 && t.inner()->n == 1) {
+                    ref kid = t.inner()->kids[0];
+                    t = std::move(kid);
+                }
+                return t;
+            }
+
+            /*!
+             * Nodes of the specified height holding the slots of nodes[i, j), packed
+             * from the left.
+             */
+            static std::vector<ref> repack(const std::vector<ref>& nodes, size_t i, size_t j, int height) {
+                std::vector<ref> out;
+                if (height == 0) {
+                    ref l;
+                    for (size_t m = i; m < j; m++)
+                        for (int k = nodes[m].lo; k < nodes[m].hi; k++) {
+                            if (!l.p || l.hi == WIDTH) {
+                                if (l.p) out.push_back(l);
+                                l = ref(new leaf(0), 0, 0);
+                            }
+                            leaf_push(l, *nodes[m].leaf()->slot(k));
+                        }
+                    if (l.p) out.push_back(l);
+                }
+                else {
+                    inner* in = NULL;
+                    for (size_t m = i; m < j; m++) {
+                        const inner* from = nodes[m].inner();
+                        for (int k = 0; k < from->n; k++) {
+                            if (in == NULL || in->n == WIDTH) {
+                                in = new inner(height);
+                                out.push_back(ref(in));
+                            }
+                            in->push_range(*from, k, k + 1);
+                        }
+                    }
+                }
+                return out;
+            }
+
+            /*!
+             * Merge the nodes that have spare slots until there are at most RRB_EXTRAS
+             * more nodes than would be needed if they were all full.  This bounds how
+             * far child_index has to search past its guess.
+             */
+            static void rebalance(std::vector<ref>& nodes, int height) {
+                size_t total = 0;
+                for (const ref& r : nodes)
+                    total += r.slots();
+                size_t fewest = (total + WIDTH - 1) / WIDTH;
+                size_t i = 0;
+                while (nodes.size() > fewest + impl::RRB_EXTRAS) {
+                    while (i < nodes.size() && nodes[i].slots() >= WIDTH - impl::RRB_EXTRAS / 2)
+                        i++;
+                    // Find the shortest run starting at i that fits in one fewer node.
+                    size_t j = i, run = 0;
+                    while (j < nodes.size() && (j == i || run > (size_t)WIDTH * (j - i - 1)))
+                        run += nodes[j++].slots();
+                    if (j == i || run > (size_t)WIDTH * (j - i - 1)) {
+                        // Only nearly full nodes are left to merge, so pack everything
+                        // after the full nodes at the front, which leaves the fewest.
+                        size_t k = 0;
+                        while (nodes[k].slots() == WIDTH)
+                            k++;
+                        std::vector<ref> packed = repack(nodes, k, nodes.size(), height);
+                        nodes.erase(nodes.begin() + k, nodes.end());
+                        nodes.insert(nodes.end(), packed.begin(), packed.end());
+                        break;
+                    }
+                    std::vector<ref> packed = repack(nodes, i, j, height);
+                    nodes.erase(nodes.begin() + i, nodes.begin() + j);
+                    nodes.insert(nodes.begin() + i, packed.begin(), packed.end());
+                }
+            }
+
+            /*!
+             * Group nodes into parents of the specified height.
+             */
+            static std::vector<ref> pack(const std::vector<ref>& nodes, int height) {
+                std::vector<ref> out;
+                inner* in = NULL;
+                for (const ref& r : nodes) {
+                    if (in == NULL || in->n == WIDTH) {
+                        in = new inner(height);
+                        out.push_back(ref(in));
+                    }
+                    in->push(r);
+                }
+                return out;
+            }
+
+            /*!
+             * Nodes of height max(l.height(), r.height()) holding the elements of l
+             * followed by r.  Only the nodes along the seam are rebuilt.
+             */
+            static std::vector<ref> concat_trees(const ref& l, const ref& r) {
+                int hl = l.height(), hr = r.height();
+                std::vector<ref> kids;
+                if (hl == 0 && hr == 0) {
+                    if (l.size() + r.size() <= (size_t)WIDTH) {
+                        ref out = copy_leaf(l, 0);
+                        for (int k = r.lo; k < r.hi; k++)
+                            leaf_push(out, *r.leaf()->slot(k));
+                        kids.push_back(out);
+                    }
+                    else {
+                        kids.push_back(l);
+                        kids.push_back(r);
+                    }
+                    return kids;
+                }
+                const inner* li = hl >= hr ? l.inner() : NULL;
+                const inner* ri = hr >= hl ? r.inner() : NULL;
+                if (li != NULL)
+                    kids.assign(li->kids, li->kids + li->n - 1);
+                std::vector<ref> mid = concat_trees(li != NULL ? li->kids[li->n - 1] : l,
+                                                    ri != NULL ? ri->kids[0] : r);
+                kids.insert(kids.end(), mid.begin(), mid.end());
+                if (ri != NULL)
+                    kids.insert(kids.end(), ri->kids + 1, ri->kids + ri->n);
+                int height = std::max(hl, hr);
+                rebalance(kids, height - 1);
+                return pack(kids, height);
+            }
+
+            static ref concat_tree(const ref& l, const ref& r) {
+                if (!l.p) return r;
+                if (!r.p) return l;
+                std::vector<ref> top = concat_trees(l, r);
+                int height = std::max(l.height(), r.height());
+                while (top.size() > 1)
+                    top = pack(top, ++height);
+                return trim(top[0]);
+            }
+
+            /*!
+             * Call f(first, count) on each leaf's elements in order.
+             */
+            template <class Fn>
+            static void each_leaf(const ref& t, const Fn& f) {
+                if (!t.p)
+                    return;
+                if (t.height() == 0)
+                    f(t.leaf()->slot(t.lo), t.hi - t.lo);
+                else {
+                    const inner* in = t.inner();
+                    for (int i = 0; i < in->n; i++)
+                        each_leaf(in->kids[i], f);
+                }
+            }
+
+            /*!
+             * The contiguous elements around element i.  start is set to the index of
+             * the first of them, and len to how many there are.
+             */
+            const A* chunk(size_t i, size_t& start, int& len) const {
+                size_t fs = front.size(), ts = root.size();
+                const ref* l;
+                size_t k = i;
+                if (i < fs)
+                    l = &front;
+                else if (i < fs + ts) {
+                    k = i - fs;
+                    l = &leaf_of(root, k);
+                }
+                else {
+                    k = i - fs - ts;
+                    l = &back;
+                }
+                start = i - k;
+                len = l->hi - l->lo;
+                return l->leaf()->slot(l->lo);
+            }
 
         public:
+            typedef A value_type;
+
             class iterator {
                 friend class seq<A>;
                 private:
-                    typename map<int, A>::iterator it;
-                    iterator(const typename map<int, A>::iterator& it) : it(it) {}
+                    seq<A> s;
+                    size_t i;
+                    const A* c;     // The elements around i, which s keeps alive
+                    size_t start;   // The index of c[0]
+                    int len;
+                    iterator(const seq<A>& s, size_t i) : s(s), i(i) {
+                        c = this->s.chunk(i, start, len);
+                    }
+                    iterator(const iterator& it, size_t i) : s(it.s), i(i), c(it.c), start(it.start), len(it.len) {
+                        if (i < start || i >= start + len)
+                            c = s.chunk(i, start, len);
+                    }
 
                 public:
                     boost::optional<iterator> next() {
-                        auto oIt = it.next();
-                        if (oIt)
-                            return boost::optional<iterator>(iterator(oIt.get()));
+                        if (i + 1 < s.n)
+                            return boost::optional<iterator>(iterator(*this, i + 1));
                         else
                             return boost::optional<iterator>();
                     }
 
                     boost::optional<iterator> prev() {
-                        auto oIt = it.prev();
-                        if (oIt)
-                            return boost::optional<iterator>(iterator(oIt.get()));
+                        if (i > 0)
+                            return boost::optional<iterator>(iterator(*this, i - 1));
                         else
                             return boost::optional<iterator>();
                     }
 
-                    A get() const { return it.get_value(); }
+                    const A& get() const { return c[i - start]; }
+
+                    /*!
+                     * The position of this element in the seq.
+                     */
+                    size_t index() const { return i; }
 
+                    /*!
+                     * Return the seq without this element.  O(log N).
+                     */
                     seq<A> remove() const
                     {
-                        return seq<A>(it.remove());
+                        seq<A> before, rest;
+                        std::tie(before, rest) = s.split_at(i);
+                        return before + std::get<1>(rest.split_at(1));
                     }
             };
             friend class seq<A>::iterator;
 
-            seq() {}
+            seq() : n(0) {}
+
+            /*!
+             * construct a seq from a C++11 initializer list.
+             */
+            seq(std::initializer_list<A> il) : n(0) {
+                for (const A& a : il)
+                    *this = emplace_back(a);
+            }
+
+            /*!
+             * True if this seq has anything in it.
+             */
+            operator bool() const
+            {
+                return n != 0;
+            }
+
+            /*!
+             * O(1).
+             */
+            size_t size() const
+            {
+                return n;
+            }
 
             boost::optional<iterator> begin() const
             {
-                auto oIt = m.begin();
-                if (oIt)
-                    return boost::optional<iterator>(iterator(oIt.get()));
+                if (n != 0)
+                    return boost::optional<iterator>(iterator(*this, 0));
                 else
                     return boost::optional<iterator>();
             }
 
+            /*!
+             * An iterator pointing at the last element.
+             */
             boost::optional<iterator> end() const
             {
-                auto oIt = m.end();
-                if (oIt)
-                    return boost::optional<iterator>(iterator(oIt.get()));
+                if (n != 0)
+                    return boost::optional<iterator>(iterator(*this, n - 1));
                 else
                     return boost::optional<iterator>();
             }
 
+            /*!
+             * Caller must ensure that ix < size().  O(log32 N).
+             */
+            const A& operator [] (size_t ix) const
+            {
+                size_t fs = front.size(), ts = root.size();
+                if (ix < fs)
+                    return element(front, (int)ix);
+                if (ix < fs + ts) {
+                    size_t k = ix - fs;
+                    const ref& l = leaf_of(root, k);
+                    return element(l, (int)k);
+                }
+                return element(back, (int)(ix - fs - ts));
+            }
+
+            /*!
+             * Return this seq with the element at index ix replaced by a.  Caller must
+             * ensure that ix < size().  O(log32 N).
+             */
+            seq update(size_t ix, const A& a) const
+            {
+                size_t fs = front.size(), ts = root.size();
+                if (ix < fs)
+                    return seq(update_leaf(front, ix, a), root, back, n);
+                if (ix < fs + ts)
+                    return seq(front, update_tree(root, ix - fs, a), back, n);
+                return seq(front, root, update_leaf(back, ix - fs - ts, a), n);
+            }
+
+            /*!
+             * Return the first ix elements and the rest.  O(log N).
+             */
+            std::tuple<seq, seq> split_at(size_t ix) const
+            {
+                if (ix == 0)
+                    return std::make_tuple(seq(), *this);
+                if (ix >= n)
+                    return std::make_tuple(*this, seq());
+                size_t fs = front.size(), ts = root.size();
+                if (ix <= fs) {
+                    int k = front.lo + (int)ix;
+                    return std::make_tuple(seq(slice(front, front.lo, k), ref(), ref(), ix),
+                                           seq(slice(front, k, front.hi), root, back, n - ix));
+                }
+                if (ix < fs + ts) {
+                    size_t k = ix - fs;
+                    return std::make_tuple(seq(front, trim(take_tree(root, k)), ref(), ix),
+                                           seq(ref(), trim(drop_tree(root, k)), back, n - ix));
+                }
+                int k = back.lo + (int)(ix - fs - ts);
+                return std::make_tuple(seq(front, root, slice(back, back.lo, k), ix),
+                                       seq(ref(), ref(), slice(back, k, back.hi), n - ix));
+            }
+
             seq prepend(const A& a) const {
-                auto oIt = m.begin();
-                if (oIt)
-                    return seq<A>(m.insert(oIt.get().get_key() - 1, a));
-                else
-                    return seq<A>(map<int, A>().insert(0, a));
+                return emplace_front(a);
+            }
+
+            seq prepend(A&& a) const {
+                return emplace_front(std::move(a));
             }
 
             seq append(const A& a) const {
-                auto oIt = m.end();
-                if (oIt)
-                    return seq<A>(m.insert(oIt.get().get_key() + 1, a));
-                else
-                    return seq<A>(map<int, A>().insert(0, a));
+                return emplace_back(a);
+            }
+
+            seq append(A&& a) const {
+                return emplace_back(std::move(a));
+            }
+
+            /*!
+             * Its nodes never come from an arena, so this seq is returned unchanged.
+             */
+            seq promote() const {
+                return *this;
+            }
+
+            template <class... Args>
+            seq emplace_front(Args&&... args) const {
+                seq s(*this);
+                if (!s.front.p || !claim_front(s.front, std::forward<Args>(args)...)) {
+                    if (s.front.size() == (size_t)WIDTH) {
+                        s.root = push_front_leaf(s.root, s.front);
+                        s.front = ref();
+                    }
+                    s.front = copy_leaf(s.front, WIDTH - (int)s.front.size());
+                    claim_front(s.front, std::forward<Args>(args)...);
+                }
+                s.n++;
+                return s;
+            }
+
+            template <class... Args>
+            seq emplace_back(Args&&... args) const {
+                seq s(*this);
+                if (!s.back.p || !claim_back(s.back, std::forward<Args>(args)...)) {
+                    if (s.back.size() == (size_t)WIDTH) {
+                        s.root = push_back_leaf(s.root, s.back);
+                        s.back = ref();
+                    }
+                    s.back = copy_leaf(s.back, 0);
+                    claim_back(s.back, std::forward<Args>(args)...);
+                }
+                s.n++;
+                return s;
+            }
+
+            template <class B>
+            B foldl(std::function<B(const B&,const A&)> f, B b) const
+            {
+                auto step = [&f, &b] (const A* xs, int len) {
+                    for (int k = 0; k < len; k++)
+                        b = f(b, xs[k]);
+                };
+                each_leaf(front, step);
+                each_leaf(root, step);
+                each_leaf(back, step);
+                return b;
+            }
+
+            /*!
+             * Concatenate two seqs.  O(log N).
+             */
+            friend seq operator + (const seq& one, const seq& two)
+            {
+                if (one.n == 0) return two;
+                if (two.n == 0) return one;
+                ref left = one.back.p ? push_back_leaf(one.root, one.back) : one.root;
+                ref right = two.front.p ? push_front_leaf(two.root, two.front) : two.root;
+                return seq(one.front, concat_tree(left, right), two.back, one.n + two.n);
             }
     };
 };
@@ -5,16 +5,38 @@
  */
 #include <heist/set.h>
 #include <stdexcept>
+#include <future>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 
 namespace heist {
     namespace impl {
 
+        /*!
+         * Order y (whose key is x) amongst a and b.
+         */
         std::tuple<const Ptr*, const Ptr*, const Ptr*> insertItem(
-            std::function<int(const Ptr&, const Ptr&)> compare, const Ptr& x, const Ptr& a, const Ptr& b) {
-            if (compare(x, a) < 0) return std::tuple<const Ptr*, const Ptr*, const Ptr*>(&x, &a, &b); else
-            if (compare(x, b) < 0) return std::tuple<const Ptr*, const Ptr*, const Ptr*>(&a, &x, &b); else
-                                   return std::tuple<const Ptr*, const Ptr*, const Ptr*>(&a, &b, &x);
+            const Comparator& compare, const Ptr& x, const Ptr& y, const Ptr& a, const Ptr& b) {
+            if (compare(x, a) < 0) return std::tuple<const Ptr*, const Ptr*, const Ptr*>(&y, &a, &b); else
+            if (compare(x, b) < 0) return std::tuple<const Ptr*, const Ptr*, const Ptr*>(&a, &y, &b); else
+                                   return std::tuple<const Ptr*, const Ptr*, const Ptr*>(&a, &b, &y);
+        }
+
+        const char removal_marker = 0;
+
+        static bool isRemoval(const Ptr& y)
+        {
+            return y.value == &removal_marker;
+        }
+
+        /*!
+         * True if a merge function's result y means the tree is to be left alone.
+         */
+        static bool isUnchanged(const Ptr& y, const Ptr* existing)
+        {
+            return y.value == NULL || (existing != NULL ? y.value == existing->value : isRemoval(y));
         }
 
         void nullDeleter(void*) {}
@@ -114,7 +136,7 @@ namespace heist {
                 auto push = [&] (int ix) -> heist::list<Position> {
                     return Position(Node(l1), ix) %= this->stack;
                 };
-                if (compare(l1.a, x) >= 0)
+                if (compare(x, l1.a) <= 0)
                     return boost::make_optional(push(0));
                 else
                     return boost::optional<heist::list<Position>>();
@@ -123,10 +145,10 @@ namespace heist {
                 auto push = [&] (int ix) -> heist::list<Position> {
                     return Position(Node(l2), ix) %= this->stack;
                 };
-                if (compare(l2.a, x) >= 0)
+                if (compare(x, l2.a) <= 0)
                     return boost::make_optional(push(0));
                 else
-                if (compare(l2.b, x) >= 0)
+                if (compare(x, l2.b) <= 0)
                     return boost::make_optional(push(1));
                 else
                     return boost::optional<heist::list<Position>>();
@@ -135,7 +157,7 @@ namespace heist {
                 auto push = [&] (int ix) -> heist::list<Position> {
                     return Position(Node(n2), ix) %= this->stack;
                 };
-                if (compare(n2.a, x) >= 0) {
+                if (compare(x, n2.a) <= 0) {
                     auto child = boost::apply_visitor(LowerBoundVisitor(compare, push(0), x), ((const Node*)n2.p.value)->n);
                     if (child)
                         return child;
@@ -149,7 +171,7 @@ namespace heist {
                 auto push = [&] (int ix) -> heist::list<Position> {
                     return Position(Node(n3), ix) %= this->stack;
                 };
-                if (compare(n3.a, x) >= 0) {
+                if (compare(x, n3.a) <= 0) {
                     auto child = boost::apply_visitor(LowerBoundVisitor(compare, push(0), x), ((const Node*)n3.p.value)->n);
                     if (child)
                         return child;
@@ -157,7 +179,7 @@ namespace heist {
                         return boost::make_optional(push(1));
                 }
                 else
-                if (compare(n3.b, x) >= 0) {
+                if (compare(x, n3.b) <= 0) {
                     auto child = boost::apply_visitor(LowerBoundVisitor(compare, push(2), x), ((const Node*)n3.q.value)->n);
                     if (child)
                         return child;
@@ -181,12 +203,42 @@ namespace heist {
             auto oit = lower_bound(compare, a);
             // If lower_bound found something but it didn't equal what we asked for...
             // then return "not found"
-            if (oit && compare(oit.get().get(), a) != 0)
+            if (oit && compare(a, oit.get().get()) != 0)
                 return boost::optional<iterator>();
             else
                 return oit;
         }
     
+        const Ptr* Node::search(const Comparator& compare, const Ptr& a) const
+        {
+            const Node* node = this;
+            while (true) {
+                if (const Leaf1* l1 = boost::get<Leaf1>(&node->n))
+                    return compare(a, l1->a) == 0 ? &l1->a : NULL;
+                if (const Leaf2* l2 = boost::get<Leaf2>(&node->n)) {
+                    if (compare(a, l2->a) == 0) return &l2->a;
+                    return compare(a, l2->b) == 0 ? &l2->b : NULL;
+                }
+                if (const Node2* n2 = boost::get<Node2>(&node->n)) {
+                    int c = compare(a, n2->a);
+                    if (c == 0) return &n2->a;
+                    node = (const Node*)(c < 0 ? n2->p : n2->q).value;
+                }
+                else {
+                    const Node3& n3 = boost::get<Node3>(node->n);
+                    int c = compare(a, n3.a);
+                    if (c == 0) return &n3.a;
+                    if (c < 0)
+                        node = (const Node*)n3.p.value;
+                    else {
+                        c = compare(a, n3.b);
+                        if (c == 0) return &n3.b;
+                        node = (const Node*)(c < 0 ? n3.q : n3.r).value;
+                    }
+                }
+            }
+        }
+
         bool isTerminal(const Node& node)
         {
             return boost::get<Leaf1>(&node.n) != NULL ||
@@ -507,30 +559,666 @@ namespace heist {
             }
         }
     
-        std::tuple<const Ptr*, const Ptr*, const Ptr*> insertItem(
-            std::function<int(const Ptr&, const Ptr&)> compare, const Ptr& x, const Ptr& a, const Ptr& b);
-    
+        struct MapVisitor : public boost::static_visitor<Node>
+        {
+            MapVisitor(const std::function<Ptr(const Ptr&)>& f, int parallel_depth,
+                       std::atomic<int>& spare_threads)
+                : f(f), parallel_depth(parallel_depth), spare_threads(spare_threads) {}
+            const std::function<Ptr(const Ptr&)>& f;
+            int parallel_depth;
+            std::atomic<int>& spare_threads;  // Threads we may still start
+            Ptr child(const Ptr& node) const {
+                return mkPtr<Node>(new Node(
+                    boost::apply_visitor(MapVisitor(f, parallel_depth-1, spare_threads),
+                                         ((const Node*)node.value)->n)
+                ));
+            }
+            /*!
+             * Map the child on its own thread if there's one to spare, or else on
+             * this thread when the result is asked for.
+             */
+            std::future<Ptr> async_child(const Ptr& node) const {
+                if (spare_threads.fetch_sub(1, std::memory_order_relaxed) > 0)
+                    return std::async(std::launch::async, [this, &node] () {
+                        Ptr p = child(node);
+                        spare_threads.fetch_add(1, std::memory_order_relaxed);
+                        return p;
+                    });
+                spare_threads.fetch_add(1, std::memory_order_relaxed);
+                return std::async(std::launch::deferred, [this, &node] () { return child(node); });
+            }
+            Node operator()(const Leaf1& l1) const {
+                return Node(Leaf1(f(l1.a)));
+            }
+            Node operator()(const Leaf2& l2) const {
+                Ptr a = f(l2.a);
+                return Node(Leaf2(a, f(l2.b)));
+            }
+            Node operator()(const Node2& n2) const {
+                if (parallel_depth > 0) {
+                    auto p = async_child(n2.p);
+                    Ptr a = f(n2.a);
+                    Ptr q = child(n2.q);
+                    return Node(Node2(p.get(), a, q));
+                }
+                Ptr p = child(n2.p);
+                Ptr a = f(n2.a);
+                return Node(Node2(p, a, child(n2.q)));
+            }
+            Node operator()(const Node3& n3) const {
+                if (parallel_depth > 0) {
+                    auto p = async_child(n3.p);
+                    auto q = async_child(n3.q);
+                    Ptr a = f(n3.a);
+                    Ptr b = f(n3.b);
+                    Ptr r = child(n3.r);
+                    return Node(Node3(p.get(), a, q.get(), b, r));
+                }
+                Ptr p = child(n3.p);
+                Ptr a = f(n3.a);
+                Ptr q = child(n3.q);
+                Ptr b = f(n3.b);
+                return Node(Node3(p, a, q, b, child(n3.r)));
+            }
+        };
+
+        Node Node::map(const std::function<Ptr(const Ptr&)>& f, int parallel_depth) const
+        {
+            // The calling thread is one of the hardware threads.
+            std::atomic<int> spare_threads((int)std::thread::hardware_concurrency() - 1);
+            return boost::apply_visitor(MapVisitor(f, parallel_depth, spare_threads), n);
+        }
+
+        static bool inArena(const Ptr& p)
+        {
+            return p.count != NULL && p.count->arena;
+        }
+
+        struct PromoteVisitor : public boost::static_visitor<Node>
+        {
+            PromoteVisitor(const std::function<Ptr(const Ptr&)>& copy) : copy(copy) {}
+            const std::function<Ptr(const Ptr&)>& copy;
+            Ptr elt(const Ptr& a) const {
+                return inArena(a) ? copy(a) : a;
+            }
+            // Nodes that aren't in an arena can't refer to any that are.
+            Ptr child(const Ptr& node) const {
+                return inArena(node) ? mkPtr<Node>(new Node(((const Node*)node.value)->promote(copy)))
+                                     : node;
+            }
+            Node operator()(const Leaf1& l1) const {
+                return Node(Leaf1(elt(l1.a)));
+            }
+            Node operator()(const Leaf2& l2) const {
+                Ptr a = elt(l2.a);
+                return Node(Leaf2(a, elt(l2.b)));
+            }
+            Node operator()(const Node2& n2) const {
+                Ptr p = child(n2.p);
+                Ptr a = elt(n2.a);
+                return Node(Node2(p, a, child(n2.q)));
+            }
+            Node operator()(const Node3& n3) const {
+                Ptr p = child(n3.p);
+                Ptr a = elt(n3.a);
+                Ptr q = child(n3.q);
+                Ptr b = elt(n3.b);
+                return Node(Node3(p, a, q, b, child(n3.r)));
+            }
+        };
+
+        Node Node::promote(const std::function<Ptr(const Ptr&)>& copy) const
+        {
+            return boost::apply_visitor(PromoteVisitor(copy), n);
+        }
+
+        struct WalkVisitor : public boost::static_visitor<void>
+        {
+            WalkVisitor(const std::function<bool(const Node&)>& node,
+                        const std::function<void(const Ptr&)>& elt)
+                : node(node), elt(elt) {}
+            const std::function<bool(const Node&)>& node;
+            const std::function<void(const Ptr&)>& elt;
+            void child(const Ptr& p) const {
+                const Node& c = *(const Node*)p.value;
+                if (node(c))
+                    boost::apply_visitor(*this, c.n);
+            }
+            void operator()(const Leaf1& l1) const {
+                elt(l1.a);
+            }
+            void operator()(const Leaf2& l2) const {
+                elt(l2.a);
+                elt(l2.b);
+            }
+            void operator()(const Node2& n2) const {
+                child(n2.p);
+                elt(n2.a);
+                child(n2.q);
+            }
+            void operator()(const Node3& n3) const {
+                child(n3.p);
+                elt(n3.a);
+                child(n3.q);
+                elt(n3.b);
+                child(n3.r);
+            }
+        };
+
+        void Node::walk(const std::function<bool(const Node&)>& node,
+                        const std::function<void(const Ptr&)>& elt) const
+        {
+            boost::apply_visitor(WalkVisitor(node, elt), n);
+        }
+
+        size_t Node::payload_bytes() const
+        {
+            return boost::get<Node2>(&n) ? sizeof(Node2) :
+                   boost::get<Node3>(&n) ? sizeof(Node3) : 0;
+        }
+
+        const pooled_locker& intern_locker()
+        {
+            static pooled_locker* locker = new pooled_locker;
+            return *locker;
+        }
+
+        namespace {
+            /*!
+             * The intern table holds no references, so an interned element or node
+             * is freed as usual when nothing refers to it, and intern_deleter then
+             * removes it from the table.
+             */
+            struct interned {
+                size_t hash;
+                const void* tag;    // Its intern_traits, or &nodeTag for a node
+                count* cnt;
+                deleter del;
+            };
+
+            struct intern_table {
+                std::unordered_map<const void*, interned> by_value;
+                std::unordered_multimap<size_t, const void*> by_hash;
+            };
+
+            const char nodeTag = 0;
+
+            // Deliberately never destroyed, because interned values can be freed by
+            // static destructors.
+            intern_table& table()
+            {
+                static intern_table* t = new intern_table;
+                return *t;
+            }
+
+            void intern_deleter(void* value)
+            {
+                intern_table& t = table();
+                auto it = t.by_value.find(value);
+                deleter del = it->second.del;
+                auto range = t.by_hash.equal_range(it->second.hash);
+                for (auto h = range.first; h != range.second; ++h)
+                    if (h->second == value) {
+                        t.by_hash.erase(h);
+                        break;
+                    }
+                t.by_value.erase(it);
+                del(value);
+            }
+
+            bool isInterned(const Ptr& p)
+            {
+                return p.count != NULL && p.count->del == intern_deleter;
+            }
+
+            template <class Pred>
+            Ptr lookup(size_t hash, const void* tag, const Pred& pred)
+            {
+                intern_table& t = table();
+                auto range = t.by_hash.equal_range(hash);
+                for (auto h = range.first; h != range.second; ++h) {
+                    const interned& i = t.by_value.find(h->second)->second;
+                    if (i.tag == tag && pred(h->second)) {
+                        Ptr p;
+                        p.value = const_cast<void*>(h->second);
+                        p.count = i.cnt;
+                        p.count->c++;
+                        return p;
+                    }
+                }
+                return Ptr();
+            }
+
+            Ptr add(void* value, size_t hash, const void* tag, deleter del)
+            {
+                Ptr p(value, intern_deleter);
+                interned i = { hash, tag, p.count, del };
+                intern_table& t = table();
+                t.by_value.insert(std::make_pair(value, i));
+                t.by_hash.insert(std::make_pair(hash, value));
+                return p;
+            }
+
+            Ptr internElement(const Ptr& a, const intern_traits& traits)
+            {
+                if (isInterned(a))
+                    return a;
+                size_t hash = traits.hash(a.value);
+                Ptr p = lookup(hash, &traits, [&a, &traits] (const void* b) { return traits.equal(a.value, b); });
+                return p.value != NULL ? p : add(traits.copy(a.value), hash, &traits, traits.del);
+            }
+
+            size_t identityHash(const Node& node)
+            {
+                struct Hasher : public boost::static_visitor<size_t> {
+                    static size_t h(size_t seed, const Ptr& p) { return hash_combine(seed, std::hash<void*>()(p.value)); }
+                    size_t operator()(const Leaf1& l1) const { return h(1, l1.a); }
+                    size_t operator()(const Leaf2& l2) const { return h(h(2, l2.a), l2.b); }
+                    size_t operator()(const Node2& n2) const { return h(h(h(3, n2.p), n2.a), n2.q); }
+                    size_t operator()(const Node3& n3) const { return h(h(h(h(h(5, n3.p), n3.a), n3.q), n3.b), n3.r); }
+                };
+                return boost::apply_visitor(Hasher(), node.n);
+            }
+
+            Ptr internNode(const Ptr& n, const intern_traits& traits)
+            {
+                if (isInterned(n))
+                    return n;
+                Node canon = ((const Node*)n.value)->intern(traits);
+                size_t hash = identityHash(canon);
+                Ptr p = lookup(hash, &nodeTag, [&canon] (const void* m) { return ((const Node*)m)->identical(canon); });
+                return p.value != NULL ? p : add(new Node(canon), hash, &nodeTag, heist::deleter<Node>);
+            }
+
+            struct InternVisitor : public boost::static_visitor<Node>
+            {
+                InternVisitor(const intern_traits& traits) : traits(traits) {}
+                const intern_traits& traits;
+                Ptr elt(const Ptr& a) const { return internElement(a, traits); }
+                Ptr child(const Ptr& n) const { return internNode(n, traits); }
+                Node operator()(const Leaf1& l1) const {
+                    return Node(Leaf1(elt(l1.a)));
+                }
+                Node operator()(const Leaf2& l2) const {
+                    Ptr a = elt(l2.a);
+                    return Node(Leaf2(a, elt(l2.b)));
+                }
+                Node operator()(const Node2& n2) const {
+                    Ptr p = child(n2.p);
+                    Ptr a = elt(n2.a);
+                    return Node(Node2(p, a, child(n2.q)));
+                }
+                Node operator()(const Node3& n3) const {
+                    Ptr p = child(n3.p);
+                    Ptr a = elt(n3.a);
+                    Ptr q = child(n3.q);
+                    Ptr b = elt(n3.b);
+                    return Node(Node3(p, a, q, b, child(n3.r)));
+                }
+            };
+        }
+
+        Node Node::intern(const intern_traits& traits) const
+        {
+            return boost::apply_visitor(InternVisitor(traits), n);
+        }
+
+        bool Node::identical(const Node& other) const
+        {
+            if (n.which() != other.n.which())
+                return false;
+            if (const Leaf1* x = boost::get<Leaf1>(&n)) {
+                const Leaf1& y = boost::get<Leaf1>(other.n);
+                return x->a.value == y.a.value;
+            }
+            if (const Leaf2* x = boost::get<Leaf2>(&n)) {
+                const Leaf2& y = boost::get<Leaf2>(other.n);
+                return x->a.value == y.a.value && x->b.value == y.b.value;
+            }
+            if (const Node2* x = boost::get<Node2>(&n)) {
+                const Node2& y = boost::get<Node2>(other.n);
+                return x->p.value == y.p.value && x->a.value == y.a.value && x->q.value == y.q.value;
+            }
+            const Node3& x = boost::get<Node3>(n);
+            const Node3& y = boost::get<Node3>(other.n);
+            return x.p.value == y.p.value && x.a.value == y.a.value && x.q.value == y.q.value &&
+                   x.b.value == y.b.value && x.r.value == y.r.value;
+        }
+
+        namespace {
+            struct ContentHashVisitor : public boost::static_visitor<size_t>
+            {
+                ContentHashVisitor(element_hasher hash_of) : hash_of(hash_of) {}
+                element_hasher hash_of;
+                size_t elt(const Ptr& a) const { return mix_hash(hash_of(a.value)); }
+                size_t child(const Ptr& n) const { return ((const Node*)n.value)->content_hash(hash_of); }
+                size_t operator()(const Leaf1& l1) const { return elt(l1.a); }
+                size_t operator()(const Leaf2& l2) const { return elt(l2.a) + elt(l2.b); }
+                size_t operator()(const Node2& n2) const {
+                    return child(n2.p) + elt(n2.a) + child(n2.q);
+                }
+                size_t operator()(const Node3& n3) const {
+                    return child(n3.p) + elt(n3.a) + child(n3.q) + elt(n3.b) + child(n3.r);
+                }
+            };
+        }
+
+        size_t Node::content_hash(element_hasher hash_of) const
+        {
+            size_t h = hash.load(std::memory_order_relaxed);
+            if (h == 0) {
+                // Summing makes it independent of the shape.  (A hash of 0 isn't
+                // cached, which only costs time.)
+                h = boost::apply_visitor(ContentHashVisitor(hash_of), n);
+                hash.store(h, std::memory_order_relaxed);
+            }
+            return h;
+        }
+
+        namespace {
+            /*!
+             * The part of a tree that diff() hasn't visited yet, as a stack of subtrees
+             * and elements with the smallest on top.
+             */
+            struct Frontier {
+                struct Item {
+                    const Node* node;   // NULL if it's an element
+                    const Ptr* elt;
+                    int height;         // Of node, where leaves are 0
+                };
+                std::vector<Item> items;
+
+                Frontier(const boost::optional<Node>& root) {
+                    if (root) {
+                        int height = 0;
+                        for (const Node* n = &root.get(); ; height++) {
+                            if (const Node2* n2 = boost::get<Node2>(&n->n))
+                                n = (const Node*)n2->p.value;
+                            else if (const Node3* n3 = boost::get<Node3>(&n->n))
+                                n = (const Node*)n3->p.value;
+                            else
+                                break;
+                        }
+                        Item i = { &root.get(), NULL, height };
+                        items.push_back(i);
+                    }
+                }
+                bool empty() const { return items.empty(); }
+                const Item& top() const { return items.back(); }
+                void pop() { items.pop_back(); }
+                void push_elt(const Ptr& a) {
+                    Item i = { NULL, &a, 0 };
+                    items.push_back(i);
+                }
+                void push_node(const Ptr& n, int height) {
+                    Item i = { (const Node*)n.value, NULL, height };
+                    items.push_back(i);
+                }
+                /*!
+                 * Replace the node on top with its contents.
+                 */
+                void expand() {
+                    Item i = top();
+                    pop();
+                    if (const Leaf1* l1 = boost::get<Leaf1>(&i.node->n))
+                        push_elt(l1->a);
+                    else if (const Leaf2* l2 = boost::get<Leaf2>(&i.node->n)) {
+                        push_elt(l2->b);
+                        push_elt(l2->a);
+                    }
+                    else if (const Node2* n2 = boost::get<Node2>(&i.node->n)) {
+                        push_node(n2->q, i.height - 1);
+                        push_elt(n2->a);
+                        push_node(n2->p, i.height - 1);
+                    }
+                    else {
+                        const Node3& n3 = boost::get<Node3>(i.node->n);
+                        push_node(n3.r, i.height - 1);
+                        push_elt(n3.b);
+                        push_node(n3.q, i.height - 1);
+                        push_elt(n3.a);
+                        push_node(n3.p, i.height - 1);
+                    }
+                }
+            };
+        }
+
+        void diff(const boost::optional<Node>& a, const boost::optional<Node>& b,
+                  const Comparator& compare, element_hasher hash_of,
+                  bool (*equal)(const void* a, const void* b), const DiffFn& f)
+        {
+            Frontier fa(a), fb(b);
+            while (!fa.empty() && !fb.empty()) {
+                const Frontier::Item& x = fa.top();
+                const Frontier::Item& y = fb.top();
+                if (x.node != NULL && y.node != NULL) {
+                    // Both subtrees come next in their trees, so if they hold the
+                    // same elements, they can be skipped together.
+                    if (x.node == y.node ||
+                            x.node->content_hash(hash_of) == y.node->content_hash(hash_of)) {
+                        fa.pop();
+                        fb.pop();
+                    }
+                    else if (x.height > y.height)
+                        fa.expand();
+                    else if (x.height < y.height)
+                        fb.expand();
+                    else {
+                        fa.expand();
+                        fb.expand();
+                    }
+                }
+                else if (x.node != NULL)
+                    fa.expand();
+                else if (y.node != NULL)
+                    fb.expand();
+                else {
+                    const Ptr* ea = x.elt;
+                    const Ptr* eb = y.elt;
+                    int c = compare(*ea, *eb);
+                    if (c < 0) {
+                        fa.pop();
+                        f(ea, NULL);
+                    }
+                    else if (c > 0) {
+                        fb.pop();
+                        f(NULL, eb);
+                    }
+                    else {
+                        fa.pop();
+                        fb.pop();
+                        if (ea->value != eb->value && !equal(ea->value, eb->value))
+                            f(ea, eb);
+                    }
+                }
+            }
+            while (!fa.empty()) {
+                if (fa.top().node != NULL)
+                    fa.expand();
+                else {
+                    f(fa.top().elt, NULL);
+                    fa.pop();
+                }
+            }
+            while (!fb.empty()) {
+                if (fb.top().node != NULL)
+                    fb.expand();
+                else {
+                    f(NULL, fb.top().elt);
+                    fb.pop();
+                }
+            }
+        }
+
+        /*!
+         * The 3-node made from sibling, which is a 2-node, and the separator k
+         * between it and a child that shrank to hole.
+         */
+        static Node join(const Ptr& hole, const Ptr& k, const Node& sibling, bool holeLeft)
+        {
+            if (const Leaf1* l1 = boost::get<Leaf1>(&sibling.n))
+                return holeLeft ? Node(Leaf2(k, l1->a)) : Node(Leaf2(l1->a, k));
+            const Node2& n2 = boost::get<Node2>(sibling.n);
+            return holeLeft ? Node(Node3(hole, k, n2.p, n2.a, n2.q))
+                            : Node(Node3(n2.p, n2.a, n2.q, k, hole));
+        }
+
+        /*!
+         * Take an element from sibling, which is a 3-node, to refill a child that
+         * shrank to hole, returning the new left node, separator and right node.
+         */
+        static std::tuple<Node, Ptr, Node> borrowFrom(const Ptr& hole, const Ptr& k, const Node& sibling,
+                                                      bool holeLeft)
+        {
+            if (const Leaf2* l2 = boost::get<Leaf2>(&sibling.n))
+                return holeLeft ? std::make_tuple(Node(Leaf1(k)), l2->a, Node(Leaf1(l2->b)))
+                                : std::make_tuple(Node(Leaf1(l2->a)), l2->b, Node(Leaf1(k)));
+            const Node3& n3 = boost::get<Node3>(sibling.n);
+            return holeLeft ? std::make_tuple(Node(Node2(hole, k, n3.p)), n3.a, Node(Node2(n3.q, n3.b, n3.r)))
+                            : std::make_tuple(Node(Node2(n3.p, n3.a, n3.q)), n3.b, Node(Node2(n3.r, k, hole)));
+        }
+
+        /*!
+         * parent with its child at ix (0, 2 or 4) replaced by result, which is a
+         * Node or Shrunk.
+         */
+        static Node::InsertResult withChild(const Node& parent, int ix, const Node::InsertResult& result)
+        {
+            if (const Node* newNode = boost::get<Node>(&result)) {
+                Ptr c = mkPtr<Node>(new Node(*newNode));
+                if (const Node2* n2 = boost::get<Node2>(&parent.n))
+                    return Node::InsertResult(ix == 0 ? Node(Node2(c, n2->a, n2->q))
+                                                      : Node(Node2(n2->p, n2->a, c)));
+                const Node3& n3 = boost::get<Node3>(parent.n);
+                return Node::InsertResult(ix == 0 ? Node(Node3(c, n3.a, n3.q, n3.b, n3.r)) :
+                                          ix == 2 ? Node(Node3(n3.p, n3.a, c, n3.b, n3.r))
+                                                  : Node(Node3(n3.p, n3.a, n3.q, n3.b, c)));
+            }
+            const Ptr& hole = boost::get<Shrunk>(result).node;
+            if (const Node2* n2 = boost::get<Node2>(&parent.n)) {
+                bool holeLeft = ix == 0;
+                const Node& sibling = *(const Node*)(holeLeft ? n2->q : n2->p).value;
+                if (is_two_node(sibling))
+                    // The parent shrinks in turn.
+                    return Node::InsertResult(Shrunk { mkPtr<Node>(new Node(join(hole, n2->a, sibling, holeLeft))) });
+                auto tpl = borrowFrom(hole, n2->a, sibling, holeLeft);
+                return Node::InsertResult(Node(Node2(
+                    mkPtr<Node>(new Node(std::get<0>(tpl))), std::get<1>(tpl), mkPtr<Node>(new Node(std::get<2>(tpl)))
+                )));
+            }
+            const Node3& n3 = boost::get<Node3>(parent.n);
+            if (ix == 4) {
+                const Node& sibling = *(const Node*)n3.q.value;
+                if (is_two_node(sibling))
+                    return Node::InsertResult(Node(Node2(
+                        n3.p, n3.a, mkPtr<Node>(new Node(join(hole, n3.b, sibling, false)))
+                    )));
+                auto tpl = borrowFrom(hole, n3.b, sibling, false);
+                return Node::InsertResult(Node(Node3(
+                    n3.p, n3.a,
+                    mkPtr<Node>(new Node(std::get<0>(tpl))), std::get<1>(tpl), mkPtr<Node>(new Node(std::get<2>(tpl)))
+                )));
+            }
+            // A hole at p or q is refilled from the other, across a.
+            bool holeLeft = ix == 0;
+            const Node& sibling = *(const Node*)(holeLeft ? n3.q : n3.p).value;
+            if (is_two_node(sibling))
+                return Node::InsertResult(Node(Node2(
+                    mkPtr<Node>(new Node(join(hole, n3.a, sibling, holeLeft))), n3.b, n3.r
+                )));
+            auto tpl = borrowFrom(hole, n3.a, sibling, holeLeft);
+            return Node::InsertResult(Node(Node3(
+                mkPtr<Node>(new Node(std::get<0>(tpl))), std::get<1>(tpl), mkPtr<Node>(new Node(std::get<2>(tpl))),
+                n3.b, n3.r
+            )));
+        }
+
+        /*!
+         * Remove the first element of node, returning it in first.  The result is a
+         * Node or Shrunk.
+         */
+        static Node::InsertResult removeFirst(const Node& node, Ptr& first)
+        {
+            if (const Leaf1* l1 = boost::get<Leaf1>(&node.n)) {
+                first = l1->a;
+                return Node::InsertResult(Shrunk());
+            }
+            if (const Leaf2* l2 = boost::get<Leaf2>(&node.n)) {
+                first = l2->a;
+                return Node::InsertResult(Node(Leaf1(l2->b)));
+            }
+            const Ptr& p = boost::get<Node2>(&node.n) ? boost::get<Node2>(node.n).p : boost::get<Node3>(node.n).p;
+            return withChild(node, 0, removeFirst(*(const Node*)p.value, first));
+        }
+
         /*!
-         * Insert a value into this node, returning either the new node, or the
-         * overflow (as a Node2) if it doesn't fit.
+         * Remove the element of an inner node at ix (1 or 3) by replacing it with
+         * the first element of the child after it.
          */
+        static Node::InsertResult removeInner(const Node& node, int ix)
+        {
+            Ptr next;
+            if (const Node2* n2 = boost::get<Node2>(&node.n)) {
+                auto result = removeFirst(*(const Node*)n2->q.value, next);
+                return withChild(Node(Node2(n2->p, next, n2->q)), 2, result);
+            }
+            const Node3& n3 = boost::get<Node3>(node.n);
+            if (ix == 1) {
+                auto result = removeFirst(*(const Node*)n3.q.value, next);
+                return withChild(Node(Node3(n3.p, next, n3.q, n3.b, n3.r)), 2, result);
+            }
+            auto result = removeFirst(*(const Node*)n3.r.value, next);
+            return withChild(Node(Node3(n3.p, n3.a, n3.q, next, n3.r)), 4, result);
+        }
+
         typename Node::InsertResult Node::insert(const Comparator& compare, const Ptr& x) const
+        {
+            return insert(compare, x, [&x] (const Ptr*) { return x; });
+        }
+
+        /*!
+         * Insert or replace the element matching x, returning either the new node,
+         * the overflow (as a Node2) if it doesn't fit, or Unchanged if merge decided
+         * to leave the tree as it is.
+         */
+        typename Node::InsertResult Node::insert(const Comparator& compare, const Ptr& x, const Merge& merge) const
         {
             if (const Leaf1* leaf1 = boost::get<Leaf1>(&n)) {
                 int cmp = compare(x, leaf1->a);
+                const Ptr* existing = cmp == 0 ? &leaf1->a : NULL;
+                Ptr y(merge(existing));
+                if (isUnchanged(y, existing))
+                    return Node::InsertResult(Unchanged());
+                if (isRemoval(y))
+                    return Node::InsertResult(Shrunk());
                 return Node::InsertResult(
-                    cmp == 0 ? Node(Leaf1(x)) :
-                    cmp < 0  ? Node(Leaf2(x, leaf1->a)) :
-                               Node(Leaf2(leaf1->a, x))
+                    cmp == 0 ? Node(Leaf1(y)) :
+                    cmp < 0  ? Node(Leaf2(y, leaf1->a)) :
+                               Node(Leaf2(leaf1->a, y))
                 );
             }
             else
             if (const Leaf2* leaf2 = boost::get<Leaf2>(&n)) {
                 if (compare(x, leaf2->a) == 0) {
-                    return Node::InsertResult(Node(Leaf2(x, leaf2->b)));
+                    Ptr y(merge(&leaf2->a));
+                    if (isUnchanged(y, &leaf2->a))
+                        return Node::InsertResult(Unchanged());
+                    if (isRemoval(y))
+                        return Node::InsertResult(Node(Leaf1(leaf2->b)));
+                    return Node::InsertResult(Node(Leaf2(y, leaf2->b)));
                 } else
-                if (compare(x, leaf2->b) == 0) return Node::InsertResult(Node(Leaf2(leaf2->a, x))); else {
-                    auto sml = insertItem(compare, x, leaf2->a, leaf2->b);
+                if (compare(x, leaf2->b) == 0) {
+                    Ptr y(merge(&leaf2->b));
+                    if (isUnchanged(y, &leaf2->b))
+                        return Node::InsertResult(Unchanged());
+                    if (isRemoval(y))
+                        return Node::InsertResult(Node(Leaf1(leaf2->a)));
+                    return Node::InsertResult(Node(Leaf2(leaf2->a, y)));
+                } else {
+                    Ptr y(merge(NULL));
+                    if (isUnchanged(y, NULL))
+                        return Node::InsertResult(Unchanged());
+                    auto sml = insertItem(compare, x, y, leaf2->a, leaf2->b);
                     return Node::InsertResult(Node2(  // overflow
                         mkPtr<Node>(new Node(Leaf1(*std::get<0>(sml)))),
                         *std::get<1>(sml),
@@ -542,11 +1230,16 @@ namespace heist {
             if (const Node2* node2 = boost::get<Node2>(&n)) {
                 int cmp = compare(x, node2->a);
                 if (cmp == 0) {
-                    return Node::InsertResult(Node(Node2(node2->p, x, node2->q)));
+                    Ptr y(merge(&node2->a));
+                    if (isUnchanged(y, &node2->a))
+                        return Node::InsertResult(Unchanged());
+                    if (isRemoval(y))
+                        return removeInner(*this, 1);
+                    return Node::InsertResult(Node(Node2(node2->p, y, node2->q)));
                 }
                 else
                 if (cmp < 0) {
-                    auto result = ((const Node*)node2->p.value)->insert(compare, x);
+                    auto result = ((const Node*)node2->p.value)->insert(compare, x, merge);
                     if (const Node* newNode = boost::get<Node>(&result)) {
                         return Node::InsertResult(Node(Node2(
                             mkPtr<Node>(new Node(*newNode)),
@@ -554,19 +1247,24 @@ namespace heist {
                             node2->q
                         )));
                     }
-                    else {
-                        const Node2& overflow = boost::get<Node2>(result);
+                    else
+                    if (const Node2* overflow = boost::get<Node2>(&result)) {
                         return Node::InsertResult(Node(Node3(
-                            overflow.p,
-                            overflow.a,  // to do: remove this copy
-                            overflow.q,
+                            overflow->p,
+                            overflow->a,  // to do: remove this copy
+                            overflow->q,
                             node2->a,
                             node2->q
                         )));
                     }
+                    else
+                    if (boost::get<Shrunk>(&result))
+                        return withChild(*this, 0, result);
+                    else
+                        return result;
                 }
                 else {
-                    auto result = ((const Node*)node2->q.value)->insert(compare, x);
+                    auto result = ((const Node*)node2->q.value)->insert(compare, x, merge);
                     if (const Node* newNode = boost::get<Node>(&result)) {
                         return Node::InsertResult(Node(Node2(
                             node2->p,
@@ -574,28 +1272,37 @@ namespace heist {
                             mkPtr<Node>(new Node(*newNode))
                         )));
                     }
-                    else {
-                        const Node2& overflow = boost::get<Node2>(result);
+                    else
+                    if (const Node2* overflow = boost::get<Node2>(&result)) {
                         return Node::InsertResult(Node(Node3(  // overflow
                             node2->p,
                             node2->a,
-                            overflow.p,
-                            overflow.a,  // to do: remove this copy
-                            overflow.q
+                            overflow->p,
+                            overflow->a,  // to do: remove this copy
+                            overflow->q
                         )));
                     }
+                    else
+                    if (boost::get<Shrunk>(&result))
+                        return withChild(*this, 2, result);
+                    else
+                        return result;
                 }
             }
             else {
                 const Node3& node3 = boost::get<Node3>(n);
-                if (compare(x, node3.a) == 0)
-                    return Node::InsertResult(Node(Node3(node3.p, x, node3.q, node3.b, node3.r)));
-                else
-                if (compare(x, node3.b) == 0)
-                    return Node::InsertResult(Node(Node3(node3.p, node3.a, node3.q, x, node3.r)));
+                int cmpA = compare(x, node3.a);
+                if (cmpA == 0) {
+                    Ptr y(merge(&node3.a));
+                    if (isUnchanged(y, &node3.a))
+                        return Node::InsertResult(Unchanged());
+                    if (isRemoval(y))
+                        return removeInner(*this, 1);
+                    return Node::InsertResult(Node(Node3(node3.p, y, node3.q, node3.b, node3.r)));
+                }
                 else
-                if (compare(x, node3.a) < 0) {
-                    auto result = ((Node*)node3.p.value)->insert(compare, x);
+                if (cmpA < 0) {
+                    auto result = ((Node*)node3.p.value)->insert(compare, x, merge);
                     if (const Node* newNode = boost::get<Node>(&result)) {
                         return Node::InsertResult(Node(Node3(
                             mkPtr<Node>(new Node(*newNode)),
@@ -605,18 +1312,32 @@ namespace heist {
                             node3.r
                         )));
                     }
-                    else {
-                        const Node2& overflow = boost::get<Node2>(result);
+                    else
+                    if (const Node2* overflow = boost::get<Node2>(&result)) {
                         return Node::InsertResult(Node2(  // overflow
-                            mkPtr<Node>(new Node(overflow)),
+                            mkPtr<Node>(new Node(*overflow)),
                             node3.a,
                             mkPtr<Node>(new Node(Node2(node3.q, node3.b, node3.r)))
                         ));
                     }
+                    else
+                    if (boost::get<Shrunk>(&result))
+                        return withChild(*this, 0, result);
+                    else
+                        return result;
+                }
+                int cmpB = compare(x, node3.b);
+                if (cmpB == 0) {
+                    Ptr y(merge(&node3.b));
+                    if (isUnchanged(y, &node3.b))
+                        return Node::InsertResult(Unchanged());
+                    if (isRemoval(y))
+                        return removeInner(*this, 3);
+                    return Node::InsertResult(Node(Node3(node3.p, node3.a, node3.q, y, node3.r)));
                 }
                 else
-                if (compare(x, node3.b) < 0) {
-                    auto result = ((const Node*)node3.q.value)->insert(compare, x);
+                if (cmpB < 0) {
+                    auto result = ((const Node*)node3.q.value)->insert(compare, x, merge);
                     if (const Node* newNode = boost::get<Node>(&result)) {
                         return Node::InsertResult(Node(Node3(
                             node3.p,
@@ -626,17 +1347,22 @@ namespace heist {
                             node3.r
                         )));
                     }
-                    else {
-                        const Node2& overflow = boost::get<Node2>(result);
+                    else
+                    if (const Node2* overflow = boost::get<Node2>(&result)) {
                         return Node::InsertResult(Node2(  // overflow
-                            mkPtr<Node>(new Node(Node2(node3.p, node3.a, overflow.p))),
-                            overflow.a,  // to do: remove this copy
-                            mkPtr<Node>(new Node(Node2(overflow.q, node3.b, node3.r)))
+                            mkPtr<Node>(new Node(Node2(node3.p, node3.a, overflow->p))),
+                            overflow->a,  // to do: remove this copy
+                            mkPtr<Node>(new Node(Node2(overflow->q, node3.b, node3.r)))
                         ));
                     }
+                    else
+                    if (boost::get<Shrunk>(&result))
+                        return withChild(*this, 2, result);
+                    else
+                        return result;
                 }
                 else {
-                    auto result = ((const Node*)node3.r.value)->insert(compare, x);
+                    auto result = ((const Node*)node3.r.value)->insert(compare, x, merge);
                     if (const Node* newNode = boost::get<Node>(&result)) {
                         return Node::InsertResult(Node(Node3(
                             node3.p,
@@ -646,14 +1372,19 @@ namespace heist {
                             mkPtr<Node>(new Node(*newNode))
                         )));
                     }
-                    else {
-                        const Node2& overflow = boost::get<Node2>(result);
+                    else
+                    if (const Node2* overflow = boost::get<Node2>(&result)) {
                         return Node::InsertResult(Node2(  // overflow
                             mkPtr<Node>(new Node(Node2(node3.p, node3.a, node3.q))),
                             node3.b,
-                            mkPtr<Node>(new Node(overflow))
+                            mkPtr<Node>(new Node(*overflow))
                         ));
                     }
+                    else
+                    if (boost::get<Shrunk>(&result))
+                        return withChild(*this, 4, result);
+                    else
+                        return result;
                 }
             }
         }
@@ -28,17 +28,54 @@
 
 #include <heist/light_ptr.h>
 #include <heist/list.h>
+#include <heist/node_pool.h>
 #include <heist/pooled_locker.h>
 
 #include <boost/variant.hpp>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <unistd.h>  // for size_t
 
 namespace heist {
     namespace impl {
         typedef heist::unsafe_light_ptr Ptr;
-        typedef int (*Comparator)(const Ptr&, const Ptr&);
+
+        struct access;
+        struct intern_traits;
+
+        typedef size_t (*element_hasher)(const void* a);
+
+        /*!
+         * Three-way comparison of a search key (first) with an element of the tree
+         * (second).  context is the container's comparison object, so orderings
+         * can be stateful.
+         */
+        struct Comparator {
+            typedef int (*Fn)(const void* context, const Ptr& key, const Ptr& elt);
+            Comparator(Fn fn, const void* context) : fn(fn), context(context) {}
+            Fn fn;
+            const void* context;
+            int operator () (const Ptr& key, const Ptr& elt) const { return fn(context, key, elt); }
+        };
 
         struct Empty { };
+
+        /*!
+         * The result of an insert that left the tree as it was.
+         */
+        struct Unchanged { };
+
+        /*!
+         * The result of a removal that left a subtree one level shorter, or empty if
+         * node is null.
+         */
+        struct Shrunk {
+            Ptr node;
+        };
     
         struct Leaf1 {
             private: Leaf1() : a(Ptr::DUMMY) {} public:
@@ -46,6 +83,12 @@ namespace heist {
                 : a(other.a)
             {
             }
+            Leaf1(Leaf1&& other)
+                : a(std::move(other.a))
+            {
+            }
+            Leaf1& operator = (const Leaf1& other) = default;
+            Leaf1& operator = (Leaf1&& other) = default;
             Leaf1(const Ptr& a)
                 : a(a)
             {
@@ -59,6 +102,12 @@ namespace heist {
                 : a(other.a), b(other.b)
             {
             }
+            Leaf2(Leaf2&& other)
+                : a(std::move(other.a)), b(std::move(other.b))
+            {
+            }
+            Leaf2& operator = (const Leaf2& other) = default;
+            Leaf2& operator = (Leaf2&& other) = default;
             Leaf2(const Ptr& a, const Ptr& b)
                 : a(a), b(b)
             {
@@ -79,7 +128,7 @@ namespace heist {
             int operator()(const Node3& n3) const {return 5;}
         };
     
-        struct Node {
+        struct Node : arena_pooled {
             Node(
                 boost::variant<
                     Leaf1,
@@ -87,7 +136,21 @@ namespace heist {
                     boost::recursive_wrapper<Node2>,
                     boost::recursive_wrapper<Node3>
                 > n
-            ) : n(n) {}
+            ) : n(std::move(n)), hash(0) {}
+            Node(const Node& other)
+                : n(other.n), hash(other.hash.load(std::memory_order_relaxed)) {}
+            Node(Node&& other)
+                : n(std::move(other.n)), hash(other.hash.load(std::memory_order_relaxed)) {}
+            Node& operator = (const Node& other) {
+                n = other.n;
+                hash.store(other.hash.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                return *this;
+            }
+            Node& operator = (Node&& other) {
+                n = std::move(other.n);
+                hash.store(other.hash.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                return *this;
+            }
     
             boost::variant<
                 Leaf1,
@@ -95,6 +158,13 @@ namespace heist {
                 boost::recursive_wrapper<Node2>,
                 boost::recursive_wrapper<Node3>
             > n;
+
+            /*!
+             * The cached content_hash() of this subtree, or 0 if it hasn't been worked
+             * out yet.  Nodes never change, so it's written at most once (racing
+             * writers write the same value) and copied along with the node.
+             */
+            mutable std::atomic<size_t> hash;
             
             int getNoOfIndices() const
             {
@@ -103,23 +173,89 @@ namespace heist {
     
             /*!
              * The result of inserting into a node: Either the new node, or the
-             * overflow (as a Node2) if it doesn't fit.
+             * overflow (as a Node2) if it doesn't fit, or Unchanged, or Shrunk if an
+             * element was removed.
              */
             typedef boost::variant<
                 boost::recursive_wrapper<Node>,
-                boost::recursive_wrapper<Node2>
+                boost::recursive_wrapper<Node2>,
+                Unchanged,
+                Shrunk
             > InsertResult;
+
+            /*!
+             * Decides what to store given the existing element equal to the key being
+             * inserted, or NULL if there is none.  Returning a null Ptr or the
+             * existing element leaves the tree unchanged, and returning removal()
+             * removes the existing element.
+             */
+            typedef std::function<Ptr(const Ptr* existing)> Merge;
     
             InsertResult insert(const Comparator& compare, const Ptr& a) const;
+            InsertResult insert(const Comparator& compare, const Ptr& key, const Merge& merge) const;
     
             iterator begin() const;
             iterator end() const;
             boost::optional<iterator> lower_bound(const Comparator& compare, const Ptr& a) const;
             boost::optional<iterator> find(const Comparator& compare, const Ptr& a) const;
+
+            /*!
+             * The element equal to a, or NULL.  Unlike find(), it doesn't record the
+             * path, so it doesn't allocate.
+             */
+            const Ptr* search(const Comparator& compare, const Ptr& a) const;
+
+            /*!
+             * Build a tree of exactly the same shape with every element replaced by
+             * f(element).  f must preserve the ordering.  Subtrees down to the given
+             * depth are built concurrently, so f must be thread-safe if it's > 0.
+             */
+            Node map(const std::function<Ptr(const Ptr&)>& f, int parallel_depth) const;
+
+            /*!
+             * Copy this node and everything under it that's owned by an arena,
+             * sharing the subtrees that aren't.  copy makes a copy of an element.
+             * Must be called with the arena suspended.
+             */
+            Node promote(const std::function<Ptr(const Ptr&)>& copy) const;
+
+            /*!
+             * Call elt for each element in this node and node for each child node,
+             * descending into the child if node returns true.
+             */
+            void walk(const std::function<bool(const Node&)>& node,
+                      const std::function<void(const Ptr&)>& elt) const;
+
+            /*!
+             * Bytes allocated for this node's payload outside the Node itself.
+             */
+            size_t payload_bytes() const;
+
+            /*!
+             * Copy this node with its elements and children replaced by their interned
+             * (canonical) equivalents.  Must be called with intern_locker() held.
+             */
+            Node intern(const intern_traits& traits) const;
+
+            /*!
+             * True if this node and other have the same kind, elements and children, by
+             * pointer identity.
+             */
+            bool identical(const Node& other) const;
+
+            /*!
+             * Hash of the elements in this subtree that doesn't depend on the shape of
+             * the tree, so equal contents always hash the same.  It's cached in each
+             * node, so after the first call, only nodes created since are visited.
+             * hash_of must be the same for every tree of a given element type, which
+             * set ensures by always using impl::content_hasher_of.
+             */
+            size_t content_hash(element_hasher hash_of) const;
         };
     
         struct Position {
             Position(const Node& node, int ix) : node(node), ix(ix) {}
+            Position(Node&& node, int ix) : node(std::move(node)), ix(ix) {}
             Node node;
             int ix;
         };
@@ -143,12 +279,18 @@ namespace heist {
             boost::optional<iterator> move(int dir) const;
         };
     
-        struct Node2 {
+        struct Node2 : pooled {
             private: Node2() : p(Ptr::DUMMY), a(Ptr::DUMMY), q(Ptr::DUMMY) {} public:
             Node2(const Node2& other)
                 : p(other.p), a(other.a), q(other.q)
             {
             }
+            Node2(Node2&& other)
+                : p(std::move(other.p)), a(std::move(other.a)), q(std::move(other.q))
+            {
+            }
+            Node2& operator = (const Node2& other) = default;
+            Node2& operator = (Node2&& other) = default;
             Node2(const Ptr& p, const Ptr& a, const Ptr& q)
                 : p(p), a(a), q(q)
             {
@@ -158,12 +300,19 @@ namespace heist {
             Ptr q;
         };
     
-        struct Node3 {
+        struct Node3 : pooled {
             private: Node3() : p(Ptr::DUMMY), a(Ptr::DUMMY), q(Ptr::DUMMY), b(Ptr::DUMMY), r(Ptr::DUMMY) {} public:
             Node3(const Node3& other)
                 : p(other.p), a(other.a), q(other.q), b(other.b), r(other.r)
             {
             }
+            Node3(Node3&& other)
+                : p(std::move(other.p)), a(std::move(other.a)), q(std::move(other.q)),
+                  b(std::move(other.b)), r(std::move(other.r))
+            {
+            }
+            Node3& operator = (const Node3& other) = default;
+            Node3& operator = (Node3&& other) = default;
             Node3(const Ptr& p, const Ptr& a, const Ptr& q, const Ptr& b, const Ptr& r)
                 : p(p), a(a), q(q), b(b), r(r)
             {
@@ -175,17 +324,241 @@ namespace heist {
             Ptr r;
         };
     
-        template <class A>
-        int comparator(const Ptr& a0, const Ptr& b0)
+        /*!
+         * Three-way comparison of x and y using operator<, at most twice.  Strings,
+         * pairs and tuples have cheaper overloads: one compare() for a string, and
+         * each field of a pair or tuple compared once.
+         */
+        template <class X, class Y>
+        int compare3(const X& x, const Y& y);
+        template <class C, class T, class Al>
+        int compare3(const std::basic_string<C, T, Al>& x, const std::basic_string<C, T, Al>& y);
+        template <class X1, class X2>
+        int compare3(const std::pair<X1, X2>& x, const std::pair<X1, X2>& y);
+        template <class... Xs>
+        int compare3(const std::tuple<Xs...>& x, const std::tuple<Xs...>& y);
+
+        template <size_t I, size_t N>
+        struct compare3_fields {
+            template <class T>
+            static int apply(const T& x, const T& y) {
+                int c = compare3(std::get<I>(x), std::get<I>(y));
+                return c != 0 ? c : compare3_fields<I + 1, N>::apply(x, y);
+            }
+        };
+
+        template <size_t N>
+        struct compare3_fields<N, N> {
+            template <class T>
+            static int apply(const T&, const T&) { return 0; }
+        };
+
+        template <class X, class Y>
+        int compare3(const X& x, const Y& y)
         {
-            const A& a = *a0.cast_ptr<A>(NULL);
-            const A& b = *b0.cast_ptr<A>(NULL);
-            if (a < b)  return -1; else
-            if (a == b) return 0; else
-                        return 1;
+            if (x < y) return -1; else
+            if (y < x) return 1; else
+                       return 0;
         }
-    
+
+        template <class C, class T, class Al>
+        int compare3(const std::basic_string<C, T, Al>& x, const std::basic_string<C, T, Al>& y)
+        {
+            return x.compare(y);
+        }
+
+        template <class X1, class X2>
+        int compare3(const std::pair<X1, X2>& x, const std::pair<X1, X2>& y)
+        {
+            int c = compare3(x.first, y.first);
+            return c != 0 ? c : compare3(x.second, y.second);
+        }
+
+        template <class... Xs>
+        int compare3(const std::tuple<Xs...>& x, const std::tuple<Xs...>& y)
+        {
+            return compare3_fields<0, sizeof...(Xs)>::apply(x, y);
+        }
+
+        template <class T>
+        struct voider { typedef void type; };
+
+        /*!
+         * Three-way comparison of a key of type Q with an element of type A under
+         * the ordering Compare.  Compare is either a strict weak ordering returning
+         * bool (called at most twice), or a three-way functor returning an int
+         * that is <0, 0 or >0 (called once).  std::less uses compare3().
+         */
+        template <class Compare, class Q, class A, class = void>
+        struct three_way {
+            static int compare(const Compare& c, const Q& key, const A& elt) {
+                if (c(key, elt)) return -1; else
+                if (c(elt, key)) return 1; else
+                                 return 0;
+            }
+        };
+
+        template <class Compare, class Q, class A>
+        struct three_way<Compare, Q, A, typename std::enable_if<!std::is_same<
+                decltype(std::declval<const Compare&>()(std::declval<const Q&>(), std::declval<const A&>())),
+                bool>::value>::type> {
+            static int compare(const Compare& c, const Q& key, const A& elt) {
+                return c(key, elt);
+            }
+        };
+
+        template <class T, class Q, class A>
+        struct three_way<std::less<T>, Q, A, void> {
+            static int compare(const std::less<T>&, const Q& key, const A& elt) {
+                return compare3(key, elt);
+            }
+        };
+
+        template <class Compare, class Q, class A>
+        int compare_ptrs(const void* context, const Ptr& key, const Ptr& elt)
+        {
+            return three_way<Compare, Q, A>::compare(*(const Compare*)context,
+                *key.cast_ptr<Q>(NULL), *elt.cast_ptr<A>(NULL));
+        }
+
+        /*!
+         * The comparator for searching a tree of A with a key of type Q.  It refers
+         * to compare, which must outlive it.
+         */
+        template <class A, class Q, class Compare>
+        Comparator make_comparator(const Compare& compare)
+        {
+            return Comparator(compare_ptrs<Compare, Q, A>, &compare);
+        }
+
+        /*!
+         * True if a key of type Q can be compared with elements of type A directly,
+         * in both directions, i.e. A's ordering is transparent to Q.
+         */
+        template <class A, class Q>
+        struct is_transparent {
+            template <class A2, class Q2>
+            static auto test(int) -> decltype(
+                std::declval<const A2&>() < std::declval<const Q2&>(),
+                std::declval<const Q2&>() < std::declval<const A2&>(),
+                std::true_type());
+            template <class A2, class Q2>
+            static std::false_type test(...);
+            static const bool value = !std::is_same<A, Q>::value && decltype(test<A, Q>(0))::value;
+        };
+
+        /*!
+         * True if a container ordered by Compare can be searched with a key of type
+         * Q: either Compare declares is_transparent, or it's std::less<A> and A is
+         * transparent to Q.
+         */
+        template <class Compare, class A, class Q, class = void>
+        struct is_transparent_for : std::false_type { };
+
+        template <class Compare, class A, class Q>
+        struct is_transparent_for<Compare, A, Q, typename voider<typename Compare::is_transparent>::type>
+            : std::integral_constant<bool, !std::is_same<A, Q>::value> { };
+
+        template <class A, class Q>
+        struct is_transparent_for<std::less<A>, A, Q, void>
+            : std::integral_constant<bool, is_transparent<A, Q>::value> { };
+
         void nullDeleter(void* a0);
+
+        inline size_t hash_combine(size_t seed, size_t h)
+        {
+            return seed ^ (h + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+        }
+
+        /*!
+         * How to intern the elements of a tree.  Its address identifies the element
+         * type in the intern table.
+         */
+        struct intern_traits {
+            size_t (*hash)(const void* a);
+            bool (*equal)(const void* a, const void* b);
+            void* (*copy)(const void* a);
+            void (*del)(void* a);
+        };
+
+        template <class A, class Hash, class Equal>
+        struct interning {
+            static size_t hash(const void* a) { return Hash()(*(const A*)a); }
+            static bool equal(const void* a, const void* b) { return Equal()(*(const A*)a, *(const A*)b); }
+            static void* copy(const void* a) { return new A(*(const A*)a); }
+            static const intern_traits traits;
+        };
+
+        template <class A, class Hash, class Equal>
+        const intern_traits interning<A, Hash, Equal>::traits = {
+            interning<A, Hash, Equal>::hash,
+            interning<A, Hash, Equal>::equal,
+            interning<A, Hash, Equal>::copy,
+            heist::deleter<A>
+        };
+
+        /*!
+         * The locker that all interned trees share, because their nodes can be shared
+         * with any other interned tree.  It also guards the intern table.
+         */
+        const pooled_locker& intern_locker();
+
+        /*!
+         * Spread the bits of an element's hash, so that summing them (see
+         * Node::content_hash) works even for std::hash of an integer, which is the
+         * identity.
+         */
+        inline size_t mix_hash(size_t h)
+        {
+            unsigned long long x = h;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return (size_t)(x ^ (x >> 31));
+        }
+
+        template <class A, class Hash>
+        size_t hash_element(const void* a)
+        {
+            return Hash()(*(const A*)a);
+        }
+
+        /*!
+         * Called by diff() with an element that's only in the first tree (b NULL),
+         * only in the second (a NULL), or in both but not equal.
+         */
+        typedef std::function<void(const Ptr* a, const Ptr* b)> DiffFn;
+
+        /*!
+         * Report the differences between two trees in order.  Subtrees that are
+         * physically shared or have the same content_hash() are skipped without
+         * looking inside them, even if they're at different depths, so a hash
+         * collision hides a difference.  compare orders elements and equal decides if
+         * elements that compare equivalent differ.
+         */
+        void diff(const boost::optional<Node>& a, const boost::optional<Node>& b,
+                  const Comparator& compare, element_hasher hash_of,
+                  bool (*equal)(const void* a, const void* b), const DiffFn& f);
+
+        /*!
+         * A Ptr referring to a search key that it doesn't own.  It has no reference
+         * count, so making one doesn't allocate, but it must never end up in a tree.
+         */
+        inline Ptr borrow(const void* a)
+        {
+            Ptr p;
+            p.value = const_cast<void*>(a);
+            return p;
+        }
+
+        extern const char removal_marker;
+
+        /*!
+         * What a Node::Merge returns to remove the existing element.
+         */
+        inline Ptr removal()
+        {
+            return borrow(&removal_marker);
+        }
     
         /*!
          * Must be called with lock held.
@@ -209,14 +582,46 @@ namespace heist {
         };
     }
 
-    template <class A> class set
+    /*!
+     * The hash that set::content_hash() and set::diff() use for elements of type A.
+     * It's std::hash<A> unless it's specialized.  Tree nodes cache the hash of their
+     * contents, so there's exactly one per element type.
+     */
+    template <class A>
+    struct content_hasher : std::hash<A> { };
+
+    namespace impl {
+        /*!
+         * The hasher for A's content hashes: A::content_hasher if A names one, as
+         * map's entries do, otherwise heist::content_hasher<A>.
+         */
+        template <class A, class = void>
+        struct content_hasher_of {
+            typedef heist::content_hasher<A> type;
+        };
+
+        template <class A>
+        struct content_hasher_of<A, typename voider<typename A::content_hasher>::type> {
+            typedef typename A::content_hasher type;
+        };
+    }
+
+    /*!
+     * Compare is the ordering: either a strict weak ordering like std::less<A>, or
+     * a three-way functor returning an int <0, 0 or >0 so that each node visit costs
+     * one call.  See impl::three_way.
+     */
+    template <class A, class Compare = std::less<A>> class set
     {
+        friend struct impl::access;
+        template <class K2, class A2, class Compare2> friend class map;
     private:
         impl::pooled_locker locker;
+        Compare compare;
         boost::optional<heist::impl::Node> r;
 
-        static set from_list(heist::list<A> xs) {
-            set<A> s;
+        static set from_list(heist::list<A> xs, const Compare& compare) {
+            set s(compare);
             while (xs) {
                 s = s.insert(xs.head());
                 xs = xs.tail();
@@ -226,82 +631,176 @@ namespace heist {
 
     public:
         set() {}
-        set(const heist::list<A>& xs) {
-            *this = from_list(xs);
+        explicit set(const Compare& compare) : compare(compare) {}
+        set(const heist::list<A>& xs, const Compare& compare = Compare()) {
+            *this = from_list(xs, compare);
         }
-        set(std::initializer_list<A> il) {
-            set<A> s;
+        set(std::initializer_list<A> il, const Compare& compare = Compare()) {
+            set s(compare);
             for (auto it = il.begin(); it != il.end(); ++it)
                 s = s.insert(*it);
             *this = s;
         }
-        set(const impl::pooled_locker& locker, boost::optional<heist::impl::Node> r)
-            : locker(*const_cast<impl::pooled_locker*>(&locker))
+        /*!
+         * If r shares nodes with another tree, the caller must hold locker's lock while
+         * making r and calling this.
+         */
+        set(const impl::pooled_locker& locker, boost::optional<heist::impl::Node> r,
+            const Compare& compare)
+            : locker(*const_cast<impl::pooled_locker*>(&locker)),
+              compare(compare),
+              r(std::move(r))
         {
-            this->locker.lock();
-            this->r = r;
-            this->locker.unlock();
         }
-        set(const set<A>& other) : locker(other.locker) {
+        set(const set& other) : locker(other.locker), compare(other.compare) {
             locker.lock();
             this->r = other.r;
             locker.unlock();
         }
-        set<A>& operator = (const set<A>& other) {
+        /*!
+         * Moving takes other's root without locking or touching any reference counts.
+         */
+        set(set&& other) : locker(other.locker), compare(other.compare), r(std::move(other.r)) {
+            other.r = boost::none;
+        }
+        set& operator = (const set& other) {
             locker.lock();
             r = boost::optional<heist::impl::Node>();
             locker.unlock();
             this->locker = other.locker;
+            this->compare = other.compare;
             locker.lock();
             r = other.r;
             locker.unlock();
             return *this;
         }
+        set& operator = (set&& other) {
+            if (this != &other) {
+                if (r) {
+                    locker.lock();
+                    r = boost::optional<heist::impl::Node>();
+                    locker.unlock();
+                }
+                this->locker = other.locker;
+                this->compare = other.compare;
+                r = std::move(other.r);
+                other.r = boost::none;
+            }
+            return *this;
+        }
         ~set() {
-            locker.lock();
-            r = boost::optional<heist::impl::Node>();
-            locker.unlock();
+            if (r) {
+                locker.lock();
+                r = boost::optional<heist::impl::Node>();
+                locker.unlock();
+            }
         }
 
-        static set singleton(const A& x) {
-            return set(set<A>().insert(x));
+    private:
+        /*!
+         * Single-descent insert: merge decides what to store at key's position.
+         */
+        set insert_(heist::impl::Comparator cmp, const heist::impl::Ptr& key,
+                    const heist::impl::Node::Merge& merge) const {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            if (r) {
+                auto result = r.get().insert(cmp, key, merge);
+                if (const heist::impl::Node* newNode = boost::get<heist::impl::Node>(&result))
+                    return set(locker, *newNode, compare);
+                else
+                if (const heist::impl::Node2* overflow = boost::get<heist::impl::Node2>(&result))
+                    return set(locker, heist::impl::Node(*overflow), compare);
+                else
+                if (const heist::impl::Shrunk* shrunk = boost::get<heist::impl::Shrunk>(&result))
+                    return set(locker, shrunk->node.value != NULL
+                                           ? boost::make_optional(*(const heist::impl::Node*)shrunk->node.value)
+                                           : boost::optional<heist::impl::Node>(), compare);
+                else
+                    return *this;
+            }
+            else {
+                heist::impl::Ptr y(merge(NULL));
+                if (y.value != NULL && y.value != &heist::impl::removal_marker)
+                    return set(locker, heist::impl::Node(heist::impl::Leaf1(y)), compare);
+                else
+                    return *this;
+            }
         }
 
+        set insert_new(const heist::impl::Ptr& newPtr) const {
+            return insert_(heist::impl::make_comparator<A, A>(compare), newPtr,
+                           [&newPtr] (const heist::impl::Ptr*) { return newPtr; });
+        }
+
+    public:
+        static set singleton(const A& x, const Compare& compare = Compare()) {
+            return set(compare).insert(x);
+        }
+
+        /*!
+         * The ordering this set was constructed with.
+         */
+        const Compare& key_comp() const { return compare; }
+
         class iterator {
             private:
                 impl::pooled_locker locker;
+                Compare compare;
                 typename heist::impl::iterator it;
             public:
-                iterator(const impl::pooled_locker& locker, const heist::impl::iterator& it) : locker(locker) {
+                iterator(const impl::pooled_locker& locker, const Compare& compare,
+                         const heist::impl::iterator& it) : locker(locker), compare(compare) {
                     this->locker.lock();
                     this->it = it;
                     this->locker.unlock();
                 }
-                iterator(const iterator& other) : locker(other.locker) {
+                iterator(const impl::pooled_locker& locker, const Compare& compare,
+                         heist::impl::iterator&& it)
+                    : locker(locker), compare(compare), it(std::move(it)) {
+                }
+                iterator(const iterator& other) : locker(other.locker), compare(other.compare) {
                     locker.lock();
                     this->it = other.it;
                     locker.unlock();
                 }
+                iterator(iterator&& other) : locker(other.locker), compare(other.compare), it(std::move(other.it)) {
+                }
                 iterator& operator = (const iterator& other) {
                     locker.lock();
                     this->it = heist::impl::iterator();
                     locker.unlock();
                     this->locker = other.locker;
+                    this->compare = other.compare;
                     locker.lock();
                     this->it = other.it;
                     locker.unlock();
                     return *this;
                 }
+                iterator& operator = (iterator&& other) {
+                    if (this != &other) {
+                        if (it.stack) {
+                            locker.lock();
+                            this->it = heist::impl::iterator();
+                            locker.unlock();
+                        }
+                        this->locker = other.locker;
+                        this->compare = other.compare;
+                        this->it = std::move(other.it);
+                    }
+                    return *this;
+                }
                 ~iterator() {
-                    locker.lock();
-                    this->it = heist::impl::iterator();
-                    locker.unlock();
+                    if (it.stack) {
+                        locker.lock();
+                        this->it = heist::impl::iterator();
+                        locker.unlock();
+                    }
                 }
                 boost::optional<iterator> next() const {
                     impl::lock_holder<impl::pooled_locker> lh(locker);
                     auto oit2 = it.next();
                     if (oit2)
-                        return boost::make_optional(set<A>::iterator(locker, oit2.get()));
+                        return boost::make_optional(iterator(locker, compare, std::move(oit2.get())));
                     else
                         return boost::optional<iterator>();
                 }
@@ -309,7 +808,7 @@ namespace heist {
                     impl::lock_holder<impl::pooled_locker> lh(locker);
                     auto oit2 = it.prev();
                     if (oit2)
-                        return boost::make_optional(set<A>::iterator(locker, oit2.get()));
+                        return boost::make_optional(iterator(locker, compare, std::move(oit2.get())));
                     else
                         return boost::optional<iterator>();
                 }
@@ -321,15 +820,73 @@ namespace heist {
                 set remove() const
                 {
                     impl::lock_holder<impl::pooled_locker> lh(locker);
-                    return set(set<A>(locker, it.remove()));
+                    return set(locker, it.remove(), compare);
                 }
         };
 
+    private:
+        template <class Q>
+        boost::optional<iterator> lower_bound_(const Q& pivot) const
+        {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            if (r) {
+                auto oit = r.get().lower_bound(heist::impl::make_comparator<A, Q>(compare),
+                                               heist::impl::borrow(&pivot));
+                if (oit)
+                    return boost::make_optional(iterator(locker, compare, std::move(oit.get())));
+            }
+            return boost::optional<iterator>();
+        }
+
+        template <class Q>
+        boost::optional<iterator> upper_bound_(const Q& pivot) const
+        {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            auto oit = lower_bound_(pivot);
+            if (oit) {
+                auto it = oit.get();
+                return heist::impl::three_way<Compare, Q, A>::compare(compare, pivot, it.get()) < 0
+                    ? it.prev() : oit;
+            }
+            else
+                return end();
+        }
+
+        /*!
+         * The element equal to a, or NULL, without making an iterator.
+         */
+        template <class Q>
+        const A* search_(const Q& a) const
+        {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            if (r) {
+                const heist::impl::Ptr* p = r.get().search(heist::impl::make_comparator<A, Q>(compare),
+                                                           heist::impl::borrow(&a));
+                if (p != NULL)
+                    return (const A*)p->value;
+            }
+            return NULL;
+        }
+
+        template <class Q>
+        boost::optional<iterator> find_(const Q& a) const
+        {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            if (r) {
+                auto oit = r.get().find(heist::impl::make_comparator<A, Q>(compare),
+                                        heist::impl::borrow(&a));
+                if (oit)
+                    return boost::make_optional(iterator(locker, compare, std::move(oit.get())));
+            }
+            return boost::optional<iterator>();
+        }
+
+    public:
         boost::optional<iterator> begin() const
         {
             impl::lock_holder<impl::pooled_locker> lh(locker);
             const impl::pooled_locker& locker = this->locker;
-            return r ? boost::optional<iterator>(iterator(locker, r.get().begin()))
+            return r ? boost::optional<iterator>(iterator(locker, compare, r.get().begin()))
                      : boost::optional<iterator>();
         }
 
@@ -337,7 +894,7 @@ namespace heist {
         {
             impl::lock_holder<impl::pooled_locker> lh(locker);
             const impl::pooled_locker& locker = this->locker;
-            return r ? boost::optional<iterator>(iterator(locker, r.get().end()))
+            return r ? boost::optional<iterator>(iterator(locker, compare, r.get().end()))
                      : boost::optional<iterator>();
         }
 
@@ -347,14 +904,19 @@ namespace heist {
          */
         boost::optional<iterator> lower_bound(const A& pivot) const
         {
-            impl::lock_holder<impl::pooled_locker> lh(locker);
-            if (r) {
-                heist::impl::Ptr elt((void*)&pivot, heist::impl::nullDeleter);
-                auto oit = r.get().lower_bound(heist::impl::comparator<A>, elt);
-                if (oit)
-                    return boost::make_optional(iterator(locker, oit.get()));
-            }
-            return boost::optional<iterator>();
+            return lower_bound_(pivot);
+        }
+
+        /*!
+         * Heterogeneous lower_bound: The pivot can be of any type that A can be
+         * compared with, so no A needs to be constructed.  This needs Compare to
+         * declare is_transparent, or A to be ordered by std::less and operator<.
+         */
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, A, Q>::value, boost::optional<iterator>>::type
+            lower_bound(const Q& pivot) const
+        {
+            return lower_bound_(pivot);
         }
 
         /*!
@@ -363,46 +925,95 @@ namespace heist {
          */
         boost::optional<iterator> upper_bound(const A& pivot) const
         {
-            impl::lock_holder<impl::pooled_locker> lh(locker);
-            auto oit = lower_bound(pivot);
-            if (oit) {
-                auto it = oit.get();
-                return pivot < it.get() ? it.prev() : oit;
-            }
-            else
-                return end();
+            return upper_bound_(pivot);
+        }
+
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, A, Q>::value, boost::optional<iterator>>::type
+            upper_bound(const Q& pivot) const
+        {
+            return upper_bound_(pivot);
         }
 
         boost::optional<iterator> find(const A& a) const
         {
-            impl::lock_holder<impl::pooled_locker> lh(locker);
-            if (r) {
-                heist::impl::Ptr elt((void*)&a, heist::impl::nullDeleter);
-                auto oit = r.get().find(heist::impl::comparator<A>, elt);
-                if (oit)
-                    return boost::make_optional(iterator(locker, oit.get()));
-            }
-            return boost::optional<iterator>();
+            return find_(a);
+        }
+
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, A, Q>::value, boost::optional<iterator>>::type
+            find(const Q& a) const
+        {
+            return find_(a);
         }
 
         bool contains(const A& a) const
         {
-            return (bool)find(a);
+            return search_(a) != NULL;
+        }
+
+        template <class Q>
+        typename std::enable_if<impl::is_transparent_for<Compare, A, Q>::value, bool>::type
+            contains(const Q& a) const
+        {
+            return search_(a) != NULL;
         }
 
         set insert(const A& a) const {
-            impl::lock_holder<impl::pooled_locker> lh(locker);
-            heist::impl::Comparator compare = heist::impl::comparator<A>;
-            heist::impl::Ptr newPtr(new A(a), heist::deleter<A>);
-            if (r) {
-                auto result = r.get().insert(compare, newPtr);
-                if (const heist::impl::Node* newNode = boost::get<heist::impl::Node>(&result))
-                    return set(set<A>(locker, *newNode));
-                else
-                    return set(set<A>(locker, heist::impl::Node(boost::get<heist::impl::Node2>(result))));
-            }
-            else
-                return set(set<A>(locker, heist::impl::Node(heist::impl::Leaf1(newPtr))));
+            return insert_new(heist::impl::Ptr(new A(a), heist::deleter<A>));
+        }
+
+        set insert(A&& a) const {
+            return insert_new(heist::impl::Ptr(new A(std::move(a)), heist::deleter<A>));
+        }
+
+        /*!
+         * Insert an element constructed in place from the specified arguments.
+         */
+        template <class... Args>
+        set emplace(Args&&... args) const {
+            return insert_new(heist::impl::Ptr(new A(std::forward<Args>(args)...), heist::deleter<A>));
+        }
+
+        /*!
+         * Insert, replace or keep the element equal to key in a single descent of the
+         * tree.  f is passed the existing element (or boost::none) and returns the
+         * element to store, or boost::none to leave the set exactly as it is, in
+         * which case no nodes are copied.  The key may be an A or any type that A is
+         * transparently comparable with.
+         */
+        template <class Q, class Fn>
+        set update(const Q& key, const Fn& f) const {
+            return insert_(
+                heist::impl::make_comparator<A, Q>(compare),
+                heist::impl::borrow(&key),
+                [&f] (const heist::impl::Ptr* existing) -> heist::impl::Ptr {
+                    boost::optional<A> oa = existing
+                        ? f(boost::optional<const A&>(*(const A*)existing->value))
+                        : f(boost::optional<const A&>());
+                    return oa ? heist::impl::Ptr(new A(std::move(oa.get())), heist::deleter<A>)
+                              : heist::impl::Ptr();
+                });
+        }
+
+        /*!
+         * Insert, replace or remove the element equal to key in a single descent of
+         * the tree.  f is passed the existing element (or boost::none) and returns the
+         * element to store, or boost::none for there to be none.  The key may be an A
+         * or any type that A is transparently comparable with.
+         */
+        template <class Q, class Fn>
+        set alter(const Q& key, const Fn& f) const {
+            return insert_(
+                heist::impl::make_comparator<A, Q>(compare),
+                heist::impl::borrow(&key),
+                [&f] (const heist::impl::Ptr* existing) -> heist::impl::Ptr {
+                    boost::optional<A> oa = existing
+                        ? f(boost::optional<const A&>(*(const A*)existing->value))
+                        : f(boost::optional<const A&>());
+                    return oa ? heist::impl::Ptr(new A(std::move(oa.get())), heist::deleter<A>)
+                              : heist::impl::removal();
+                });
         }
 
         set remove(const A& a) const {
@@ -411,9 +1022,10 @@ namespace heist {
                            : *this);
         }
 
-        bool operator == (const set<A>& other) const {
-            boost::optional<set<A>::iterator> it1 = begin();
-            boost::optional<set<A>::iterator> it2 = other.begin();
+        bool operator == (const set& other) const {
+            if (identical(other)) return true;
+            boost::optional<iterator> it1 = begin();
+            boost::optional<iterator> it2 = other.begin();
             while (it1 && it2) {
                 if (!(it1.get().get() == it2.get().get())) return false;
                 it1 = it1.get().next();
@@ -422,31 +1034,31 @@ namespace heist {
             return !it1 && !it2;
         }
 
-        bool operator != (const set<A>& other) const {
+        bool operator != (const set& other) const {
             return ! (*this == other);
         }
 
-        bool operator < (const set<A>& other) const {
-            boost::optional<set<A>::iterator> it1 = begin();
-            boost::optional<set<A>::iterator> it2 = other.begin();
+        bool operator < (const set& other) const {
+            boost::optional<iterator> it1 = begin();
+            boost::optional<iterator> it2 = other.begin();
             while (it1 && it2) {
-                if (it1.get().get() < it2.get().get()) return true;
-                if (it2.get().get() < it1.get().get()) return false;
+                int c = heist::impl::three_way<Compare, A, A>::compare(compare, it1.get().get(), it2.get().get());
+                if (c != 0) return c < 0;
                 it1 = it1.get().next();
                 it2 = it2.get().next();
             }
             return (bool)it2;
         }
 
-        bool operator > (const set<A>& other) const {
+        bool operator > (const set& other) const {
             return other < *this;
         }
 
-        bool operator <= (const set<A>& other) const {
+        bool operator <= (const set& other) const {
             return !(*this > other);
         }
 
-        bool operator >= (const set<A>& other) const {
+        bool operator >= (const set& other) const {
             return !(*this < other);
         }
 
@@ -466,7 +1078,7 @@ namespace heist {
 
         template <class B>
         static B foldl(std::function<B(const B&, const A&)> f, B b,
-                boost::optional<typename heist::set<A>::iterator> oit)
+                boost::optional<iterator> oit)
         {
             while (oit) {
                 auto it = oit.get();
@@ -507,13 +1119,120 @@ namespace heist {
                 }, set<B>());
         }
 
+        /*!
+         * Map a function over the set elements in O(N), without any comparisons,
+         * keeping the tree's shape.  f must be strictly monotonic, i.e. a < b must
+         * imply f(a) < f(b) under compareB.  If parallel_depth > 0, the subtrees at the top
+         * parallel_depth levels of the tree are mapped on separate threads, but no more
+         * than std::thread::hardware_concurrency() run at once, counting the caller's;
+         * a subtree that finds none to spare is mapped on its parent's thread.
+         */
+        template <class B, class CompareB = std::less<B>, class Fn>
+        set<B, CompareB> map_monotonic(const Fn& f, int parallel_depth = 0,
+                                       const CompareB& compareB = CompareB()) const {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            if (r)
+                return set<B, CompareB>(impl::pooled_locker(), r.get().map([&f] (const heist::impl::Ptr& a) {
+                        return heist::impl::Ptr(new B(f(*(const A*)a.value)), heist::deleter<B>);
+                    }, parallel_depth), compareB);
+            else
+                return set<B, CompareB>(compareB);
+        }
+
+        /*!
+         * Return this set with all of its nodes and elements that were allocated in
+         * an arena copied to the heap, so it can outlive the arena.  See arena.h.
+         */
+        set promote() const {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            if (r) {
+                impl::region_suspender rs;
+                return set(locker, r.get().promote([] (const heist::impl::Ptr& a) {
+                        return heist::impl::Ptr(new A(*(const A*)a.value), heist::deleter<A>);
+                    }), compare);
+            }
+            else
+                return *this;
+        }
+
+        /*!
+         * Return this set with its elements and nodes replaced by canonical copies
+         * from a global intern table, so that equal elements and equal subtrees of
+         * all interned sets share the same memory.  Elements are hashed with Hash and
+         * compared with Equal.  A set with the same contents as another interned set
+         * built in the same order shares all its nodes with it, so identical() is true
+         * and comparing them is O(1).  Sets with the same contents but differently
+         * shaped trees only share the subtrees they have in common.  Sets derived from
+         * an interned set aren't interned until intern() is called on them.
+         *
+         * The table doesn't keep anything alive.  All interned sets share one locker.
+         */
+        template <class Hash = std::hash<A>, class Equal = std::equal_to<A>>
+        set intern() const {
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            const impl::pooled_locker& il = impl::intern_locker();
+            impl::lock_holder<impl::pooled_locker> ilh(il);
+            if (r) {
+                impl::region_suspender rs;
+                return set(il, r.get().intern(impl::interning<A, Hash, Equal>::traits), compare);
+            }
+            else
+                return set(il, boost::optional<heist::impl::Node>(), compare);
+        }
+
+        /*!
+         * True if this set and other have the same root node, which means they are
+         * equal.  O(1).  Interned sets with the same contents are usually identical.
+         */
+        bool identical(const set& other) const {
+            if (!r || !other.r)
+                return !r && !other.r;
+            impl::lock_holder<impl::pooled_locker> lh(locker);
+            return r.get().identical(other.r.get());
+        }
+
+        /*!
+         * A hash of the set's contents that only depends on what elements it holds,
+         * not on how its tree is shaped, so equal sets always have the same hash, and
+         * sets with different hashes are certainly different.  Each node caches the
+         * hash of its subtree, so only the nodes created since the last call are
+         * visited, which after a single insert or remove is O(log N).  Elements are
+         * hashed with heist::content_hasher<A>.
+         */
+        size_t content_hash() const {
+            return r ? r.get().content_hash(impl::hash_element<A, typename impl::content_hasher_of<A>::type>) : 0;
+        }
+
+        /*!
+         * Call f(inThis, inOther) in order for every element that differs between this
+         * set and other: inThis and inOther are the elements from each set, and one of
+         * them is boost::none if only one set has it.  Subtrees with the same contents
+         * are skipped without looking inside them, using the cached hashes (see
+         * content_hash()) even if they aren't shared, so the cost depends mostly on
+         * the size of the difference.  Elements are taken to be the same if their
+         * hashes and Equal say so.
+         *
+         * The result is probabilistic: Subtrees are skipped when their 64-bit hashes
+         * match, so if two different subtrees' hashes collide, their differences
+         * aren't reported.
+         */
+        template <class Equal = std::equal_to<A>, class Fn>
+        void diff(const set& other, const Fn& f) const {
+            impl::diff(r, other.r, heist::impl::make_comparator<A, A>(compare),
+                impl::hash_element<A, typename impl::content_hasher_of<A>::type>, equal_elements<Equal>,
+                [&f] (const heist::impl::Ptr* a, const heist::impl::Ptr* b) {
+                    f(a != NULL ? boost::optional<const A&>(*(const A*)a->value) : boost::optional<const A&>(),
+                      b != NULL ? boost::optional<const A&>(*(const A*)b->value) : boost::optional<const A&>());
+                });
+        }
+
         /*!
          * Monoidal append = set union.
          */
-        set<A> operator + (const set<A>& other) const
+        set operator + (const set& other) const
         {
-            return other.foldl<set<A>>(
-                [] (const set<A>& s, const A& b) {return s.insert(b);},
+            return other.template foldl<set>(
+                [] (const set& s, const A& b) {return s.insert(b);},
                 *this);
         }
 
@@ -521,17 +1240,17 @@ namespace heist {
          * set difference a - b:  Return the value which is the first set after having removed
          * all the items in the second set from it.
          */
-        set<A> operator - (const set<A>& sb) const
+        set operator - (const set& sb) const
         {
-            return sb.foldl<set<A>>([] (const set<A>& s, const A& b) { return s.remove(b); }, *this);
+            return sb.template foldl<set>([] (const set& s, const A& b) { return s.remove(b); }, *this);
         }
 
         /*!
          * set intersection.
          */
-        set<A> intersection(const set<A>& sb) const
+        set intersection(const set& sb) const
         {
-            set<A> out;
+            set out(compare);
             for (auto oit = begin(); oit; oit = oit.get().next()) {
                 auto elt = oit.get().get();
                 if (sb.contains(elt))
@@ -540,9 +1259,9 @@ namespace heist {
             return out;
         }
 
-        set<A> filter(std::function<bool(const A&)> pred) const
+        set filter(std::function<bool(const A&)> pred) const
         {
-            set<A> out;
+            set out(compare);
             for (auto o_iter = begin(); o_iter; o_iter = o_iter.get().next()) {
                 const auto& value = o_iter.get().get();
                 if (pred(value))
@@ -555,11 +1274,24 @@ namespace heist {
          * True if this set contains any elements.
          */
         operator bool () const { return (bool)begin(); }
+
+    private:
+        template <class Equal>
+        static bool equal_elements(const void* a, const void* b) {
+            return Equal()(*(const A*)a, *(const A*)b);
+        }
     };
 }  // end namespace
 
-template <class A>
-std::ostream& operator << (std::ostream& os, heist::set<A> set) {
+namespace std {
+    template <class A, class Compare>
+    struct hash<heist::set<A, Compare>> {
+        size_t operator () (const heist::set<A, Compare>& s) const { return s.content_hash(); }
+    };
+}
+
+template <class A, class Compare>
+std::ostream& operator << (std::ostream& os, heist::set<A, Compare> set) {
     bool first = true;
     os << "{";
     for (auto fs = set.to_list(); fs; fs = fs.tail()) {
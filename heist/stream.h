@@ -0,0 +1,417 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_STREAM_H_
+#define _HEIST_STREAM_H_
+
+#include <heist/list.h>
+#include <boost/optional.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+namespace heist {
+    template <class A> class stream;
+
+    namespace impl {
+        /*!
+         * Where a stream's elements come from: Each call returns the next one, or
+         * boost::none at the end.  Sources are stateful, and each is only ever pulled
+         * by the one cell that's waiting for it.
+         */
+        template <class A>
+        using stream_source = std::function<boost::optional<A>()>;
+
+        template <class A>
+        struct stream_cell {
+            explicit stream_cell(const std::shared_ptr<stream_source<A>>& src)
+                : done(false), src(src) {}
+            stream_cell(const A& head, const std::shared_ptr<stream_cell>& tail)
+                : done(true), head(head), tail(tail) {}
+            /*!
+             * The end of a stream.
+             */
+            stream_cell() : done(true) {}
+            ~stream_cell() {
+                // Unlink long chains iteratively so we don't use up the stack.
+                std::shared_ptr<stream_cell> t = std::move(tail);
+                while (t && t.use_count() == 1) {
+                    std::shared_ptr<stream_cell> next = std::move(t->tail);
+                    t = std::move(next);
+                }
+            }
+
+            /*!
+             * Pull this cell's element from the source, once.
+             */
+            void force() {
+                if (done.load(std::memory_order_acquire))
+                    return;
+                std::call_once(once, [this] () {
+                    boost::optional<A> oa = (*src)();
+                    if (oa) {
+                        head = std::move(oa);
+                        tail = std::make_shared<stream_cell>(src);
+                    }
+                    src.reset();
+                    done.store(true, std::memory_order_release);
+                });
+            }
+
+            std::atomic<bool> done;
+            std::once_flag once;
+            boost::optional<A> head;        // boost::none if it's the end of the stream
+            std::shared_ptr<stream_cell> tail;
+            std::shared_ptr<stream_source<A>> src;  // Until it's forced
+        };
+    }
+
+    /*!
+     * An immutable lazy list.  Its elements are worked out the first time they're
+     * asked for, and then remembered, so it can be shared and traversed any number
+     * of times, like a list.  It can be infinite.
+     *
+     * map, filter, take, concat_map and zip_with don't do any work until the result
+     * is looked at, and then only as much as is needed for the elements that are.
+     * When they're applied to a stream that nothing else refers to and that hasn't
+     * been looked at yet, such as the result of another of them, they're fused with
+     * it, so
+     *
+     *     xs.map(f).filter(p).map(g).take(10).to_list()
+     *
+     * evaluates f, p and g element by element without allocating any intermediate
+     * cells.  Applied to a stream that's shared, they read its elements through its
+     * cells, so they're only computed once.
+     *
+     * Its cells aren't allocated from arenas.
+     */
+    template <class A>
+    class stream
+    {
+        template <class B> friend class stream;
+        private:
+            typedef impl::stream_cell<A> cell;
+            typedef impl::stream_source<A> source;
+            std::shared_ptr<cell> c;
+
+            explicit stream(const std::shared_ptr<cell>& c) : c(c) {}
+            explicit stream(std::shared_ptr<cell>&& c) : c(std::move(c)) {}
+
+            static stream from_source(source&& src) {
+                return stream(std::make_shared<cell>(std::make_shared<source>(std::move(src))));
+            }
+
+            /*!
+             * Read the elements of a stream through its cells.
+             */
+            struct cursor {
+                stream<A> s;
+                boost::optional<A> operator () () {
+                    if (!s) return boost::optional<A>();
+                    boost::optional<A> a(s.head());
+                    s = s.tail();
+                    return a;
+                }
+            };
+
+            /*!
+             * The source of a stream we're about to consume.  If nothing else can see
+             * its cells, take over its source instead of going through them.
+             */
+            static source source_of(stream&& s) {
+                if (s.c && s.c.use_count() == 1 && !s.c->done.load(std::memory_order_acquire)) {
+                    std::shared_ptr<source> src = std::move(s.c->src);
+                    s.c.reset();
+                    if (src.use_count() == 1)
+                        return std::move(*src);
+                    return [src] () { return (*src)(); };
+                }
+                return source_of(static_cast<const stream&>(s));
+            }
+            static source source_of(const stream& s) {
+                cursor cur = { s };
+                return cur;
+            }
+
+            template <class B, class Fn>
+            struct map_source {
+                impl::stream_source<B> in;
+                Fn f;
+                boost::optional<A> operator () () {
+                    boost::optional<B> ob = in();
+                    return ob ? boost::optional<A>(f(ob.get())) : boost::optional<A>();
+                }
+            };
+
+            template <class Pred>
+            struct filter_source {
+                source in;
+                Pred pred;
+                boost::optional<A> operator () () {
+                    while (true) {
+                        boost::optional<A> oa = in();
+                        if (!oa || pred(oa.get()))
+                            return oa;
+                    }
+                }
+            };
+
+            struct take_source {
+                source in;
+                size_t n;
+                boost::optional<A> operator () () {
+                    if (n == 0) {
+                        in = source();  // Let go of what it refers to
+                        return boost::optional<A>();
+                    }
+                    n--;
+                    return in();
+                }
+            };
+
+            template <class B, class Fn>
+            struct concat_map_source {
+                impl::stream_source<B> outer;
+                Fn f;
+                boost::optional<source> inner;
+                boost::optional<A> operator () () {
+                    while (true) {
+                        if (inner) {
+                            boost::optional<A> oa = inner.get()();
+                            if (oa)
+                                return oa;
+                            inner = boost::none;
+                        }
+                        boost::optional<B> ob = outer();
+                        if (!ob)
+                            return boost::optional<A>();
+                        inner = stream<A>::source_of(f(ob.get()));
+                    }
+                }
+            };
+
+            template <class B, class C, class Fn>
+            struct zip_source {
+                impl::stream_source<B> bs;
+                impl::stream_source<C> cs;
+                Fn f;
+                boost::optional<A> operator () () {
+                    boost::optional<B> ob = bs();
+                    if (!ob) return boost::optional<A>();
+                    boost::optional<C> oc = cs();
+                    if (!oc) return boost::optional<A>();
+                    return boost::optional<A>(f(ob.get(), oc.get()));
+                }
+            };
+
+            template <class Fn>
+            struct iterate_source {
+                boost::optional<A> last;  // The element returned last, or x before the first
+                bool started;
+                Fn f;
+                boost::optional<A> operator () () {
+                    // Apply f only when the next element is asked for.
+                    if (started)
+                        last = f(last.get());
+                    started = true;
+                    return last;
+                }
+            };
+
+        public:
+            typedef A value_type;
+
+            /*!
+             * An empty stream.
+             */
+            stream() {}
+            /*!
+             * A stream with the specified head, followed by tail.
+             */
+            stream(const A& head, const stream& tail)
+                : c(std::make_shared<cell>(head, tail.c ? tail.c : std::make_shared<cell>())) {}
+            /*!
+             * A stream of the elements of a list.
+             */
+            explicit stream(const list<A>& xs) {
+                struct list_source {
+                    list<A> xs;
+                    boost::optional<A> operator () () {
+                        if (!xs) return boost::optional<A>();
+                        boost::optional<A> a(xs.head());
+                        xs = xs.tail();
+                        return a;
+                    }
+                };
+                list_source src = { xs };
+                *this = from_source(src);
+            }
+
+            /*!
+             * A stream of the values returned by next, up to the first boost::none.
+             * next is called at most once per element, as the stream is evaluated.
+             */
+            static stream generate(std::function<boost::optional<A>()> next) {
+                return from_source(std::move(next));
+            }
+
+            /*!
+             * The infinite stream x, f(x), f(f(x)), ...  f is called once for each
+             * element after the first, as it is evaluated.
+             */
+            template <class Fn>
+            static stream iterate(const A& x, const Fn& f) {
+                iterate_source<Fn> src = { boost::optional<A>(x), false, f };
+                return from_source(src);
+            }
+
+            /*!
+             * Check whether this stream is non-empty, evaluating its head if it hasn't
+             * been already.  If it returns true, then it's valid to use head() and
+             * tail().
+             */
+            operator bool() const {
+                if (!c) return false;
+                c->force();
+                return (bool)c->head;
+            }
+
+            /*!
+             * Return the head of this stream.  Caller must ensure that it isn't empty
+             * before calling, by casting to bool.
+             */
+            const A& head() const {
+                c->force();
+                return c->head.get();
+            }
+
+            /*!
+             * Return the tail of this stream, without evaluating any of it.  Caller
+             * must ensure that it isn't empty before calling, by casting to bool.
+             */
+            stream tail() const {
+                c->force();
+                return stream(c->tail);
+            }
+
+            /*!
+             * Map a function over the stream lazily.
+             */
+            template <class Fn>
+            stream<typename std::result_of<Fn(A)>::type> map(const Fn& f) const & {
+                return stream(*this).map(f);
+            }
+            template <class Fn>
+            stream<typename std::result_of<Fn(A)>::type> map(const Fn& f) && {
+                typedef typename std::result_of<Fn(A)>::type B;
+                typename stream<B>::template map_source<A, Fn> src = { source_of(std::move(*this)), f };
+                return stream<B>::from_source(src);
+            }
+
+            /*!
+             * The elements that match the predicate, lazily.
+             */
+            template <class Pred>
+            stream filter(const Pred& pred) const & {
+                return stream(*this).filter(pred);
+            }
+            template <class Pred>
+            stream filter(const Pred& pred) && {
+                filter_source<Pred> src = { source_of(std::move(*this)), pred };
+                return from_source(src);
+            }
+
+            /*!
+             * The first n elements, lazily.  Nothing after them is evaluated.
+             */
+            stream take(size_t n) const & {
+                return stream(*this).take(n);
+            }
+            stream take(size_t n) && {
+                if (n == 0) return stream();
+                take_source src = { source_of(std::move(*this)), n };
+                return from_source(src);
+            }
+
+            /*!
+             * Map each element to a stream, and concatenate them, lazily.
+             */
+            template <class Fn>
+            typename std::result_of<Fn(A)>::type concat_map(const Fn& f) const & {
+                return stream(*this).concat_map(f);
+            }
+            template <class Fn>
+            typename std::result_of<Fn(A)>::type concat_map(const Fn& f) && {
+                typedef typename std::result_of<Fn(A)>::type::value_type B;
+                typename stream<B>::template concat_map_source<A, Fn> src = { source_of(std::move(*this)), f, boost::none };
+                return stream<B>::from_source(src);
+            }
+
+            /*!
+             * Evaluate the whole stream into a list.  If it's a stream that nothing
+             * else refers to, its elements go straight into the list, without being
+             * remembered in the stream's cells.
+             */
+            list<A> to_list() const & {
+                return stream(*this).to_list();
+            }
+            list<A> to_list() && {
+                source src = source_of(std::move(*this));
+                impl::list_builder<A> out;
+                for (boost::optional<A> oa = src(); oa; oa = src())
+                    out.push_back(std::move(oa.get()));
+                return out.finish();
+            }
+
+            template <class B>
+            B foldl(std::function<B(const B&,const A&)> f, B b) const &
+            {
+                return stream(*this).foldl(f, b);
+            }
+            template <class B>
+            B foldl(std::function<B(const B&,const A&)> f, B b) &&
+            {
+                source src = source_of(std::move(*this));
+                for (boost::optional<A> oa = src(); oa; oa = src())
+                    b = f(b, oa.get());
+                return b;
+            }
+
+            /*!
+             * Evaluates the whole stream.
+             */
+            size_t size() const &
+            {
+                return stream(*this).size();
+            }
+            size_t size() &&
+            {
+                source src = source_of(std::move(*this));
+                size_t len = 0;
+                while (src())
+                    len++;
+                return len;
+            }
+
+            template <class B, class C, class Fn>
+            friend stream<typename std::result_of<Fn(B, C)>::type> zip_with(const Fn& f, stream<B> bs, stream<C> cs);
+    };
+
+    /*!
+     * Combine two streams element by element, lazily, up to the end of the shorter.
+     */
+    template <class B, class C, class Fn>
+    stream<typename std::result_of<Fn(B, C)>::type> zip_with(const Fn& f, stream<B> bs, stream<C> cs)
+    {
+        typedef typename std::result_of<Fn(B, C)>::type A;
+        typename stream<A>::template zip_source<B, C, Fn> src = {
+            stream<B>::source_of(std::move(bs)), stream<C>::source_of(std::move(cs)), f };
+        return stream<A>::from_source(src);
+    }
+}
+
+#endif
@@ -7,17 +7,86 @@
 #define _HEIST_SUPPLY_H_
 
 #include <boost/optional.hpp>
+#include <algorithm>
+#include <atomic>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <functional>
+#include <tuple>
+#include <type_traits>
+
+namespace heist {
+    namespace impl {
+        /*!
+         * Fresh ranges for supplies with the default successor that have split until
+         * there's nothing left to split.  Blocks are reserved from a counter shared
+         * by all threads, starting above the range the supplies start with, and each
+         * thread hands its current block out in chunks without synchronizing.
+         */
+        template <class A>
+        struct supply_blocks {
+            static const A TOP = std::numeric_limits<A>::max() / 2 + 1;
+            static const A BLOCK = (A)1 << 20;
+            static const A CHUNK = (A)1 << 16;
+
+            static std::atomic<A> next;
+            static thread_local A cache_next;
+            static thread_local A cache_end;
+
+            /*!
+             * The start of CHUNK values, all greater than above, that nothing else
+             * has been given.
+             */
+            static A chunk(A above)
+            {
+                if (cache_next <= above || cache_end - cache_next < CHUNK) {
+                    cache_next = next.fetch_add(BLOCK, std::memory_order_relaxed);
+                    cache_end = cache_next + BLOCK;
+                }
+                A c = cache_next;
+                cache_next += CHUNK;
+                return c;
+            }
+        };
+
+        template <class A> std::atomic<A> supply_blocks<A>::next(supply_blocks<A>::TOP);
+        template <class A> thread_local A supply_blocks<A>::cache_next = 0;
+        template <class A> thread_local A supply_blocks<A>::cache_end = 0;
+    }
+}
 
 /*!
  * Functional supply of unique values.
+ *
+ * With the default successor and an integral type of at least 64 bits, a supply
+ * is just a range of values that nothing else has: get() is the first, and
+ * split2() divides the rest between the two new supplies, giving the first a
+ * small part and the second everything else.  That makes get() and split2()
+ * lock-free and allocation-free, and the values of the second supply are all
+ * greater than those of the first, which are all greater than get().  Only when a
+ * range has nothing left to split does split2() take a fresh range from
+ * heist::impl::supply_blocks, and then splitting the same supply twice gives
+ * different supplies.  The values they give are still unique and still greater.
+ *
+ * Otherwise values are handed out in order, under a lock, as they're first asked
+ * for.
  */
 template <class A>
 class supply
 {
     private:
+        static const bool RANGED = std::is_integral<A>::value && sizeof(A) >= 8;
+        typedef std::integral_constant<bool, RANGED> ranged;
+        typedef typename std::conditional<RANGED, A, long long>::type range_t;
+        typedef heist::impl::supply_blocks<range_t> blocks;
+        /*!
+         * How many values split2() gives to the first supply.  The second keeps the
+         * rest, so a chain of splits that always keeps the second can go on for a long
+         * time before it needs a fresh range.
+         */
+        static const int FIRST_SPAN = 256;
+
         struct common_t {
             common_t(A nextValue, const std::function<A(A)>& succ) : nextValue(nextValue), succ(succ) {}
             std::recursive_mutex mutex;
@@ -28,23 +97,40 @@ class supply
             boost::optional<A> value;
             boost::optional<std::tuple<supply<A>, supply<A>>> supplies;
         };
-        std::shared_ptr<common_t> common;
+        std::shared_ptr<common_t> common;   // NULL for a range
         std::shared_ptr<state_t> state;
+        range_t lo, hi;                     // A range: lo is the value, and the rest up to hi are ours
 
         supply(const std::shared_ptr<common_t>& common)
           : common(common),
-            state(new state_t) {}
+            state(new state_t),
+            lo(0), hi(0) {}
 
-    public:
-        supply(A init_value, std::function<A(A)> succ = [] (A a) { return a+1; })
-          : common(new common_t(init_value, succ)),
-            state(new state_t) {}
+        supply(range_t lo, range_t hi) : lo(lo), hi(hi) {}
 
-        /*!
-         * Get this supply's unique value, which is always the same for this supply
-         * (no matter how much it is passed around by value).
-         */
-        A get() const
+        void init_locked(A init_value, std::function<A(A)> succ)
+        {
+            common.reset(new common_t(init_value, succ));
+            state.reset(new state_t);
+        }
+
+        bool init_range(const A& init_value, std::true_type)
+        {
+            if (init_value >= blocks::TOP)
+                return false;
+            lo = init_value;
+            hi = blocks::TOP;
+            return true;
+        }
+        bool init_range(const A&, std::false_type) { return false; }
+
+        A get(std::true_type) const
+        {
+            return !common ? lo : get_locked();
+        }
+        A get(std::false_type) const { return get_locked(); }
+
+        A get_locked() const
         {
             common->mutex.lock();
             if (!state->value) {
@@ -56,11 +142,21 @@ class supply
             return value;
         }
 
-        /*!
-         * Split this supply into two new supplies, each of which is different to the
-         * input supply.
-         */
-        std::tuple<supply<A>, supply<A>> split2() const
+        std::tuple<supply<A>, supply<A>> split2(std::true_type) const
+        {
+            if (common)
+                return split2_locked();
+            range_t first = lo + 1, end = hi;
+            if (end - first < 2) {
+                first = blocks::chunk(lo);
+                end = first + blocks::CHUNK;
+            }
+            range_t mid = first + std::min<range_t>((end - first) / 2, FIRST_SPAN);
+            return std::tuple<supply<A>, supply<A>>(supply(first, mid), supply(mid, end));
+        }
+        std::tuple<supply<A>, supply<A>> split2(std::false_type) const { return split2_locked(); }
+
+        std::tuple<supply<A>, supply<A>> split2_locked() const
         {
             using namespace std;
             using namespace boost;
@@ -71,6 +167,36 @@ class supply
             common->mutex.unlock();
             return p;
         }
+
+    public:
+        supply(A init_value) : lo(0), hi(0)
+        {
+            if (!init_range(init_value, ranged()))
+                init_locked(init_value, [] (A a) { return a+1; });
+        }
+
+        supply(A init_value, std::function<A(A)> succ) : lo(0), hi(0)
+        {
+            init_locked(init_value, succ);
+        }
+
+        /*!
+         * Get this supply's unique value, which is always the same for this supply
+         * (no matter how much it is passed around by value).
+         */
+        A get() const
+        {
+            return get(ranged());
+        }
+
+        /*!
+         * Split this supply into two new supplies, each of which is different to the
+         * input supply.
+         */
+        std::tuple<supply<A>, supply<A>> split2() const
+        {
+            return split2(ranged());
+        }
 };
 
 #endif
@@ -0,0 +1,560 @@
+/**
+ * Heist immutable/functional data structure library
+ * Copyright (C) 2016-2017 by Stephen Blackheath
+ * Released under a BSD3 licence
+ */
+#ifndef _HEIST_UNROLLED_LIST_H_
+#define _HEIST_UNROLLED_LIST_H_
+
+#include <heist/node_pool.h>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/optional.hpp>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <list>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <assert.h>
+
+namespace heist {
+    template <class A> class deque;
+
+    namespace impl {
+        /*!
+         * A cell of an unrolled_list: Up to N elements, filled from the end of the
+         * array backwards, followed by the rest of the list.  The slots from first
+         * on hold elements.  The list whose head is at first may claim the free slot
+         * in front of it, so consing onto a list that nobody else has consed onto
+         * fills its head chunk instead of allocating.  The slots never change once
+         * filled, so lists that share a chunk can't see each other's elements.
+         */
+        template <class A, int N>
+        struct unrolled_chunk : pooled {
+            unrolled_chunk(unrolled_chunk* next, int next_ix)
+                : ref_count(0), first(N), next(next), next_ix(next_ix)
+            {
+                if (next != NULL)
+                    next->ref_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            ~unrolled_chunk() {
+                for (int i = first.load(std::memory_order_relaxed); i < N; i++)
+                    slot(i)->~A();
+                // next is released by intrusive_ptr_release, so long lists don't
+                // use up the stack.
+            }
+            A* slot(int i) { return reinterpret_cast<A*>(&slots[i]); }
+            const A* slot(int i) const { return reinterpret_cast<const A*>(&slots[i]); }
+
+            std::atomic<int> ref_count;
+            std::atomic<int> first;
+            unrolled_chunk* next;   // Holds a reference
+            int next_ix;            // Index of the head of the rest of the list in next
+            typename std::aligned_storage<sizeof(A), alignof(A)>::type slots[N];
+
+          private:
+            unrolled_chunk(const unrolled_chunk&) = delete;
+            unrolled_chunk& operator = (const unrolled_chunk&) = delete;
+        };
+
+        template <class A, int N>
+        void intrusive_ptr_add_ref(unrolled_chunk<A, N>* p)
+        {
+            p->ref_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        template <class A, int N>
+        void intrusive_ptr_release(unrolled_chunk<A, N>* p)
+        {
+            while (p != NULL && p->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                unrolled_chunk<A, N>* next = p->next;
+                delete p;
+                p = next;
+            }
+        }
+    }
+
+    /*!
+     * An immutable singly-linked list with the same interface as heist::list, that
+     * stores up to N elements in each cell.  Traversing it touches a fraction of the
+     * memory and takes a fraction of the cache misses, size() and [] skip whole
+     * cells, and there's one allocation and reference count per N elements instead
+     * of per element, as long as each version is only consed onto once.  Consing
+     * onto a version that something else has already consed onto starts a new cell.
+     *
+     * Its cells aren't allocated from arenas.
+     */
+    template <class A, int N = 16>
+    class unrolled_list
+    {
+        static_assert(N > 0, "unrolled_list needs at least one element per cell");
+        template <class B, int M> friend class unrolled_list;
+        template <class B> friend class deque;
+        template <class A2, class B2, class C2, int M>
+        friend unrolled_list<C2, M> zip_with(std::function<C2(const A2&,const B2&)> f,
+                                             unrolled_list<A2, M> as, unrolled_list<B2, M> bs);
+        private:
+            typedef impl::unrolled_chunk<A, N> chunk;
+            boost::intrusive_ptr<chunk> c;
+            int ix;  // Index of the head in c
+
+            unrolled_list(const boost::intrusive_ptr<chunk>& c, int ix) : c(c), ix(ix) {}
+            unrolled_list(boost::intrusive_ptr<chunk>&& c, int ix) : c(std::move(c)), ix(ix) {}
+
+            /*!
+             * A position in a list that borrows from it.
+             */
+            struct cursor {
+                cursor(const chunk* c, int ix) : c(c), ix(ix) {}
+                const chunk* c;
+                int ix;
+                const A& get() const { return *c->slot(ix); }
+                void next() {
+                    if (++ix == N) {
+                        ix = c->next_ix;
+                        c = c->next;
+                    }
+                }
+                bool operator == (const cursor& other) const {
+                    return c == other.c && (c == NULL || ix == other.ix);
+                }
+                operator bool () const { return c != NULL; }
+            };
+            cursor begin() const { return cursor(c.get(), ix); }
+
+            template <class... Args>
+            static unrolled_list make_cons(const unrolled_list& tail, Args&&... args)
+            {
+                chunk* tc = tail.c.get();
+                if (tc != NULL && tail.ix > 0) {
+                    int expected = tail.ix;
+                    if (tc->first.compare_exchange_strong(expected, tail.ix - 1, std::memory_order_acq_rel)) {
+                        // The slot is ours, and until we return, no one else can claim
+                        // the one in front of it.
+                        try {
+                            new (tc->slot(tail.ix - 1)) A(std::forward<Args>(args)...);
+                        }
+                        catch (...) {
+                            tc->first.store(tail.ix, std::memory_order_release);
+                            throw;
+                        }
+                        return unrolled_list(tail.c, tail.ix - 1);
+                    }
+                }
+                boost::intrusive_ptr<chunk> n(new chunk(tc, tail.ix));
+                new (n->slot(N - 1)) A(std::forward<Args>(args)...);
+                n->first.store(N - 1, std::memory_order_relaxed);
+                return unrolled_list(std::move(n), N - 1);
+            }
+
+            /*!
+             * Build a list of the elements in order, consing from the back.
+             */
+            template <class It>
+            static unrolled_list from_reversed(It begin, It end)
+            {
+                unrolled_list out;
+                for (It it = begin; it != end; ++it)
+                    out = make_cons(out, std::move(*it));
+                return out;
+            }
+
+            std::vector<const A*> pointers() const {
+                std::vector<const A*> out;
+                for (cursor cur = begin(); cur; cur.next())
+                    out.push_back(&cur.get());
+                return out;
+            }
+
+        public:
+            typedef A value_type;
+
+            /*!
+             * An empty list.
+             */
+            unrolled_list() : ix(0) {}
+            /*!
+             * construct a list.  Better to use % operator.
+             */
+            unrolled_list(const A& head, const unrolled_list& tail) { *this = make_cons(tail, head); }
+            unrolled_list(A&& head, const unrolled_list& tail) { *this = make_cons(tail, std::move(head)); }
+            /*!
+             * construct a list from a C++11 initializer list.
+             */
+            unrolled_list(std::initializer_list<A> il) : ix(0) {
+                *this = from_reversed(std::reverse_iterator<const A*>(il.end()),
+                                      std::reverse_iterator<const A*>(il.begin()));
+            }
+
+            /*!
+             * Return this list with a new head constructed in place from the specified
+             * arguments.
+             */
+            template <class... Args>
+            unrolled_list emplace_front(Args&&... args) const {
+                return make_cons(*this, std::forward<Args>(args)...);
+            }
+
+            /*!
+             * Check whether this list is non-empty.  If it returns true, then it's valid to
+             * use head() and tail().
+             */
+            inline operator bool() const
+            {
+                return (bool)c;
+            }
+
+            /*!
+             * Return the head of this list.  Caller must ensure that this list isn't
+             * empty before calling, by casting to bool.
+             */
+            const A& head() const {return *c->slot(ix);}
+
+            /*!
+             * Return the tail of this list.  Caller must ensure that this list isn't
+             * empty before calling, by casting to bool.
+             */
+            unrolled_list tail() const {
+                if (ix + 1 < N)
+                    return unrolled_list(c, ix + 1);
+                else
+                    return unrolled_list(boost::intrusive_ptr<chunk>(c->next), c->next_ix);
+            }
+
+            bool operator == (const unrolled_list& other) const {
+                cursor one = begin();
+                cursor two = other.begin();
+                // Stop early at a shared tail.
+                while (!(one == two) && one && two) {
+                    if (!(one.get() == two.get())) return false;
+                    one.next();
+                    two.next();
+                }
+                return one == two;
+            }
+
+            bool operator != (const unrolled_list& other) const {
+                return !(*this == other);
+            }
+
+            bool operator < (const unrolled_list& other) const {
+                cursor one = begin();
+                cursor two = other.begin();
+                while (!(one == two) && one && two) {
+                    if (one.get() < two.get()) return true;
+                    if (two.get() < one.get()) return false;
+                    one.next();
+                    two.next();
+                }
+                return !(one == two) && (bool)two;
+            }
+
+            bool operator > (const unrolled_list& other) const {
+                return other < *this;
+            }
+
+            bool operator <= (const unrolled_list& other) const {
+                return !(*this > other);
+            }
+
+            bool operator >= (const unrolled_list& other) const {
+                return !(*this < other);
+            }
+
+            /*!
+             * O(ix / N).
+             */
+            A operator [] (int ix) const {
+                const chunk* p = c.get();
+                int i = this->ix;
+                while (ix >= N - i) {
+                    ix -= N - i;
+                    i = p->next_ix;
+                    p = p->next;
+                }
+                return *p->slot(i + ix);
+            };
+
+            /*!
+             * Its cells never come from an arena, so this list is returned unchanged.
+             */
+            unrolled_list promote() const
+            {
+                return *this;
+            }
+
+            /*!
+             * O(N / chunk size).
+             */
+            size_t size() const
+            {
+                size_t len = 0;
+                int i = ix;
+                for (const chunk* p = c.get(); p != NULL; p = p->next) {
+                    len += N - i;
+                    i = p->next_ix;
+                }
+                return len;
+            }
+
+            /*!
+             * Map a function over the list, producing a new list of modified values.
+             */
+            template <class Fn>
+            unrolled_list<typename std::result_of<Fn(A)>::type, N> map(const Fn& f) const {
+                typedef typename std::result_of<Fn(A)>::type B;
+                std::vector<B> out;
+                for (cursor cur = begin(); cur; cur.next())
+                    out.push_back(f(cur.get()));
+                return unrolled_list<B, N>::from_reversed(out.rbegin(), out.rend());
+            }
+
+            unrolled_list filter(std::function<bool(const A&)> pred) const
+            {
+                std::vector<const A*> ys;
+                for (cursor cur = begin(); cur; cur.next())
+                    if (pred(cur.get()))
+                        ys.push_back(&cur.get());
+                unrolled_list out;
+                for (auto it = ys.rbegin(); it != ys.rend(); ++it)
+                    out = make_cons(out, **it);
+                return out;
+            }
+
+            unrolled_list reverse() const
+            {
+                unrolled_list acc;
+                for (cursor cur = begin(); cur; cur.next())
+                    acc = make_cons(acc, cur.get());
+                return acc;
+            }
+
+            /*!
+             * Map then concat.
+             */
+            template <class Fn>
+            typename std::result_of<Fn(A)>::type concat_map(const Fn& f) const {
+                return concat(this->map(f));
+            }
+
+            /*!
+             * Map A's to optional Bs, then take the defined values.
+             */
+            template <class Fn>
+            unrolled_list<typename std::result_of<Fn(A)>::type::value_type, N>
+                    map_optional(const Fn& f) const {
+                typedef typename std::result_of<Fn(A)>::type::value_type B;
+                std::vector<B> out;
+                for (cursor cur = begin(); cur; cur.next()) {
+                    boost::optional<B> ob = f(cur.get());
+                    if (ob)
+                        out.push_back(std::move(ob.get()));
+                }
+                return unrolled_list<B, N>::from_reversed(out.rbegin(), out.rend());
+            }
+
+            std::tuple<unrolled_list, unrolled_list> split_at(int i) const {
+                std::vector<const A*> fst;
+                unrolled_list xs = *this;
+                while (i > 0 && xs.c) {
+                    fst.push_back(&xs.head());
+                    i--;
+                    if (xs.ix + 1 < N)
+                        xs.ix++;
+                    else
+                        xs = xs.tail();
+                }
+                unrolled_list out;
+                for (auto it = fst.rbegin(); it != fst.rend(); ++it)
+                    out = make_cons(out, **it);
+                return std::tuple<unrolled_list, unrolled_list>(out, xs);
+            }
+
+            unrolled_list intersperse(A x) const {
+                std::vector<const A*> xs = pointers();
+                unrolled_list out;
+                for (auto it = xs.rbegin(); it != xs.rend(); ++it) {
+                    if (it != xs.rbegin())
+                        out = make_cons(out, x);
+                    out = make_cons(out, **it);
+                }
+                return out;
+            }
+
+            bool any(std::function<bool(const A&)> pred) const {
+                for (cursor cur = begin(); cur; cur.next())
+                    if (pred(cur.get())) return true;
+                return false;
+            }
+
+            std::list<A> to_std_list() const {
+                std::list<A> out;
+                for (cursor cur = begin(); cur; cur.next())
+                    out.push_back(cur.get());
+                return out;
+            }
+
+            bool contains(const A& a) const
+            {
+                for (cursor cur = begin(); cur; cur.next())
+                    if (cur.get() == a)
+                        return true;
+                return false;
+            }
+
+            template <class B>
+            B foldl(std::function<B(const B&,const A&)> f, B b) const
+            {
+                for (cursor cur = begin(); cur; cur.next())
+                    b = f(b, cur.get());
+                return b;
+            }
+
+            template <class B>
+            B foldr(std::function<B(const A&,const B&)> f, B b) const
+            {
+                std::vector<const A*> xs = pointers();
+                for (auto it = xs.rbegin(); it != xs.rend(); ++it)
+                    b = f(**it, b);
+                return b;
+            }
+
+            /*!
+             * Fold a non-empty set with no initial value.
+             */
+            A foldl1(std::function<A(const A&, const A&)> f) const
+            {
+                assert(*this);
+                return this->tail().foldl(f, this->head());
+            }
+
+            /*!
+             * Fold a non-empty set with no initial value.
+             */
+            A foldr1(std::function<A(const A&, const A&)> f) const
+            {
+                assert(*this);
+                return this->tail().foldr(f, this->head());
+            }
+
+            /*!
+             * Return the lists of items from xs that do and do not match the predicate,
+             * respectively.
+             */
+            std::tuple<unrolled_list, unrolled_list> partition(std::function<bool(const A&)> pred) const
+            {
+                std::vector<const A*> ins, outs;
+                for (cursor cur = begin(); cur; cur.next())
+                    (pred(cur.get()) ? ins : outs).push_back(&cur.get());
+                unrolled_list in, out;
+                for (auto it = ins.rbegin(); it != ins.rend(); ++it)
+                    in = make_cons(in, **it);
+                for (auto it = outs.rbegin(); it != outs.rend(); ++it)
+                    out = make_cons(out, **it);
+                return std::make_tuple(in, out);
+            }
+
+            /*!
+             * Append other to this list, sharing other.
+             */
+            unrolled_list append(const unrolled_list& other) const
+            {
+                std::vector<const A*> xs = pointers();
+                unrolled_list out = other;
+                for (auto it = xs.rbegin(); it != xs.rend(); ++it)
+                    out = make_cons(out, **it);
+                return out;
+            }
+    };
+
+    /*!
+     * Operator synonym for list constructor - right-associative.
+     */
+    template <class A, int N>
+    inline unrolled_list<A, N> operator %= (const A& x, const unrolled_list<A, N>& xs)
+    {
+        return unrolled_list<A, N>(x, xs);
+    }
+
+    template <class A, int N>
+    inline unrolled_list<A, N> operator %= (A&& x, const unrolled_list<A, N>& xs)
+    {
+        return unrolled_list<A, N>(std::move(x), xs);
+    }
+
+    template <class A, int N>
+    unrolled_list<A, N> operator + (const unrolled_list<A, N>& one, const unrolled_list<A, N>& tother)
+    {
+        return one.append(tother);
+    }
+
+    template <class A, int N>
+    std::ostream& operator << (std::ostream& os, const unrolled_list<A, N>& xs0) {
+        os << "[";
+        unrolled_list<A, N> xs(xs0);
+        while (xs) {
+            os << xs.head();
+            xs = xs.tail();
+            if (xs) os << ",";
+        }
+        os << "]";
+        return os;
+    }
+
+    /*!
+     * Concatenate the list of lists into a single list.
+     */
+    template <class A, int N, int M>
+    unrolled_list<A, M> concat(const unrolled_list<unrolled_list<A, M>, N>& lists) {
+        return lists.template foldr<unrolled_list<A, M>>(
+            [] (const unrolled_list<A, M>& a, const unrolled_list<A, M>& b) {
+                return a + b;
+            }, unrolled_list<A, M>());
+    }
+
+    /*!
+     * Filter the defined values and put them into the output list.
+     */
+    template <class A, int N>
+    unrolled_list<A, N> cat_optional(const unrolled_list<boost::optional<A>, N>& xs) {
+        return xs.map_optional([] (const boost::optional<A>& oa) { return oa; });
+    }
+
+    template <class A, class B, class C, int N>
+    unrolled_list<C, N> zip_with(std::function<C(const A&,const B&)> f,
+                                 unrolled_list<A, N> as, unrolled_list<B, N> bs)
+    {
+        std::vector<C> cs;
+        while (as && bs) {
+            cs.push_back(f(as.head(), bs.head()));
+            as = as.tail();
+            bs = bs.tail();
+        }
+        return unrolled_list<C, N>::from_reversed(cs.rbegin(), cs.rend());
+    }
+
+    template <class A, class B, int N>
+    std::tuple<unrolled_list<A, N>, unrolled_list<B, N>> unzip(const unrolled_list<std::tuple<A, B>, N>& tuples)
+    {
+        return std::make_tuple(
+                tuples.map([] (const std::tuple<A,B>& t) {return std::get<0>(t);}),
+                tuples.map([] (const std::tuple<A,B>& t) {return std::get<1>(t);})
+            );
+    }
+
+    template <class A, class B, class C, int N>
+    std::tuple<unrolled_list<A, N>, unrolled_list<B, N>, unrolled_list<C, N>> unzip3(
+        const unrolled_list<std::tuple<A, B, C>, N>& tuples)
+    {
+        return std::make_tuple(
+                tuples.map([] (const std::tuple<A,B,C>& t) {return std::get<0>(t);}),
+                tuples.map([] (const std::tuple<A,B,C>& t) {return std::get<1>(t);}),
+                tuples.map([] (const std::tuple<A,B,C>& t) {return std::get<2>(t);})
+            );
+    }
+}
+
+#endif